@@ -0,0 +1,57 @@
+#include <thread>
+#include "capture_source.h"
+
+video_streamer::frame_pacer::frame_pacer(double fps): m_period(
+		fps > 0 ? std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / fps))
+				: std::chrono::steady_clock::duration::zero()
+), m_next_frame(std::chrono::steady_clock::now()) {
+}
+
+std::chrono::steady_clock::time_point video_streamer::frame_pacer::wait() {
+	auto now = std::chrono::steady_clock::now();
+	if (m_period == std::chrono::steady_clock::duration::zero()) {
+		return now;
+	}
+	if (m_next_frame > now) {
+		std::this_thread::sleep_until(m_next_frame);
+	} else if (now - m_next_frame > 4 * m_period) {
+		// Don't burst to catch up after a stall, like a camera would drop frames instead
+		m_next_frame = now;
+	}
+	auto due = m_next_frame;
+	m_next_frame += m_period;
+	return due;
+}
+
+video_streamer::jpeg_frame video_streamer::capture_source::make_jpeg(
+		image_buffer buffer, int quality, jpeg_buffer_pool &pool
+) const {
+	yuv422_layout layout;
+	switch (pixel_format()) {
+		case v4l2::format::YUYV:
+			layout = yuv422_layout::YUYV;
+			break;
+		case v4l2::format::YVYU:
+			layout = yuv422_layout::YVYU;
+			break;
+		case v4l2::format::UYVY:
+			layout = yuv422_layout::UYVY;
+			break;
+		case v4l2::format::VYUY:
+			layout = yuv422_layout::VYUY;
+			break;
+		default: {
+			// Frame size doesn't change within a format, so only the first frame has its headers parsed
+			auto geometry = m_jpeg_geometry.load(std::memory_order_relaxed);
+			if (geometry) {
+				return jpeg_frame(std::move(buffer), (int) (geometry >> 32), (int) (geometry & 0xFFFFFFFF));
+			}
+			jpeg_frame frame(std::move(buffer));
+			m_jpeg_geometry.store(
+					((uint64_t) frame.width() << 32) | (uint32_t) frame.height(), std::memory_order_relaxed
+			);
+			return frame;
+		}
+	}
+	return jpeg_frame(buffer, frame_width(), frame_height(), frame_stride(), layout, quality, pool);
+}
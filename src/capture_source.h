@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include "video_streamer.h"
+#include "jpeg_frame.h"
+
+namespace video_streamer {
+	
+	namespace v4l2 {
+		
+		enum class format {
+			UNKNOWN,
+			YVYU,
+			YUYV,
+			VYUY,
+			UYVY,
+			MJPEG,
+			H264
+		};
+		
+	}
+	
+	/*
+	 * Anything producing frames for the streamer: a V4L2 device or a stand-in for load testing.
+	 * read_buffer() is called by a single thread, make_jpeg() by any number of them.
+	 */
+	class capture_source {
+		// Width and height of MJPEG frames (packed into 64 bits), 0 until the first frame of a format
+		mutable std::atomic<uint64_t> m_jpeg_geometry;
+		
+	protected:
+		// Must be called whenever the frame format changes
+		void reset_jpeg_geometry() {
+			m_jpeg_geometry = 0;
+		}
+		
+	public:
+		capture_source(): m_jpeg_geometry(0) {
+		}
+		capture_source(const capture_source&) = delete;
+		virtual ~capture_source() = default;
+		virtual v4l2::format pixel_format() const = 0;
+		virtual int frame_width() const = 0;
+		virtual int frame_height() const = 0;
+		// Bytes per row of packed YUV 4:2:2 frames
+		virtual int frame_stride() const = 0;
+		// Fills in the metadata (index without gaps, sequence and capture timestamp)
+		virtual image_buffer read_buffer(frame_metadata &metadata) = 0;
+		// Buffers the source can hand out at once and how many of them are free now
+		virtual unsigned int buffer_count() const {
+			return 0;
+		}
+		virtual unsigned int queued_buffer_count() const {
+			return 0;
+		}
+		// Wraps an MJPEG buffer or compresses a packed YUV 4:2:2 one into a buffer from the pool
+		jpeg_frame make_jpeg(
+				image_buffer buffer, int quality = 80, jpeg_buffer_pool &pool = jpeg_buffer_pool::instance()
+		) const;
+		
+	};
+	
+	// Paces a source which isn't driven by hardware
+	class frame_pacer final {
+		std::chrono::steady_clock::duration m_period;
+		std::chrono::steady_clock::time_point m_next_frame;
+		
+	public:
+		// 0 frames per second means as fast as possible
+		explicit frame_pacer(double fps);
+		// Sleeps until the next frame is due and returns the moment it was due
+		std::chrono::steady_clock::time_point wait();
+		
+	};
+	
+}
+
+inline std::ostream &operator<<(std::ostream &ostream, video_streamer::v4l2::format format) {
+	static const char *formats[] = { "UNKNOWN", "YVYU", "YUYV", "VYUY", "UYVY", "MJPEG", "H264" };
+	return ostream << formats[(int) format];
+}
@@ -0,0 +1,157 @@
+#include <cerrno>
+#include <cstring>
+#include <condition_variable>
+#include <sys/eventfd.h>
+#include <easylogging++.h>
+#include "event_loop.h"
+
+video_streamer::event_loop_exception::event_loop_exception(
+		std::string message, int errNo
+): m_message(std::move(message)) {
+	if (errNo) {
+		m_message += ": ";
+		m_message += strerror(errNo);
+	}
+	LOG(ERROR) << m_message;
+}
+
+video_streamer::event_loop::event_loop(): m_epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+	m_wakeup_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), m_stopped(false), m_quit(false)
+{
+	if (m_epoll_fd < 0) {
+		throw event_loop_exception("epoll_create1() failed", errno);
+	}
+	if (m_wakeup_fd < 0) {
+		throw event_loop_exception("eventfd() failed", errno);
+	}
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.ptr = nullptr;
+	if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &event) != 0) {
+		throw event_loop_exception("epoll_ctl(EPOLL_CTL_ADD) failed for the wakeup descriptor", errno);
+	}
+	m_thread = std::thread(&event_loop::run, this);
+}
+
+video_streamer::event_loop::~event_loop() {
+	m_quit = true;
+	wakeup();
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+}
+
+void video_streamer::event_loop::add(int fd, uint32_t events, event_handler *handler) {
+	epoll_event event = {};
+	event.events = events;
+	event.data.ptr = handler;
+	if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+		throw event_loop_exception("epoll_ctl(EPOLL_CTL_ADD) failed", errno);
+	}
+}
+
+void video_streamer::event_loop::modify(int fd, uint32_t events, event_handler *handler) {
+	epoll_event event = {};
+	event.events = events;
+	event.data.ptr = handler;
+	if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &event) != 0) {
+		throw event_loop_exception("epoll_ctl(EPOLL_CTL_MOD) failed", errno);
+	}
+}
+
+void video_streamer::event_loop::remove(int fd) {
+	if (epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr) != 0) {
+		LOG(WARNING) << "epoll_ctl(EPOLL_CTL_DEL) failed: " << strerror(errno);
+	}
+}
+
+void video_streamer::event_loop::wakeup() {
+	uint64_t value = 1;
+	if (::write(m_wakeup_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+		LOG(WARNING) << "Unable to wake up the event loop: " << strerror(errno);
+	}
+}
+
+void video_streamer::event_loop::post(std::function<void()> task) {
+	bool need_wakeup;
+	{
+		std::unique_lock<std::mutex> lock(m_tasks_mutex);
+		if (m_stopped) {
+			// Nobody would run the task, and invoke() would wait for it forever
+			lock.unlock();
+			task();
+			return;
+		}
+		need_wakeup = m_tasks.empty();
+		m_tasks.emplace_back(std::move(task));
+	}
+	if (need_wakeup) {
+		wakeup();
+	}
+}
+
+void video_streamer::event_loop::invoke(const std::function<void()> &task) {
+	if (in_loop_thread()) {
+		task();
+		return;
+	}
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool done = false;
+	post([&] {
+		task();
+		std::unique_lock<std::mutex> lock(mutex);
+		done = true;
+		cond.notify_one();
+	});
+	std::unique_lock<std::mutex> lock(mutex);
+	cond.wait(lock, [&done] { return done; });
+}
+
+bool video_streamer::event_loop::in_loop_thread() const {
+	return std::this_thread::get_id() == m_thread.get_id();
+}
+
+void video_streamer::event_loop::run_tasks() {
+	std::vector<std::function<void()>> tasks;
+	{
+		std::unique_lock<std::mutex> lock(m_tasks_mutex);
+		tasks.swap(m_tasks);
+	}
+	for (auto &task : tasks) {
+		task();
+	}
+}
+
+void video_streamer::event_loop::run() {
+	epoll_event events[64];
+	while (!m_quit) {
+		int count = epoll_wait(m_epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+		if (count < 0) {
+			if (errno == EINTR) continue;
+			// Nothing above the loop thread could catch an exception, so stop serving instead of terminating
+			LOG(ERROR) << "epoll_wait() failed, stopping the event loop: " << strerror(errno);
+			m_quit = true;
+			break;
+		}
+		for (int i = 0; i < count; i++) {
+			auto handler = (event_handler*) events[i].data.ptr;
+			if (handler) {
+				handler->handle_events(events[i].events);
+			} else {
+				uint64_t value;
+				while (::read(m_wakeup_fd, &value, sizeof(value)) > 0);
+			}
+		}
+		run_tasks();
+	}
+	// Tasks may post more tasks, the ones posted after this are run by the posting threads
+	while (true) {
+		run_tasks();
+		std::unique_lock<std::mutex> lock(m_tasks_mutex);
+		if (m_tasks.empty()) {
+			m_stopped = true;
+			break;
+		}
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <sys/epoll.h>
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "unique_fd.h"
+
+namespace video_streamer {
+	
+	class event_loop_exception: public std::exception {
+		std::string m_message;
+	
+	public:
+		explicit event_loop_exception(std::string message, int errNo = 0);
+		const char *what() const noexcept override {
+			return m_message.c_str();
+		}
+		
+	};
+	
+	class event_handler {
+	public:
+		virtual ~event_handler() = default;
+		virtual void handle_events(uint32_t events) = 0;
+		
+	};
+	
+	/*
+	 * epoll based reactor with a dedicated thread. File descriptors are served by event_handler objects.
+	 * Tasks posted from other threads are executed on the loop thread in FIFO order after the current
+	 * batch of events, so it is safe to destroy a handler from a posted task. Once the loop has stopped
+	 * (after a fatal epoll error), tasks are executed right away by the thread posting them.
+	 */
+	class event_loop final {
+		posix::unique_fd m_epoll_fd;
+		posix::unique_fd m_wakeup_fd;
+		std::mutex m_tasks_mutex;
+		std::vector<std::function<void()>> m_tasks;
+		// Set by the loop thread once it won't run tasks anymore, guarded by m_tasks_mutex
+		bool m_stopped;
+		std::atomic<bool> m_quit;
+		std::thread m_thread;
+		
+		void run();
+		void run_tasks();
+		void wakeup();
+		
+	public:
+		event_loop();
+		event_loop(const event_loop&) = delete;
+		~event_loop();
+		void add(int fd, uint32_t events, event_handler *handler);
+		void modify(int fd, uint32_t events, event_handler *handler);
+		void remove(int fd);
+		void post(std::function<void()> task);
+		void invoke(const std::function<void()> &task);
+		bool in_loop_thread() const;
+		
+	};
+	
+}
@@ -0,0 +1,89 @@
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <cerrno>
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <easylogging++.h>
+#include "event_loop.h"
+
+INITIALIZE_EASYLOGGINGPP
+
+/*
+ * Checks that tasks posted to an event loop run on its thread and that post() and invoke() neither lose
+ * tasks nor block after the loop has stopped because epoll_wait() failed. A deadlock ends the test
+ * with SIGALRM.
+ */
+
+namespace {
+	
+	std::atomic<bool> fail_epoll_wait(false);
+	
+	bool fail(const char *message) {
+		std::cerr << message << std::endl;
+		return false;
+	}
+	
+	bool test_running_loop() {
+		video_streamer::event_loop loop;
+		std::thread::id task_thread;
+		loop.invoke([&task_thread] {
+			task_thread = std::this_thread::get_id();
+		});
+		if (task_thread == std::this_thread::get_id()) {
+			return fail("invoke() ran the task on the calling thread of a running loop");
+		}
+		return true;
+	}
+	
+	bool test_stopped_loop() {
+		fail_epoll_wait = true;
+		video_streamer::event_loop loop;
+		// The loop thread stops on its first epoll_wait(), tasks posted before or after that must run
+		std::atomic<int> posted(0);
+		for (int i = 0; i < 100; i++) {
+			loop.post([&posted] {
+				posted++;
+			});
+		}
+		bool invoked = false;
+		loop.invoke([&invoked] {
+			invoked = true;
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		invoked = false;
+		loop.invoke([&invoked] {
+			invoked = true;
+		});
+		fail_epoll_wait = false;
+		if (!invoked) {
+			return fail("invoke() returned without running the task on a stopped loop");
+		}
+		if (posted != 100) {
+			return fail("Tasks posted to a stopping loop were lost");
+		}
+		return true;
+	}
+	
+}
+
+extern "C" int epoll_wait(int epfd, epoll_event *events, int maxevents, int timeout) {
+	typedef int (*epoll_wait_function)(int, epoll_event*, int, int);
+	static auto next = (epoll_wait_function) dlsym(RTLD_NEXT, "epoll_wait");
+	if (fail_epoll_wait) {
+		errno = EBADF;
+		return -1;
+	}
+	return next(epfd, events, maxevents, timeout);
+}
+
+int main() {
+	alarm(10);
+	bool ok = test_running_loop();
+	ok = test_stopped_loop() && ok;
+	if (ok) {
+		std::cout << "event_loop OK" << std::endl;
+	}
+	return ok ? 0 : 1;
+}
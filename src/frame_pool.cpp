@@ -0,0 +1,93 @@
+#include <sys/mman.h>
+#include <unistd.h>
+#include <new>
+#include <thread>
+#include "frame_pool.h"
+
+static const size_t cache_line_size = 64;
+static const size_t huge_page_size = 2 * 1024 * 1024;
+
+static size_t round_up(size_t value, size_t alignment) {
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+video_streamer::frame_pool::frame_pool(
+		size_t max_free_buffers
+): m_max_free_buffers(max_free_buffers), m_hugepages(false), m_allocations(0) {
+}
+
+video_streamer::frame_pool &video_streamer::frame_pool::instance() {
+	// Every worker holds a decoded and a processed frame, keep enough of them for all
+	static auto pool = new frame_pool(2 * std::max(std::thread::hardware_concurrency(), 1u) + 2);
+	return *pool;
+}
+
+int video_streamer::frame_pool::aligned_stride(int width, int bytes_per_pixel) {
+	return (int) round_up((size_t) width * bytes_per_pixel, cache_line_size);
+}
+
+uint8_t *video_streamer::frame_pool::allocate(size_t size) {
+	void *data = MAP_FAILED;
+	size_t length = 0;
+#ifdef MAP_HUGETLB
+	if (m_hugepages.load(std::memory_order_relaxed) && size >= huge_page_size / 2) {
+		length = round_up(size, huge_page_size);
+		data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+#endif
+	if (data == MAP_FAILED) {
+		// No huge pages reserved, fall back to regular ones (possibly merged by the kernel)
+		length = round_up(size, (size_t) sysconf(_SC_PAGESIZE));
+		data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (data == MAP_FAILED) {
+			throw std::bad_alloc();
+		}
+#ifdef MADV_HUGEPAGE
+		if (m_hugepages.load(std::memory_order_relaxed)) {
+			madvise(data, length, MADV_HUGEPAGE);
+		}
+#endif
+	}
+	m_allocations.fetch_add(1, std::memory_order_relaxed);
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_mappings[(uint8_t*) data] = mapping { length, size };
+	return (uint8_t*) data;
+}
+
+video_streamer::uncompressed_frame video_streamer::frame_pool::acquire(int width, int height, int bytes_per_pixel) {
+	int stride = aligned_stride(width, bytes_per_pixel);
+	return uncompressed_frame(acquire_buffer((size_t) stride * height), width, height, bytes_per_pixel, stride);
+}
+
+video_streamer::image_buffer video_streamer::frame_pool::acquire_buffer(size_t size) {
+	uint8_t *data = nullptr;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		auto it = m_free_buffers.find(size);
+		if (it != m_free_buffers.end() && !it->second.empty()) {
+			data = it->second.back();
+			it->second.pop_back();
+		}
+	}
+	if (data == nullptr) {
+		data = allocate(size);
+	}
+	return image_buffer(data, size, this);
+}
+
+void video_streamer::frame_pool::release(image_buffer &buffer) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	auto it = m_mappings.find(buffer.data());
+	if (it == m_mappings.end()) {
+		return;
+	}
+	auto &buffers = m_free_buffers[it->second.size];
+	if (buffers.size() < m_max_free_buffers) {
+		buffers.push_back(buffer.data());
+		return;
+	}
+	auto length = it->second.length;
+	m_mappings.erase(it);
+	lock.unlock();
+	munmap(buffer.data(), length);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "video_streamer.h"
+
+namespace video_streamer {
+	
+	/*
+	 * Recycles pixel buffers of uncompressed (and captured) frames, so that decoding a stream of equally sized
+	 * frames doesn't allocate. Buffers are mapped directly (page aligned) and can be backed by huge pages,
+	 * rows are padded to a cache line.
+	 */
+	class frame_pool final: public image_buffer_releaser {
+		struct mapping {
+			size_t length;
+			size_t size;
+		};
+		
+		std::mutex m_mutex;
+		// Free buffers by size, a stream usually has a single geometry
+		std::unordered_map<size_t, std::vector<uint8_t*>> m_free_buffers;
+		std::unordered_map<uint8_t*, mapping> m_mappings;
+		size_t m_max_free_buffers;
+		std::atomic<bool> m_hugepages;
+		std::atomic<uint64_t> m_allocations;
+		
+		uint8_t *allocate(size_t size);
+		
+	public:
+		explicit frame_pool(size_t max_free_buffers);
+		frame_pool(const frame_pool&) = delete;
+		// Never destroyed, frames may outlive any other static object
+		static frame_pool &instance();
+		static int aligned_stride(int width, int bytes_per_pixel);
+		// Tries MAP_HUGETLB first and transparent huge pages next for buffers allocated from now on
+		void set_hugepages(bool enabled) {
+			m_hugepages.store(enabled, std::memory_order_relaxed);
+		}
+		uncompressed_frame acquire(int width, int height, int bytes_per_pixel);
+		// Page aligned buffer of any other kind (e.g. capture buffers), returned to the pool on release
+		image_buffer acquire_buffer(size_t size);
+		void release(image_buffer &buffer) override;
+		uint64_t allocations() const {
+			return m_allocations.load(std::memory_order_relaxed);
+		}
+		
+	};
+	
+}
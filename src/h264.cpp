@@ -0,0 +1,100 @@
+#include <cstring>
+#include "h264.h"
+#include "jpeg_frame.h"
+
+static const uint8_t h264_start_code[] = { 0, 0, 0, 1 };
+
+void video_streamer::for_each_h264_nal(
+		const uint8_t *data, size_t size, const std::function<void(const uint8_t*, size_t)> &callback
+) {
+	auto end = data + size;
+	const uint8_t *unit = nullptr;
+	auto emit = [&](const uint8_t *unit_end) {
+		// Zero bytes before a start code belong to it (a four byte start code or trailing_zero_8bits)
+		while (unit_end > unit && unit_end[-1] == 0) {
+			unit_end--;
+		}
+		if (unit_end > unit) {
+			callback(unit, (size_t) (unit_end - unit));
+		}
+	};
+	auto p = data + 2;
+	while (p < end) {
+		p = (const uint8_t*) memchr(p, 1, (size_t) (end - p));
+		if (p == nullptr) break;
+		if (p[-1] == 0 && p[-2] == 0) {
+			if (unit != nullptr) {
+				emit(p - 2);
+			}
+			unit = p + 1;
+		}
+		p++;
+	}
+	if (unit != nullptr) {
+		emit(end);
+	}
+}
+
+video_streamer::h264_packetizer::h264_packetizer(
+): m_pool(jpeg_buffer_pool::create()), m_key_frames(0), m_delta_frames(0) {
+}
+
+std::shared_ptr<const video_streamer::image_buffer> video_streamer::h264_packetizer::packetize(
+		const image_buffer &buffer, frame_dependency &dependency
+) {
+	bool has_sps = false;
+	bool has_pps = false;
+	bool idr = false;
+	bool picture = false;
+	for_each_h264_nal(buffer.data(), buffer.size(), [&](const uint8_t *nal, size_t size) {
+		switch ((h264_nal_type) (nal[0] & 0x1F)) {
+			case h264_nal_type::SPS:
+				m_sps.assign(nal, nal + size);
+				has_sps = true;
+				break;
+			case h264_nal_type::PPS:
+				m_pps.assign(nal, nal + size);
+				has_pps = true;
+				break;
+			case h264_nal_type::IDR_SLICE:
+				idr = true;
+				picture = true;
+				break;
+			case h264_nal_type::SLICE:
+				picture = true;
+				break;
+			default:
+				break;
+		}
+	});
+	if (!picture) {
+		return nullptr;
+	}
+	// Many encoders send parameter sets only once, when streaming starts
+	size_t prefix_size = 0;
+	if (idr && (!has_sps || !has_pps) && has_parameter_sets()) {
+		prefix_size = 2 * sizeof(h264_start_code) + m_sps.size() + m_pps.size();
+	}
+	auto &pool = *m_pool;
+	size_t capacity = prefix_size + buffer.size();
+	auto data = pool.acquire(capacity);
+	auto p = data;
+	if (prefix_size > 0) {
+		for (auto parameter_set : { &m_sps, &m_pps }) {
+			memcpy(p, h264_start_code, sizeof(h264_start_code));
+			p += sizeof(h264_start_code);
+			memcpy(p, parameter_set->data(), parameter_set->size());
+			p += parameter_set->size();
+		}
+	}
+	memcpy(p, buffer.data(), buffer.size());
+	// Without parameter sets a decoder can't start at this frame, so it isn't a key frame for a new client
+	if (idr && has_parameter_sets()) {
+		dependency = frame_dependency::KEY;
+		m_key_frames++;
+	} else {
+		dependency = frame_dependency::DELTA;
+		m_delta_frames++;
+	}
+	return std::make_shared<image_buffer>(data, prefix_size + buffer.size(), &pool);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "video_streamer.h"
+#include "jpeg_frame.h"
+
+namespace video_streamer {
+	
+	enum class h264_nal_type {
+		SLICE = 1,
+		IDR_SLICE = 5,
+		SEI = 6,
+		SPS = 7,
+		PPS = 8,
+		ACCESS_UNIT_DELIMITER = 9
+	};
+	
+	/*
+	 * Calls the callback for every NAL unit of an Annex B byte stream (units separated by 00 00 01 or
+	 * 00 00 00 01 start codes). Units are passed without their start code and trailing zero bytes.
+	 */
+	void for_each_h264_nal(
+			const uint8_t *data, size_t size, const std::function<void(const uint8_t*, size_t)> &callback
+	);
+	
+	/*
+	 * Turns captured H.264 access units into frames ready to be streamed as they are. Parameter sets are
+	 * remembered and put in front of every IDR access unit which doesn't carry them itself, so that
+	 * a client can start decoding at any key frame. IDR access units which come before the first parameter
+	 * sets are passed as delta frames. Must be called from a single thread.
+	 */
+	class h264_packetizer final {
+		// Copies of access units, kept apart from the buffers of JPEG encoders
+		std::shared_ptr<jpeg_buffer_pool> m_pool;
+		std::vector<uint8_t> m_sps;
+		std::vector<uint8_t> m_pps;
+		uint64_t m_key_frames;
+		uint64_t m_delta_frames;
+		
+	public:
+		h264_packetizer();
+		/*
+		 * Returns a copy of the access unit (capture buffers are given back to the device right away, while
+		 * frames may be kept for late joiners) or nullptr if it has no picture (e.g. parameter sets alone).
+		 */
+		std::shared_ptr<const image_buffer> packetize(const image_buffer &buffer, frame_dependency &dependency);
+		bool has_parameter_sets() const {
+			return !m_sps.empty() && !m_pps.empty();
+		}
+		const jpeg_buffer_pool &pool() const {
+			return *m_pool;
+		}
+		uint64_t key_frames() const {
+			return m_key_frames;
+		}
+		uint64_t delta_frames() const {
+			return m_delta_frames;
+		}
+		
+	};
+	
+}
@@ -1,18 +1,12 @@
+#include <algorithm>
+#include <cstring>
 #include <easylogging++.h>
 #include "jpeg_frame.h"
+#include "frame_pool.h"
 #include "video_streamer.h"
 
-namespace video_streamer {
-	class c_heap_image_buffer_releaser: public image_buffer_releaser {
-	public:
-		void release(image_buffer &buffer) override {
-			free(buffer.data());
-		}
-		
-	};
-}
-
-static video_streamer::c_heap_image_buffer_releaser _c_heap_image_buffer_releaser;
+// Rows passed to libjpeg per call, an iMCU row of 4:2:0 is 16
+static const JDIMENSION scanline_batch_size = 2 * DCTSIZE;
 
 static auto getLibJPEGLogger() {
 	static auto logger = el::Loggers::getLogger("libjpeg");
@@ -29,6 +23,10 @@ video_streamer::libjpeg_exception::libjpeg_exception(jpeg_common_struct *cinfo,
 	}
 }
 
+video_streamer::libjpeg_exception::libjpeg_exception(const char *message): m_messageBuffer() {
+	strncpy(m_messageBuffer, message, sizeof(m_messageBuffer) - 1);
+}
+
 static jpeg_error_mgr *init_jpeg_err(jpeg_error_mgr *err) {
 	err = jpeg_std_error(err);
 	err->error_exit = [](jpeg_common_struct *cinfo) {
@@ -55,16 +53,265 @@ video_streamer::jpeg_decompressor_impl::~jpeg_decompressor_impl() {
 	jpeg_destroy_decompress(this);
 }
 
-video_streamer::jpeg_compressor_impl::jpeg_compressor_impl(): jpeg_compress_struct() {
+// Buffers carry their size class in front of the data, so that recycling doesn't need a lookup
+static const size_t pooled_buffer_header_size = 16;
+static const uint8_t oversized_buffer_class = 0xFF;
+
+video_streamer::jpeg_buffer_pool::jpeg_buffer_pool(): m_typical_size(0), m_allocations(0), m_references(1) {
+}
+
+video_streamer::jpeg_buffer_pool::~jpeg_buffer_pool() {
+	for (auto &size_class : m_classes) {
+		for (auto data : size_class.buffers) {
+			free(data - pooled_buffer_header_size);
+		}
+	}
+}
+
+std::shared_ptr<video_streamer::jpeg_buffer_pool> video_streamer::jpeg_buffer_pool::create() {
+	return std::shared_ptr<jpeg_buffer_pool>(new jpeg_buffer_pool(), [](jpeg_buffer_pool *pool) {
+		pool->unreference();
+	});
+}
+
+video_streamer::jpeg_buffer_pool &video_streamer::jpeg_buffer_pool::instance() {
+	static auto pool = new jpeg_buffer_pool();
+	return *pool;
+}
+
+void video_streamer::jpeg_buffer_pool::unreference() {
+	if (m_references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		delete this;
+	}
+}
+
+uint8_t *video_streamer::jpeg_buffer_pool::acquire(size_t &capacity) {
+	int index = 0;
+	m_references.fetch_add(1, std::memory_order_relaxed);
+	while (index < class_count && ((size_t) 1 << (min_class_bits + index)) < capacity) {
+		index++;
+	}
+	if (index < class_count) {
+		capacity = (size_t) 1 << (min_class_bits + index);
+		std::unique_lock<std::mutex> lock(m_classes[index].mutex);
+		auto &buffers = m_classes[index].buffers;
+		if (!buffers.empty()) {
+			auto data = buffers.back();
+			buffers.pop_back();
+			return data;
+		}
+	}
+	auto base = (uint8_t*) malloc(pooled_buffer_header_size + capacity);
+	if (base == nullptr) {
+		unreference();
+		throw std::bad_alloc();
+	}
+	m_allocations.fetch_add(1, std::memory_order_relaxed);
+	base[0] = index < class_count ? (uint8_t) index : oversized_buffer_class;
+	return base + pooled_buffer_header_size;
+}
+
+void video_streamer::jpeg_buffer_pool::recycle(uint8_t *data) {
+	auto base = data - pooled_buffer_header_size;
+	bool kept = false;
+	if (base[0] != oversized_buffer_class) {
+		std::unique_lock<std::mutex> lock(m_classes[base[0]].mutex);
+		auto &buffers = m_classes[base[0]].buffers;
+		if (buffers.size() < max_free_buffers) {
+			buffers.push_back(data);
+			kept = true;
+		}
+	}
+	if (!kept) {
+		free(base);
+	}
+	unreference();
+}
+
+void video_streamer::jpeg_buffer_pool::learn(size_t size) {
+	// Moving average over the last few frames, a lost update from a concurrent encoder doesn't matter
+	auto typical = m_typical_size.load(std::memory_order_relaxed);
+	m_typical_size.store(typical ? typical - typical / 8 + size / 8 : size, std::memory_order_relaxed);
+}
+
+video_streamer::jpeg_pooled_destination::jpeg_pooled_destination(
+		jpeg_buffer_pool &pool
+): jpeg_destination_mgr(), pool(&pool), buffer(nullptr), capacity(0), size(0) {
+	init_destination = [](j_compress_ptr cinfo) {
+		auto dest = (jpeg_pooled_destination*) cinfo->dest;
+		// An aborted compression leaves its buffer behind, it is simply reused
+		if (dest->buffer == nullptr) {
+			auto typical = dest->pool->typical_size();
+			dest->capacity = typical + typical / 4;
+			dest->buffer = dest->pool->acquire(dest->capacity);
+		}
+		dest->next_output_byte = dest->buffer;
+		dest->free_in_buffer = dest->capacity;
+	};
+	empty_output_buffer = [](j_compress_ptr cinfo) -> boolean {
+		auto dest = (jpeg_pooled_destination*) cinfo->dest;
+		size_t capacity = dest->capacity * 2;
+		auto buffer = dest->pool->acquire(capacity);
+		memcpy(buffer, dest->buffer, dest->capacity);
+		dest->pool->recycle(dest->buffer);
+		dest->next_output_byte = buffer + dest->capacity;
+		dest->free_in_buffer = capacity - dest->capacity;
+		dest->buffer = buffer;
+		dest->capacity = capacity;
+		return true;
+	};
+	term_destination = [](j_compress_ptr cinfo) {
+		auto dest = (jpeg_pooled_destination*) cinfo->dest;
+		dest->size = dest->capacity - dest->free_in_buffer;
+		dest->pool->learn(dest->size);
+	};
+}
+
+video_streamer::jpeg_pooled_destination::~jpeg_pooled_destination() {
+	if (buffer != nullptr) {
+		pool->recycle(buffer);
+	}
+}
+
+void video_streamer::jpeg_pooled_destination::use(jpeg_buffer_pool &pool) {
+	// An aborted compression of another encoder may have left a buffer behind
+	if (&pool != this->pool && buffer != nullptr) {
+		this->pool->recycle(buffer);
+		buffer = nullptr;
+	}
+	this->pool = &pool;
+}
+
+video_streamer::image_buffer video_streamer::jpeg_pooled_destination::take() {
+	image_buffer result(buffer, size, pool);
+	buffer = nullptr;
+	capacity = 0;
+	size = 0;
+	return result;
+}
+
+video_streamer::jpeg_compressor_impl::jpeg_compressor_impl(
+): jpeg_compress_struct(), m_dest(jpeg_buffer_pool::instance()) {
 	err = init_jpeg_err(&m_err);
 	jpeg_create_compress(this);
+	dest = &m_dest;
 }
 
 video_streamer::jpeg_compressor_impl::~jpeg_compressor_impl() {
 	jpeg_destroy_compress(this);
 }
 
-video_streamer::jpeg_frame::jpeg_frame(image_buffer buffer): m_buffer(std::move(buffer)) {
+bool video_streamer::scan_jpeg_geometry(const uint8_t *data, size_t size, int &width, int &height) {
+	if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+		return false;
+	}
+	size_t offset = 2;
+	while (offset + 4 <= size) {
+		if (data[offset] != 0xFF) {
+			return false;
+		}
+		uint8_t marker = data[offset + 1];
+		if (marker == 0xFF) {
+			// Fill byte
+			offset++;
+			continue;
+		}
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+			// Standalone markers
+			offset += 2;
+			continue;
+		}
+		if (marker == 0xD9 || marker == 0xDA) {
+			// EOI or the first scan before any frame header
+			return false;
+		}
+		size_t length = ((size_t) data[offset + 2] << 8) | data[offset + 3];
+		if (length < 2 || offset + 2 + length > size) {
+			return false;
+		}
+		switch (marker) {
+			case 0xC0:
+			case 0xC1:
+			case 0xC2:
+			case 0xC9:
+			case 0xCA:
+				if (length < 8) {
+					return false;
+				}
+				height = (data[offset + 5] << 8) | data[offset + 6];
+				width = (data[offset + 7] << 8) | data[offset + 8];
+				// Zero height means it comes later in a DNL marker
+				return width > 0 && height > 0;
+			case 0xC3:
+			case 0xC5:
+			case 0xC6:
+			case 0xC7:
+			case 0xCB:
+			case 0xCD:
+			case 0xCE:
+			case 0xCF:
+				// Lossless and hierarchical frames aren't supported by libjpeg anyway
+				return false;
+			default:
+				offset += 2 + length;
+		}
+	}
+	return false;
+}
+
+size_t video_streamer::find_jpeg_end(const uint8_t *data, size_t size) {
+	// Some cameras pad the payload with zeroes
+	while (size > 0 && data[size - 1] == 0) {
+		size--;
+	}
+	return size >= 4 && data[size - 2] == 0xFF && data[size - 1] == 0xD9 ? size : 0;
+}
+
+size_t video_streamer::measure_jpeg(const uint8_t *data, size_t size) {
+	if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+		return 0;
+	}
+	size_t offset = 2;
+	while (offset + 2 <= size) {
+		if (data[offset] != 0xFF) {
+			return 0;
+		}
+		uint8_t marker = data[offset + 1];
+		if (marker == 0xFF) {
+			offset++;
+			continue;
+		}
+		if (marker == 0xD9) {
+			return offset + 2;
+		}
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+			offset += 2;
+			continue;
+		}
+		if (offset + 4 > size) {
+			return 0;
+		}
+		size_t length = ((size_t) data[offset + 2] << 8) | data[offset + 3];
+		offset += 2 + length;
+		if (marker != 0xDA) {
+			continue;
+		}
+		// Entropy coded data ends at the first marker other than a stuffed zero or a restart marker
+		while (offset + 1 < size) {
+			if (data[offset] == 0xFF && data[offset + 1] != 0x00 && (data[offset + 1] < 0xD0 || data[offset + 1] > 0xD7)) {
+				break;
+			}
+			offset++;
+		}
+	}
+	return 0;
+}
+
+video_streamer::jpeg_frame::jpeg_frame(image_buffer buffer): m_buffer(std::make_shared<image_buffer>(std::move(buffer))) {
+	if (scan_jpeg_geometry(m_buffer->data(), m_buffer->size(), m_width, m_height)) {
+		return;
+	}
+	// Let libjpeg report what exactly is wrong (or figure out the height from DNL)
 	libjpeg_instance<jpeg_decompressor_impl> decompressor;
 	read_header(decompressor);
 	m_width = decompressor.get()->image_width;
@@ -72,13 +319,22 @@ video_streamer::jpeg_frame::jpeg_frame(image_buffer buffer): m_buffer(std::move(
 	jpeg_abort_decompress(decompressor.get());
 }
 
+video_streamer::jpeg_frame::jpeg_frame(
+		image_buffer buffer, int width, int height
+): m_buffer(std::make_shared<image_buffer>(std::move(buffer))), m_width(width), m_height(height) {
+	auto end = find_jpeg_end(m_buffer->data(), m_buffer->size());
+	if (m_buffer->size() < 2 || m_buffer->data()[0] != 0xFF || m_buffer->data()[1] != 0xD8 || !end) {
+		throw libjpeg_exception("Incomplete JPEG frame (SOI or EOI is missing)");
+	}
+	m_buffer->truncate(end);
+}
+
 video_streamer::image_buffer video_streamer::jpeg_frame::compress_frame(
-		uncompressed_frame& frame, J_COLOR_SPACE color_space, int num_components, int quality
+		uncompressed_frame& frame, J_COLOR_SPACE color_space, int num_components, int quality,
+		jpeg_buffer_pool &pool
 ) {
 	libjpeg_instance<jpeg_compressor_impl> compressor;
-	uint8_t *buffer = nullptr;
-	unsigned long bufferSize = 0;
-	jpeg_mem_dest(compressor.get(), &buffer, &bufferSize);
+	compressor.get()->m_dest.use(pool);
 	compressor.get()->image_width = frame.width();
 	compressor.get()->image_height = frame.height();
 	compressor.get()->in_color_space = color_space;
@@ -86,43 +342,330 @@ video_streamer::image_buffer video_streamer::jpeg_frame::compress_frame(
 	jpeg_set_defaults(compressor.get());
 	jpeg_set_quality(compressor.get(), quality, true);
 	jpeg_start_compress(compressor.get(), true);
-	JSAMPROW ptr[] = {(JSAMPLE *) frame.buffer().data()};
+	// Hand over a whole iMCU row per call
+	JSAMPROW rows[scanline_batch_size];
 	while (compressor.get()->next_scanline < compressor.get()->image_height) {
-		jpeg_write_scanlines(compressor.get(), ptr, 1);
-		ptr[0] += compressor.get()->image_width * 3;
+		auto first = compressor.get()->next_scanline;
+		auto count = std::min<JDIMENSION>(scanline_batch_size, compressor.get()->image_height - first);
+		for (JDIMENSION i = 0; i < count; i++) {
+			rows[i] = frame.row(first + i);
+		}
+		jpeg_write_scanlines(compressor.get(), rows, count);
 	}
 	jpeg_finish_compress(compressor.get());
-	return image_buffer(buffer, bufferSize, &_c_heap_image_buffer_releaser);
+	return compressor.get()->m_dest.take();
 }
 
 video_streamer::jpeg_frame::jpeg_frame(
-		uncompressed_frame& frame, J_COLOR_SPACE color_space, int num_components, int quality
-): m_buffer(compress_frame(frame, color_space, num_components, quality)),
+		uncompressed_frame& frame, J_COLOR_SPACE color_space, int num_components, int quality,
+		jpeg_buffer_pool &pool
+): m_buffer(std::make_shared<image_buffer>(compress_frame(frame, color_space, num_components, quality, pool))),
 	m_width(frame.width()), m_height(frame.height())
 {
 }
 
+video_streamer::image_buffer video_streamer::jpeg_frame::compress_yuv422(
+		const image_buffer &buffer, int width, int height, int stride, yuv422_layout layout, int quality,
+		jpeg_buffer_pool &pool
+) {
+	if (width < 2 || height < 1 || buffer.size() < (size_t) stride * (height - 1) + width * 2) {
+		throw libjpeg_exception("Packed YUV 4:2:2 frame is incomplete");
+	}
+	libjpeg_instance<jpeg_compressor_impl> compressor;
+	auto cinfo = compressor.get();
+	cinfo->m_dest.use(pool);
+	cinfo->image_width = width;
+	cinfo->image_height = height;
+	cinfo->input_components = 3;
+	cinfo->in_color_space = JCS_YCbCr;
+	jpeg_set_defaults(cinfo);
+	jpeg_set_colorspace(cinfo, JCS_YCbCr);
+	cinfo->raw_data_in = true;
+#if JPEG_LIB_VERSION >= 70
+	cinfo->do_fancy_downsampling = false;
+#endif
+	cinfo->comp_info[0].h_samp_factor = 2;
+	cinfo->comp_info[0].v_samp_factor = 1;
+	for (int i = 1; i < 3; i++) {
+		cinfo->comp_info[i].h_samp_factor = 1;
+		cinfo->comp_info[i].v_samp_factor = 1;
+	}
+	jpeg_set_quality(cinfo, quality, true);
+	jpeg_start_compress(cinfo, true);
+	// libjpeg consumes whole MCUs (16x8 luma samples), pad rows by replicating the right edge
+	int even_width = width & ~1;
+	int luma_width = (width + 15) & ~15;
+	int chroma_width = luma_width / 2;
+	static thread_local std::vector<uint8_t> planes;
+	planes.resize((size_t) (luma_width + 2 * chroma_width) * DCTSIZE);
+	JSAMPROW y_rows[DCTSIZE], cb_rows[DCTSIZE], cr_rows[DCTSIZE];
+	for (int i = 0; i < DCTSIZE; i++) {
+		y_rows[i] = planes.data() + (size_t) i * luma_width;
+		cb_rows[i] = planes.data() + (size_t) DCTSIZE * luma_width + (size_t) i * chroma_width;
+		cr_rows[i] = planes.data() + (size_t) DCTSIZE * (luma_width + chroma_width) + (size_t) i * chroma_width;
+	}
+	JSAMPARRAY components[] = { y_rows, cb_rows, cr_rows };
+	while (cinfo->next_scanline < cinfo->image_height) {
+		for (int i = 0; i < DCTSIZE; i++) {
+			int row = std::min((int) cinfo->next_scanline + i, height - 1);
+			deinterleave_yuv422(
+					buffer.data() + (size_t) row * stride, y_rows[i], cb_rows[i], cr_rows[i], even_width, layout
+			);
+			std::fill(y_rows[i] + even_width, y_rows[i] + luma_width, y_rows[i][even_width - 1]);
+			std::fill(cb_rows[i] + even_width / 2, cb_rows[i] + chroma_width, cb_rows[i][even_width / 2 - 1]);
+			std::fill(cr_rows[i] + even_width / 2, cr_rows[i] + chroma_width, cr_rows[i][even_width / 2 - 1]);
+		}
+		jpeg_write_raw_data(cinfo, components, DCTSIZE);
+	}
+	jpeg_finish_compress(cinfo);
+	return cinfo->m_dest.take();
+}
+
+video_streamer::jpeg_frame::jpeg_frame(
+		const image_buffer &buffer, int width, int height, int stride, yuv422_layout layout, int quality,
+		jpeg_buffer_pool &pool
+): m_buffer(std::make_shared<image_buffer>(compress_yuv422(buffer, width, height, stride, layout, quality, pool))),
+	m_width(width), m_height(height)
+{
+}
+
 void video_streamer::jpeg_frame::read_header(video_streamer::libjpeg_instance<jpeg_decompressor_impl>& decompressor) {
-	jpeg_mem_src(decompressor.get(), m_buffer.data(), m_buffer.size());
+	jpeg_mem_src(decompressor.get(), m_buffer->data(), m_buffer->size());
 	if (jpeg_read_header(decompressor.get(), true) != JPEG_HEADER_OK) {
 		throw video_streamer::libjpeg_exception((jpeg_common_struct*) decompressor.get(), false, false);
 	}
 }
 
+video_streamer::jpeg_frame::jpeg_frame(
+		std::shared_ptr<image_buffer> buffer, int width, int height
+): m_buffer(std::move(buffer)), m_width(width), m_height(height) {
+}
+
+video_streamer::image_buffer video_streamer::jpeg_frame::requantize(
+		jpeg_decompress_struct *src, jpeg_compressor_impl *dst, int quality, bool reduce_chroma
+) {
+	auto coefficients = jpeg_read_coefficients(src);
+	jpeg_copy_critical_parameters(src, dst);
+	// Source tables are still owned by the decompressor, remember the standard ones scaled to the quality
+	UINT16 source_tables[NUM_QUANT_TBLS][DCTSIZE2];
+	for (int i = 0; i < NUM_QUANT_TBLS; i++) {
+		if (dst->quant_tbl_ptrs[i] != nullptr) {
+			std::copy_n(dst->quant_tbl_ptrs[i]->quantval, DCTSIZE2, source_tables[i]);
+		}
+	}
+	jpeg_set_quality(dst, quality, true);
+	UINT16 standard_tables[2][DCTSIZE2];
+	for (int i = 0; i < 2; i++) {
+		std::copy_n(dst->quant_tbl_ptrs[i]->quantval, DCTSIZE2, standard_tables[i]);
+	}
+	bool luma_table[NUM_QUANT_TBLS] = {};
+	luma_table[dst->comp_info[0].quant_tbl_no] = true;
+	bool used_table[NUM_QUANT_TBLS] = {};
+	for (int ci = 0; ci < dst->num_components; ci++) {
+		int slot = dst->comp_info[ci].quant_tbl_no;
+		if (used_table[slot]) continue;
+		used_table[slot] = true;
+		if (dst->quant_tbl_ptrs[slot] == nullptr) {
+			dst->quant_tbl_ptrs[slot] = jpeg_alloc_quant_table((j_common_ptr) dst);
+		}
+		auto table = dst->quant_tbl_ptrs[slot];
+		auto &standard = standard_tables[luma_table[slot] ? 0 : 1];
+		for (int k = 0; k < DCTSIZE2; k++) {
+			table->quantval[k] = std::max(source_tables[slot][k], standard[k]);
+		}
+		table->sent_table = false;
+	}
+	for (int ci = 0; ci < dst->num_components; ci++) {
+		auto component = &src->comp_info[ci];
+		auto from = source_tables[component->quant_tbl_no];
+		auto to = dst->quant_tbl_ptrs[component->quant_tbl_no]->quantval;
+		bool chroma = reduce_chroma && ci > 0;
+		/*
+		 * 16.16 fixed point ratio between the old and the new step (never above 1.0, so it doesn't overflow).
+		 * Rounding with a 1/3 dead zone instead of 1/2 compensates the double quantization, which otherwise
+		 * keeps too many small coefficients alive.
+		 */
+		uint32_t scale[DCTSIZE2];
+		for (int k = 0; k < DCTSIZE2; k++) {
+			bool dropped = chroma && (k / DCTSIZE >= DCTSIZE / 2 || k % DCTSIZE >= DCTSIZE / 2);
+			scale[k] = dropped ? 0 : ((uint32_t) from[k] << 16) / to[k];
+		}
+		for (JDIMENSION row = 0; row < component->height_in_blocks; row++) {
+			auto blocks = (*src->mem->access_virt_barray)((j_common_ptr) src, coefficients[ci], row, 1, true);
+			for (JDIMENSION column = 0; column < component->width_in_blocks; column++) {
+				auto &block = blocks[0][column];
+				for (int k = 0; k < DCTSIZE2; k++) {
+					int coefficient = block[k];
+					uint32_t value = ((uint32_t) std::abs(coefficient) * scale[k] + (1 << 16) / 3) >> 16;
+					block[k] = (JCOEF) (coefficient < 0 ? -(int) value : (int) value);
+				}
+			}
+		}
+	}
+	jpeg_write_coefficients(dst, coefficients);
+	jpeg_finish_compress(dst);
+	jpeg_finish_decompress(src);
+	return dst->m_dest.take();
+}
+
+video_streamer::jpeg_frame video_streamer::jpeg_frame::recompress(
+		int quality, bool reduce_chroma, jpeg_buffer_pool &pool
+) {
+	libjpeg_instance<jpeg_decompressor_impl> decompressor;
+	libjpeg_instance<jpeg_compressor_impl> compressor;
+	compressor.get()->m_dest.use(pool);
+	read_header(decompressor);
+	std::shared_ptr<image_buffer> buffer;
+	try {
+		buffer = std::make_shared<image_buffer>(
+				requantize(decompressor.get(), compressor.get(), quality, reduce_chroma)
+		);
+	} catch (...) {
+		jpeg_abort_decompress(decompressor.get());
+		throw;
+	}
+	jpeg_frame result(std::move(buffer), m_width, m_height);
+	result.metadata() = metadata();
+	return result;
+}
+
 video_streamer::uncompressed_frame video_streamer::jpeg_frame::uncompress(
-		J_COLOR_SPACE color_space, int num_components
+		J_COLOR_SPACE color_space, int num_components, int scale_denom
 ) {
 	libjpeg_instance<jpeg_decompressor_impl> decompressor;
 	read_header(decompressor);
 	decompressor.get()->out_color_space = color_space;
 	decompressor.get()->out_color_components = num_components;
-	uncompressed_frame image(width(), height(), 3);
+	decompressor.get()->scale_num = 1;
+	decompressor.get()->scale_denom = scale_denom;
+	jpeg_calc_output_dimensions(decompressor.get());
+	auto image = frame_pool::instance().acquire(
+			decompressor.get()->output_width, decompressor.get()->output_height, 3
+	);
 	jpeg_start_decompress(decompressor.get());
-	JSAMPROW ptr[] = { image.buffer().data() };
-	for (auto i = 0; i < image.height(); i++) {
-		jpeg_read_scanlines(decompressor.get(), ptr, 1);
-		ptr[0] += width() * 3;
+	// libjpeg returns at most rec_outbuf_height rows per call, ask for more anyway to save calls
+	JSAMPROW rows[scanline_batch_size];
+	while (decompressor.get()->output_scanline < decompressor.get()->output_height) {
+		auto first = decompressor.get()->output_scanline;
+		auto count = std::min<JDIMENSION>(scanline_batch_size, decompressor.get()->output_height - first);
+		for (JDIMENSION i = 0; i < count; i++) {
+			rows[i] = image.row(first + i);
+		}
+		jpeg_read_scanlines(decompressor.get(), rows, count);
 	}
 	jpeg_finish_decompress(decompressor.get());
 	return image;
 }
+
+video_streamer::ycbcr_frame video_streamer::jpeg_frame::uncompress_ycbcr() {
+	libjpeg_instance<jpeg_decompressor_impl> decompressor;
+	read_header(decompressor);
+	auto cinfo = decompressor.get();
+	if (cinfo->jpeg_color_space != JCS_YCbCr || cinfo->num_components != 3) {
+		jpeg_abort_decompress(cinfo);
+		throw libjpeg_exception("Only YCbCr JPEG frames can be decoded to planes");
+	}
+	cinfo->out_color_space = JCS_YCbCr;
+	cinfo->raw_data_out = true;
+	// Planes are padded to whole iMCUs, libjpeg always outputs complete blocks
+	int mcu_width = cinfo->max_h_samp_factor * DCTSIZE;
+	int mcu_height = cinfo->max_v_samp_factor * DCTSIZE;
+	int mcu_columns = ((int) cinfo->image_width + mcu_width - 1) / mcu_width;
+	int mcu_rows = ((int) cinfo->image_height + mcu_height - 1) / mcu_height;
+	ycbcr_plane planes[3];
+	size_t offsets[3];
+	size_t size = 0;
+	for (int ci = 0; ci < 3; ci++) {
+		auto component = &cinfo->comp_info[ci];
+		auto &plane = planes[ci];
+		plane.h_subsampling = cinfo->max_h_samp_factor / component->h_samp_factor;
+		plane.v_subsampling = cinfo->max_v_samp_factor / component->v_samp_factor;
+		plane.width = (int) component->downsampled_width;
+		plane.height = (int) component->downsampled_height;
+		plane.stride = mcu_columns * component->h_samp_factor * DCTSIZE;
+		offsets[ci] = size;
+		size += (size_t) plane.stride * mcu_rows * component->v_samp_factor * DCTSIZE;
+	}
+	auto buffer = frame_pool::instance().acquire_buffer(size);
+	for (int ci = 0; ci < 3; ci++) {
+		planes[ci].data = buffer.data() + offsets[ci];
+	}
+	jpeg_start_decompress(cinfo);
+	JSAMPROW rows[3][MAX_SAMP_FACTOR * DCTSIZE];
+	JSAMPARRAY components[] = { rows[0], rows[1], rows[2] };
+	while (cinfo->output_scanline < cinfo->output_height) {
+		int mcu_row = (int) cinfo->output_scanline / mcu_height;
+		for (int ci = 0; ci < 3; ci++) {
+			int row_count = cinfo->comp_info[ci].v_samp_factor * DCTSIZE;
+			for (int i = 0; i < row_count; i++) {
+				rows[ci][i] = planes[ci].row(mcu_row * row_count + i);
+			}
+		}
+		jpeg_read_raw_data(cinfo, components, (JDIMENSION) mcu_height);
+	}
+	jpeg_finish_decompress(cinfo);
+	ycbcr_frame result(std::move(buffer), m_width, m_height, planes[0], planes[1], planes[2]);
+	result.metadata() = metadata();
+	return result;
+}
+
+video_streamer::image_buffer video_streamer::jpeg_frame::compress_ycbcr(
+		const ycbcr_frame &frame, int quality, jpeg_buffer_pool &pool
+) {
+	int max_h_subsampling = 1;
+	int max_v_subsampling = 1;
+	for (int ci = 0; ci < 3; ci++) {
+		max_h_subsampling = std::max(max_h_subsampling, frame.plane(ci).h_subsampling);
+		max_v_subsampling = std::max(max_v_subsampling, frame.plane(ci).v_subsampling);
+	}
+	libjpeg_instance<jpeg_compressor_impl> compressor;
+	auto cinfo = compressor.get();
+	cinfo->m_dest.use(pool);
+	cinfo->image_width = frame.width();
+	cinfo->image_height = frame.height();
+	cinfo->input_components = 3;
+	cinfo->in_color_space = JCS_YCbCr;
+	jpeg_set_defaults(cinfo);
+	jpeg_set_colorspace(cinfo, JCS_YCbCr);
+	cinfo->raw_data_in = true;
+#if JPEG_LIB_VERSION >= 70
+	cinfo->do_fancy_downsampling = false;
+#endif
+	for (int ci = 0; ci < 3; ci++) {
+		auto &plane = frame.plane(ci);
+		if (
+				plane.h_subsampling < 1 || plane.v_subsampling < 1 ||
+				max_h_subsampling % plane.h_subsampling != 0 || max_v_subsampling % plane.v_subsampling != 0 ||
+				max_h_subsampling / plane.h_subsampling > MAX_SAMP_FACTOR ||
+				max_v_subsampling / plane.v_subsampling > MAX_SAMP_FACTOR
+		) {
+			throw libjpeg_exception("Unsupported YCbCr subsampling");
+		}
+		cinfo->comp_info[ci].h_samp_factor = max_h_subsampling / plane.h_subsampling;
+		cinfo->comp_info[ci].v_samp_factor = max_v_subsampling / plane.v_subsampling;
+	}
+	jpeg_set_quality(cinfo, quality, true);
+	jpeg_start_compress(cinfo, true);
+	int mcu_height = cinfo->max_v_samp_factor * DCTSIZE;
+	JSAMPROW rows[3][MAX_SAMP_FACTOR * DCTSIZE];
+	JSAMPARRAY components[] = { rows[0], rows[1], rows[2] };
+	while (cinfo->next_scanline < cinfo->image_height) {
+		int mcu_row = (int) cinfo->next_scanline / mcu_height;
+		for (int ci = 0; ci < 3; ci++) {
+			int row_count = cinfo->comp_info[ci].v_samp_factor * DCTSIZE;
+			for (int i = 0; i < row_count; i++) {
+				rows[ci][i] = frame.plane(ci).row(mcu_row * row_count + i);
+			}
+		}
+		jpeg_write_raw_data(cinfo, components, (JDIMENSION) mcu_height);
+	}
+	jpeg_finish_compress(cinfo);
+	return cinfo->m_dest.take();
+}
+
+video_streamer::jpeg_frame::jpeg_frame(
+		const ycbcr_frame &frame, int quality, jpeg_buffer_pool &pool
+): m_buffer(std::make_shared<image_buffer>(compress_ycbcr(frame, quality, pool))),
+	m_width(frame.width()), m_height(frame.height())
+{
+}
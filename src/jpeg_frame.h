@@ -2,10 +2,12 @@
 
 #include <cstdio>
 #include <jpeglib.h>
+#include <atomic>
 #include <memory>
 #include <vector>
 #include <mutex>
 #include <stdexcept>
+#include "yuv422.h"
 
 namespace video_streamer {
 	class jpeg_frame;
@@ -20,6 +22,7 @@ namespace video_streamer {
 		
 	public:
 		explicit libjpeg_exception(jpeg_common_struct *cinfo, bool logOutput = true, bool abort = true);
+		explicit libjpeg_exception(const char *message);
 		const char *what() const noexcept override {
 			return m_messageBuffer;
 		}
@@ -34,17 +37,157 @@ namespace video_streamer {
 		
 	};
 	
+	/*
+	 * Recycles the buffers of encoded frames. Buffers are grouped into power of two size classes and the pool
+	 * tracks the typical compressed frame size, so an encoder usually gets a buffer large enough for the whole
+	 * frame on the first try and nothing is allocated once the pool is warmed up. The typical size only makes
+	 * sense for a single stream, so every encoder (a camera, a tier) owns a pool of its own.
+	 */
+	class jpeg_buffer_pool final: public image_buffer_releaser {
+		static const int min_class_bits = 12;
+		static const int class_count = 16;
+		static const size_t max_free_buffers = 32;
+		
+		struct size_class {
+			std::mutex mutex;
+			std::vector<uint8_t*> buffers;
+		};
+		
+		size_class m_classes[class_count];
+		std::atomic<size_t> m_typical_size;
+		std::atomic<uint64_t> m_allocations;
+		// The owner and every buffer handed out, frames may outlive the encoder which produced them
+		std::atomic<size_t> m_references;
+		
+		jpeg_buffer_pool();
+		~jpeg_buffer_pool();
+		void unreference();
+		
+	public:
+		jpeg_buffer_pool(const jpeg_buffer_pool&) = delete;
+		// The pool is destroyed once the owner and the last buffer acquired from it are gone
+		static std::shared_ptr<jpeg_buffer_pool> create();
+		// For encoders without a pool of their own, never destroyed
+		static jpeg_buffer_pool &instance();
+		// Returns a buffer of at least the given capacity, which is updated to the actual one
+		uint8_t *acquire(size_t &capacity);
+		void recycle(uint8_t *data);
+		void learn(size_t size);
+		size_t typical_size() const {
+			return m_typical_size.load(std::memory_order_relaxed);
+		}
+		uint64_t allocations() const {
+			return m_allocations.load(std::memory_order_relaxed);
+		}
+		void release(image_buffer &buffer) override {
+			recycle(buffer.data());
+		}
+		
+	};
+	
+	// Destination manager writing into jpeg_buffer_pool buffers instead of malloc'ed ones (like jpeg_mem_dest)
+	struct jpeg_pooled_destination: public jpeg_destination_mgr {
+		jpeg_buffer_pool *pool;
+		uint8_t *buffer;
+		size_t capacity;
+		size_t size;
+		
+		explicit jpeg_pooled_destination(jpeg_buffer_pool &pool);
+		jpeg_pooled_destination(const jpeg_pooled_destination&) = delete;
+		~jpeg_pooled_destination();
+		// Selects the pool of the next compression (codecs are cached and shared by all encoders)
+		void use(jpeg_buffer_pool &pool);
+		// Hands the output of a finished compression over, the buffer is recycled when the image buffer is released
+		image_buffer take();
+		
+	};
+	
 	struct jpeg_compressor_impl: public jpeg_compress_struct {
 		jpeg_error_mgr m_err = {};
+		jpeg_pooled_destination m_dest;
 	
 	public:
 		jpeg_compressor_impl();
 		~jpeg_compressor_impl();
 	};
 	
+	struct libjpeg_cache_stats {
+		uint64_t created;
+		// Codecs taken from the shared pool because the thread had none cached
+		uint64_t shared_hits;
+		// Codecs destroyed because both the thread cache and the shared pool were full
+		uint64_t discarded;
+	};
+	
+	/*
+	 * Checks a codec out of a cache. Every thread keeps a couple of codecs for itself, so the hot path has
+	 * no synchronization at all. Surplus codecs go to a small lock-free pool shared by all threads
+	 * (a fixed array of slots, so there is no ABA problem), anything beyond it is destroyed.
+	 */
 	template<typename T> class libjpeg_instance final {
-		static std::mutex impl_queue_mutex;
-		static std::vector<std::unique_ptr<T>> impl_queue;
+		static const size_t local_cache_size = 2;
+		static const size_t shared_pool_size = 32;
+		
+		struct shared_pool {
+			std::atomic<T*> slots[shared_pool_size];
+			std::atomic<uint64_t> created;
+			std::atomic<uint64_t> shared_hits;
+			std::atomic<uint64_t> discarded;
+			
+			shared_pool(): created(0), shared_hits(0), discarded(0) {
+				for (auto &slot : slots) {
+					slot.store(nullptr, std::memory_order_relaxed);
+				}
+			}
+			~shared_pool() {
+				for (auto &slot : slots) {
+					delete slot.load(std::memory_order_relaxed);
+				}
+			}
+			T *pop() {
+				for (auto &slot : slots) {
+					if (slot.load(std::memory_order_relaxed) == nullptr) continue;
+					auto impl = slot.exchange(nullptr, std::memory_order_acquire);
+					if (impl != nullptr) {
+						shared_hits.fetch_add(1, std::memory_order_relaxed);
+						return impl;
+					}
+				}
+				return nullptr;
+			}
+			void push(T *impl) {
+				for (auto &slot : slots) {
+					T *expected = nullptr;
+					if (slot.compare_exchange_strong(expected, impl, std::memory_order_release)) {
+						return;
+					}
+				}
+				discarded.fetch_add(1, std::memory_order_relaxed);
+				delete impl;
+			}
+		};
+		
+		// Thread caches die before static objects, so the shared pool outlives all of them
+		struct local_cache {
+			T *items[local_cache_size] = {};
+			size_t count = 0;
+			
+			~local_cache() {
+				while (count > 0) {
+					shared().push(items[--count]);
+				}
+			}
+		};
+		
+		static shared_pool &shared() {
+			static shared_pool pool;
+			return pool;
+		}
+		static local_cache &local() {
+			static thread_local local_cache cache;
+			return cache;
+		}
+		
 		std::unique_ptr<T> m_impl;
 		
 	public:
@@ -54,46 +197,98 @@ namespace video_streamer {
 		}
 		~libjpeg_instance() {
 			if (!m_impl) return;
-			std::unique_lock<std::mutex> lock(impl_queue_mutex);
-			impl_queue.emplace_back(std::move(m_impl));
+			auto &cache = local();
+			if (cache.count < local_cache_size) {
+				cache.items[cache.count++] = m_impl.release();
+			} else {
+				shared().push(m_impl.release());
+			}
 		}
 		T *get() {
 			if (!m_impl) {
-				std::unique_lock<std::mutex> lock(impl_queue_mutex);
-				if (impl_queue.empty()) {
-					lock.unlock();
-					m_impl = std::make_unique<T>();
+				auto &cache = local();
+				if (cache.count > 0) {
+					m_impl.reset(cache.items[--cache.count]);
 				} else {
-					m_impl = std::move(impl_queue.back());
-					impl_queue.pop_back();
-					lock.unlock();
+					m_impl.reset(shared().pop());
+					if (!m_impl) {
+						m_impl.reset(new T());
+						shared().created.fetch_add(1, std::memory_order_relaxed);
+					}
 				}
 			}
 			return m_impl.get();
 		}
+		static libjpeg_cache_stats stats() {
+			auto &pool = shared();
+			return libjpeg_cache_stats {
+					pool.created.load(std::memory_order_relaxed),
+					pool.shared_hits.load(std::memory_order_relaxed),
+					pool.discarded.load(std::memory_order_relaxed)
+			};
+		}
 		
 	};
 	
-	template<typename T> std::mutex video_streamer::libjpeg_instance<T>::impl_queue_mutex;
-	template<typename T> std::vector<std::unique_ptr<T>> video_streamer::libjpeg_instance<T>::impl_queue;
+	/*
+	 * Walks JPEG markers up to the frame header (SOF0, SOF1, SOF2 or their arithmetic coded variants)
+	 * without libjpeg. Returns false if there is no SOI, no supported frame header or the size is
+	 * not known from the header.
+	 */
+	bool scan_jpeg_geometry(const uint8_t *data, size_t size, int &width, int &height);
+	// Returns the size of the JPEG data up to and including EOI (ignoring zero padding) or 0 if EOI is missing
+	size_t find_jpeg_end(const uint8_t *data, size_t size);
+	/*
+	 * Returns the size of the JPEG image at the start of the data (e.g. a stream of concatenated images)
+	 * or 0 if it is incomplete. Markers are followed, so embedded thumbnails don't end the image early.
+	 */
+	size_t measure_jpeg(const uint8_t *data, size_t size);
 	
 	class jpeg_frame: public frame {
-		image_buffer m_buffer;
+		std::shared_ptr<image_buffer> m_buffer;
 		int m_width;
 		int m_height;
 		
 		static image_buffer compress_frame(
-				uncompressed_frame& frame, J_COLOR_SPACE color_space, int num_components, int quality
+				uncompressed_frame& frame, J_COLOR_SPACE color_space, int num_components, int quality,
+				jpeg_buffer_pool &pool
+		);
+		static image_buffer compress_yuv422(
+				const image_buffer &buffer, int width, int height, int stride, yuv422_layout layout, int quality,
+				jpeg_buffer_pool &pool
+		);
+		static image_buffer compress_ycbcr(const ycbcr_frame &frame, int quality, jpeg_buffer_pool &pool);
+		static image_buffer requantize(
+				jpeg_decompress_struct *src, jpeg_compressor_impl *dst, int quality, bool reduce_chroma
 		);
 		void read_header(libjpeg_instance<jpeg_decompressor_impl>& decompressor);
+		jpeg_frame(std::shared_ptr<image_buffer> buffer, int width, int height);
 		
 	public:
 		explicit jpeg_frame(image_buffer buffer);
+		// Trusts the geometry (known from earlier frames of the same stream) and only checks SOI and EOI
+		jpeg_frame(image_buffer buffer, int width, int height);
+		// Encoders which produce a stream should pass a pool of their own
 		explicit jpeg_frame(
 				uncompressed_frame& frame,
 				J_COLOR_SPACE color_space,
 				int num_components,
-				int quality = 80
+				int quality = 80,
+				jpeg_buffer_pool &pool = jpeg_buffer_pool::instance()
+		);
+		// Compresses packed 4:2:2 pixels (as captured by V4L2) without converting them to RGB
+		explicit jpeg_frame(
+				const image_buffer &buffer,
+				int width,
+				int height,
+				int stride,
+				yuv422_layout layout,
+				int quality = 80,
+				jpeg_buffer_pool &pool = jpeg_buffer_pool::instance()
+		);
+		// Compresses YCbCr planes (e.g. from uncompress_ycbcr()) keeping their subsampling
+		explicit jpeg_frame(
+				const ycbcr_frame &frame, int quality = 80, jpeg_buffer_pool &pool = jpeg_buffer_pool::instance()
 		);
 		jpeg_frame(jpeg_frame &&frame) = default;
 		int width() const override {
@@ -103,12 +298,30 @@ namespace video_streamer {
 			return m_height;
 		}
 		image_buffer& buffer() override {
-			return m_buffer;
+			return *m_buffer;
 		}
 		const image_buffer& buffer() const override {
+			return *m_buffer;
+		}
+		/*
+		 * The buffer is shared (not copied), so it stays alive until the last holder drops it.
+		 * For captured frames it means the V4L2 buffer is given back to the driver only then.
+		 */
+		std::shared_ptr<const image_buffer> shared_buffer() const {
 			return m_buffer;
 		}
-		uncompressed_frame uncompress(J_COLOR_SPACE color_space, int num_components);
+		// scale_denom of 2, 4 or 8 makes libjpeg downscale in the DCT domain while decoding
+		uncompressed_frame uncompress(J_COLOR_SPACE color_space, int num_components, int scale_denom = 1);
+		// Decodes to planes with libjpeg raw data output, without upsampling chroma or converting to RGB
+		ycbcr_frame uncompress_ycbcr();
+		/*
+		 * Produces a smaller copy of the frame encoded with the given quality. DCT coefficients are
+		 * requantized in place (no IDCT, FDCT or color conversion), so quantization never gets finer
+		 * than in the original. reduce_chroma additionally drops high frequency chroma coefficients.
+		 */
+		jpeg_frame recompress(
+				int quality, bool reduce_chroma = false, jpeg_buffer_pool &pool = jpeg_buffer_pool::instance()
+		);
 		
 	};
 
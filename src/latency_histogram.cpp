@@ -0,0 +1,85 @@
+#include <algorithm>
+#include "latency_histogram.h"
+
+int video_streamer::latency_buckets::index_of(uint64_t value) {
+	if (value < (uint64_t) linear_limit) {
+		return (int) value;
+	}
+	if (value >= ((uint64_t) 1 << max_exponent)) {
+		return count - 1;
+	}
+	int exponent = 63 - __builtin_clzll(value);
+	int shift = exponent - sub_bucket_bits;
+	int mantissa = (int) (value >> shift) - (1 << sub_bucket_bits);
+	return linear_limit + (exponent - sub_bucket_bits - 1) * (1 << sub_bucket_bits) + mantissa;
+}
+
+uint64_t video_streamer::latency_buckets::highest_value_of(int index) {
+	if (index < linear_limit) {
+		return (uint64_t) index;
+	}
+	int exponent = (index - linear_limit) / (1 << sub_bucket_bits) + sub_bucket_bits + 1;
+	uint64_t mantissa = (uint64_t) ((index - linear_limit) % (1 << sub_bucket_bits) + (1 << sub_bucket_bits));
+	int shift = exponent - sub_bucket_bits;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+uint64_t video_streamer::latency_snapshot::percentile(double fraction) const {
+	if (!count) return 0;
+	auto threshold = (uint64_t) (fraction * (double) count + 0.5);
+	if (threshold < 1) threshold = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < latency_buckets::count; i++) {
+		seen += buckets[i];
+		if (seen >= threshold) {
+			return std::min(latency_buckets::highest_value_of(i), max);
+		}
+	}
+	return max;
+}
+
+video_streamer::latency_histogram::latency_histogram(): m_count(0), m_sum(0), m_max(0) {
+	for (auto &bucket : m_buckets) {
+		bucket.store(0, std::memory_order_relaxed);
+	}
+}
+
+void video_streamer::latency_histogram::record(uint64_t microseconds) {
+	m_buckets[latency_buckets::index_of(microseconds)].fetch_add(1, std::memory_order_relaxed);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+	m_sum.fetch_add(microseconds, std::memory_order_relaxed);
+	uint64_t max = m_max.load(std::memory_order_relaxed);
+	while (microseconds > max && !m_max.compare_exchange_weak(max, microseconds, std::memory_order_relaxed));
+}
+
+video_streamer::latency_snapshot video_streamer::latency_snapshot::since(const latency_snapshot &previous) const {
+	latency_snapshot result;
+	result.count = 0;
+	result.max = 0;
+	for (int i = 0; i < latency_buckets::count; i++) {
+		result.buckets[i] = buckets[i] >= previous.buckets[i] ? buckets[i] - previous.buckets[i] : 0;
+		result.count += result.buckets[i];
+		if (result.buckets[i]) {
+			result.max = std::min(latency_buckets::highest_value_of(i), max);
+		}
+	}
+	result.sum = sum >= previous.sum ? sum - previous.sum : 0;
+	return result;
+}
+
+video_streamer::latency_snapshot video_streamer::latency_histogram::snapshot() const {
+	latency_snapshot result;
+	result.count = 0;
+	for (int i = 0; i < latency_buckets::count; i++) {
+		result.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+		result.count += result.buckets[i];
+	}
+	result.sum = m_sum.load(std::memory_order_relaxed);
+	result.max = m_max.load(std::memory_order_relaxed);
+	return result;
+}
+
+std::ostream &operator<<(std::ostream &ostream, const video_streamer::latency_snapshot &snapshot) {
+	return ostream << "p50=" << snapshot.percentile(0.5) << "us p99=" << snapshot.percentile(0.99) <<
+			"us max=" << snapshot.max << "us (" << snapshot.count << " samples)";
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+
+namespace video_streamer {
+	
+	/*
+	 * Log-linear (HDR-style) bucketing of microsecond values: exact below 32 us, then 16 buckets
+	 * per power of two, which keeps relative error under ~6% up to 2^40 us.
+	 */
+	struct latency_buckets {
+		static const int sub_bucket_bits = 4;
+		static const int linear_limit = 2 << sub_bucket_bits;
+		static const int max_exponent = 40;
+		static const int count = linear_limit + (max_exponent - sub_bucket_bits - 1) * (1 << sub_bucket_bits);
+		
+		static int index_of(uint64_t value);
+		static uint64_t highest_value_of(int index);
+	};
+	
+	struct latency_snapshot {
+		std::array<uint64_t, latency_buckets::count> buckets;
+		uint64_t count;
+		uint64_t sum;
+		uint64_t max;
+		
+		// Returns the value (in microseconds) below which the given fraction (0..1) of samples falls
+		uint64_t percentile(double fraction) const;
+		uint64_t mean() const {
+			return count ? sum / count : 0;
+		}
+		// Samples recorded after the previous snapshot of the same histogram was taken.
+		// The maximum is estimated from the highest non-empty bucket.
+		latency_snapshot since(const latency_snapshot &previous) const;
+		
+	};
+	
+	class latency_histogram final {
+		std::array<std::atomic<uint64_t>, latency_buckets::count> m_buckets;
+		std::atomic<uint64_t> m_count;
+		std::atomic<uint64_t> m_sum;
+		std::atomic<uint64_t> m_max;
+	
+	public:
+		latency_histogram();
+		latency_histogram(const latency_histogram&) = delete;
+		
+		void record(uint64_t microseconds);
+		void record(std::chrono::steady_clock::duration duration) {
+			auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+			record((uint64_t) (us > 0 ? us : 0));
+		}
+		void record_since(std::chrono::steady_clock::time_point start) {
+			record(std::chrono::steady_clock::now() - start);
+		}
+		latency_snapshot snapshot() const;
+		
+	};
+	
+}
+
+std::ostream &operator<<(std::ostream &ostream, const video_streamer::latency_snapshot &snapshot);
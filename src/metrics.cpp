@@ -0,0 +1,277 @@
+#include <sched.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <thread>
+#include <easylogging++.h>
+#include "metrics.h"
+#include "video_streamer.h"
+
+video_streamer::sharded_counter::sharded_counter(): m_shard_count(std::max(std::thread::hardware_concurrency(), 1u)) {
+	m_shards = std::unique_ptr<shard[]>(new shard[m_shard_count]);
+	for (unsigned int i = 0; i < m_shard_count; i++) {
+		m_shards[i].value.store(0, std::memory_order_relaxed);
+	}
+}
+
+unsigned int video_streamer::sharded_counter::current_shard() const {
+	int cpu = sched_getcpu();
+	if (cpu < 0) {
+		static thread_local unsigned int thread_shard = (unsigned int) std::hash<std::thread::id>()(
+				std::this_thread::get_id()
+		);
+		return thread_shard % m_shard_count;
+	}
+	return (unsigned int) cpu % m_shard_count;
+}
+
+uint64_t video_streamer::sharded_counter::value() const {
+	uint64_t result = 0;
+	for (unsigned int i = 0; i < m_shard_count; i++) {
+		result += m_shards[i].value.load(std::memory_order_relaxed);
+	}
+	return result;
+}
+
+void video_streamer::metrics_writer::header(const std::string &name, const char *type, const std::string &help) {
+	m_stream << "# HELP " << name << " " << help << "\n";
+	m_stream << "# TYPE " << name << " " << type << "\n";
+}
+
+void video_streamer::metrics_writer::sample(const std::string &name, const std::string &labels, double value) {
+	m_stream << name;
+	if (!labels.empty()) {
+		m_stream << "{" << labels << "}";
+	}
+	m_stream << " " << value << "\n";
+}
+
+void video_streamer::metrics_writer::sample(const std::string &name, const std::string &labels, uint64_t value) {
+	m_stream << name;
+	if (!labels.empty()) {
+		m_stream << "{" << labels << "}";
+	}
+	m_stream << " " << value << "\n";
+}
+
+void video_streamer::metrics_writer::sample(const std::string &name, const std::string &labels, int64_t value) {
+	m_stream << name;
+	if (!labels.empty()) {
+		m_stream << "{" << labels << "}";
+	}
+	m_stream << " " << value << "\n";
+}
+
+void video_streamer::metrics_writer::summary(
+		const std::string &name, const std::string &labels, const latency_snapshot &snapshot
+) {
+	std::string separator = labels.empty() ? "" : ",";
+	sample(name, labels + separator + "quantile=\"0.5\"", (double) snapshot.percentile(0.5) / 1e6);
+	sample(name, labels + separator + "quantile=\"0.99\"", (double) snapshot.percentile(0.99) / 1e6);
+	sample(name, labels + separator + "quantile=\"1\"", (double) snapshot.max / 1e6);
+	sample(name + "_sum", labels, (double) snapshot.sum / 1e6);
+	sample(name + "_count", labels, snapshot.count);
+}
+
+std::string video_streamer::metrics_writer::label(const char *name, const std::string &value) {
+	std::string result(name);
+	result += "=\"";
+	for (char c : value) {
+		switch (c) {
+			case '\\':
+				result += "\\\\";
+				break;
+			case '"':
+				result += "\\\"";
+				break;
+			case '\n':
+				result += "\\n";
+				break;
+			default:
+				result += c;
+		}
+	}
+	result += "\"";
+	return result;
+}
+
+void video_streamer::metrics_registry::add(
+		std::string name, const char *type, std::string help,
+		std::function<void(metrics_writer&, const std::string&)> collect
+) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_entries.push_back(entry { std::move(name), type, std::move(help), std::move(collect) });
+}
+
+void video_streamer::metrics_registry::add_counter(std::string name, std::string help, const sharded_counter &counter) {
+	add(std::move(name), "counter", std::move(help), [&counter](metrics_writer &writer, const std::string &name) {
+		writer.sample(name, "", counter.value());
+	});
+}
+
+void video_streamer::metrics_registry::add_gauge(std::string name, std::string help, std::function<int64_t()> value) {
+	add(std::move(name), "gauge", std::move(help), [value](metrics_writer &writer, const std::string &name) {
+		writer.sample(name, "", value());
+	});
+}
+
+void video_streamer::metrics_registry::write(std::ostream &stream) {
+	metrics_writer writer(stream);
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (auto &entry : m_entries) {
+		writer.header(entry.name, entry.type, entry.help);
+		entry.collect(writer, entry.name);
+	}
+}
+
+namespace video_streamer {
+	
+	class metrics_listener: public event_handler {
+	public:
+		metrics_server &server;
+		posix::unique_fd socket;
+		
+		metrics_listener(metrics_server &server, posix::unique_fd socket): server(server), socket(std::move(socket)) {
+		}
+		
+		void handle_events(uint32_t) override {
+			server.accept_connections(*this);
+		}
+		
+	};
+	
+	class metrics_connection: public event_handler {
+	public:
+		metrics_server &server;
+		posix::unique_fd socket;
+		std::string request;
+		std::string response;
+		size_t offset = 0;
+		bool closed = false;
+		
+		metrics_connection(metrics_server &server, posix::unique_fd socket): server(server), socket(std::move(socket)) {
+		}
+		
+		void handle_events(uint32_t events) override;
+		bool receive();
+		bool transmit();
+		bool request_complete() const {
+			return request.find("\r\n\r\n") != std::string::npos || request.find("\n\n") != std::string::npos;
+		}
+		
+	};
+	
+}
+
+static const size_t max_metrics_request_size = 8192;
+
+bool video_streamer::metrics_connection::receive() {
+	char buffer[1024];
+	while (true) {
+		ssize_t r = recv(socket, buffer, sizeof(buffer), 0);
+		if (r > 0) {
+			request.append(buffer, (size_t) r);
+			if (request.size() > max_metrics_request_size) return false;
+			continue;
+		}
+		// A client which shuts its side down right after the request still waits for the answer
+		if (r == 0) return request_complete();
+		if (errno == EINTR) continue;
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+	}
+}
+
+bool video_streamer::metrics_connection::transmit() {
+	while (offset < response.size()) {
+		ssize_t r = ::send(socket, response.data() + offset, response.size() - offset, MSG_NOSIGNAL);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				server.m_loop->modify(socket, EPOLLOUT, this);
+				return true;
+			}
+			return false;
+		}
+		offset += (size_t) r;
+	}
+	return false;
+}
+
+void video_streamer::metrics_connection::handle_events(uint32_t) {
+	if (closed) return;
+	if (response.empty()) {
+		if (!receive()) {
+			server.close_connection(*this);
+			return;
+		}
+		if (!request_complete()) {
+			return;
+		}
+		std::ostringstream body;
+		server.m_registry.write(body);
+		std::string content = body.str();
+		response = "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+				"Content-Length: " + std::to_string(content.size()) + "\r\n"
+				"Connection: close\r\n"
+				"\r\n" + content;
+	}
+	if (!transmit()) {
+		server.close_connection(*this);
+	}
+}
+
+video_streamer::metrics_server::metrics_server(
+		metrics_registry &registry, const std::vector<std::string> &addresses
+): m_registry(registry), m_own_loop(new event_loop()), m_loop(m_own_loop.get()) {
+	for (auto &address : addresses) {
+		m_listeners.emplace_back(new metrics_listener(*this, open_server_socket(address)));
+	}
+	m_loop->invoke([this] {
+		for (auto &listener : m_listeners) {
+			m_loop->add(listener->socket, EPOLLIN, listener.get());
+		}
+	});
+}
+
+video_streamer::metrics_server::~metrics_server() {
+	m_loop->invoke([this] {
+		for (auto &listener : m_listeners) {
+			m_loop->remove(listener->socket);
+		}
+		for (auto &connection : m_connections) {
+			m_loop->remove(connection.second->socket);
+		}
+		m_connections.clear();
+	});
+}
+
+void video_streamer::metrics_server::accept_connections(metrics_listener &listener) {
+	while (true) {
+		posix::unique_fd socket = accept4(listener.socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (socket < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				LOG(ERROR) << "accept() failed: " << strerror(errno);
+			}
+			return;
+		}
+		int fd = socket;
+		std::unique_ptr<metrics_connection> connection(new metrics_connection(*this, std::move(socket)));
+		m_loop->add(fd, EPOLLIN, connection.get());
+		m_connections[fd] = std::move(connection);
+	}
+}
+
+void video_streamer::metrics_server::close_connection(metrics_connection &connection) {
+	connection.closed = true;
+	m_loop->remove(connection.socket);
+	auto it = m_connections.find(connection.socket);
+	auto ptr = it->second.release();
+	m_connections.erase(it);
+	m_loop->post([ptr] {
+		delete ptr;
+	});
+}
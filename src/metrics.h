@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "unique_fd.h"
+#include "event_loop.h"
+#include "latency_histogram.h"
+
+namespace video_streamer {
+	
+	/*
+	 * 64-bit counter split into per-CPU shards, so that hot paths on different cores never
+	 * bounce the same cache line. Reading sums all the shards.
+	 */
+	class sharded_counter final {
+		struct shard {
+			std::atomic<uint64_t> value;
+			char padding[64 - sizeof(std::atomic<uint64_t>)];
+		};
+		
+		std::unique_ptr<shard[]> m_shards;
+		unsigned int m_shard_count;
+		
+		unsigned int current_shard() const;
+		
+	public:
+		sharded_counter();
+		sharded_counter(const sharded_counter&) = delete;
+		void add(uint64_t value = 1) {
+			m_shards[current_shard()].value.fetch_add(value, std::memory_order_relaxed);
+		}
+		uint64_t value() const;
+		
+	};
+	
+	/*
+	 * Writes samples in the Prometheus text exposition format.
+	 */
+	class metrics_writer final {
+		std::ostream &m_stream;
+		
+	public:
+		explicit metrics_writer(std::ostream &stream): m_stream(stream) {
+		}
+		void header(const std::string &name, const char *type, const std::string &help);
+		void sample(const std::string &name, const std::string &labels, double value);
+		void sample(const std::string &name, const std::string &labels, uint64_t value);
+		void sample(const std::string &name, const std::string &labels, int64_t value);
+		// Exports a latency histogram as a summary in seconds
+		void summary(const std::string &name, const std::string &labels, const latency_snapshot &snapshot);
+		static std::string label(const char *name, const std::string &value);
+		
+	};
+	
+	class metrics_registry final {
+		struct entry {
+			std::string name;
+			const char *type;
+			std::string help;
+			std::function<void(metrics_writer&, const std::string&)> collect;
+		};
+		
+		std::mutex m_mutex;
+		std::vector<entry> m_entries;
+		
+	public:
+		// The collector is called from the metrics server thread and must be thread-safe
+		void add(
+				std::string name, const char *type, std::string help,
+				std::function<void(metrics_writer&, const std::string&)> collect
+		);
+		void add_counter(std::string name, std::string help, const sharded_counter &counter);
+		void add_gauge(std::string name, std::string help, std::function<int64_t()> value);
+		void write(std::ostream &stream);
+		
+	};
+	
+	class metrics_connection;
+	class metrics_listener;
+	
+	/*
+	 * Minimal HTTP server which answers every request with the current metrics.
+	 */
+	class metrics_server final {
+		metrics_registry &m_registry;
+		std::unique_ptr<event_loop> m_own_loop;
+		event_loop *m_loop;
+		std::vector<std::unique_ptr<metrics_listener>> m_listeners;
+		std::unordered_map<int, std::unique_ptr<metrics_connection>> m_connections;
+		
+		void accept_connections(metrics_listener &listener);
+		void close_connection(metrics_connection &connection);
+		
+		friend class metrics_connection;
+		friend class metrics_listener;
+		
+	public:
+		metrics_server(metrics_registry &registry, const std::vector<std::string> &addresses);
+		~metrics_server();
+		
+	};
+	
+}
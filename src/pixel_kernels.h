@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace video_streamer {
+	
+	/*
+	 * Per byte arithmetic behind the bulk operations of pixel_ops.h, one set per instruction set.
+	 * Every set computes exactly the same bytes as the scalar one.
+	 */
+	struct pixel_kernel_set {
+		// Mixes two spans of bytes, weight (0 to 256) is the share of b
+		void (*lerp)(const uint8_t *a, const uint8_t *b, uint8_t *out, size_t count, int weight);
+		// Blends a span of bytes over another one, every byte has an alpha of its own
+		void (*blend)(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, size_t count);
+		// Convert 3 bytes per pixel in place
+		void (*rgb_to_ycbcr)(uint8_t *pixels, int count);
+		void (*ycbcr_to_rgb)(uint8_t *pixels, int count);
+		const char *name;
+	};
+	
+	// Sets the CPU can run, the first one is used by pixel_ops.h and the last one is the scalar one
+	std::vector<pixel_kernel_set> supported_pixel_kernels();
+	
+}
@@ -0,0 +1,652 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include "pixel_ops.h"
+#include "pixel_kernels.h"
+#include "frame_pool.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VIDEO_STREAMER_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VIDEO_STREAMER_NEON 1
+#endif
+
+namespace {
+	
+	inline uint32_t div255(uint32_t x) {
+		// Exact rounded division for x up to 255 * 255
+		x += 128;
+		return (x + (x >> 8)) >> 8;
+	}
+	
+	inline uint8_t clamp_byte(int value) {
+		return (uint8_t) std::min(std::max(value, 0), 255);
+	}
+	
+	/*
+	 * The vector kernels compute exactly the same integers as the scalar ones (which also process the tails):
+	 * 8-bit coefficients for RGB to YCbCr and 6-bit ones back, so that every product fits 16-bit lanes.
+	 */
+	void lerp_scalar(const uint8_t *a, const uint8_t *b, uint8_t *out, size_t count, int weight) {
+		int inverse = 256 - weight;
+		for (size_t i = 0; i < count; i++) {
+			out[i] = (uint8_t) ((a[i] * inverse + b[i] * weight + 128) >> 8);
+		}
+	}
+	
+	void blend_scalar(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, size_t count) {
+		for (size_t i = 0; i < count; i++) {
+			dst[i] = (uint8_t) div255(dst[i] * (255u - alpha[i]) + src[i] * (uint32_t) alpha[i]);
+		}
+	}
+	
+	void rgb_to_ycbcr_scalar(uint8_t *pixels, int count) {
+		for (int i = 0; i < count; i++, pixels += 3) {
+			int r = pixels[0];
+			int g = pixels[1];
+			int b = pixels[2];
+			pixels[0] = (uint8_t) ((77 * r + 150 * g + 29 * b + 128) >> 8);
+			// 32895 is the offset of 128 plus rounding, it keeps the sums positive
+			pixels[1] = (uint8_t) ((128 * b - 43 * r - 85 * g + 32895) >> 8);
+			pixels[2] = (uint8_t) ((128 * r - 107 * g - 21 * b + 32895) >> 8);
+		}
+	}
+	
+	void ycbcr_to_rgb_scalar(uint8_t *pixels, int count) {
+		for (int i = 0; i < count; i++, pixels += 3) {
+			int y = pixels[0];
+			int cb = pixels[1] - 128;
+			int cr = pixels[2] - 128;
+			pixels[0] = clamp_byte(y + ((90 * cr + 32) >> 6));
+			pixels[1] = clamp_byte(y - ((22 * cb + 46 * cr + 32) >> 6));
+			pixels[2] = clamp_byte(y + ((113 * cb + 32) >> 6));
+		}
+	}
+	
+#ifdef VIDEO_STREAMER_X86
+	
+	__attribute__((target("sse2")))
+	void lerp_sse2(const uint8_t *a, const uint8_t *b, uint8_t *out, size_t count, int weight) {
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i weight_a = _mm_set1_epi16((short) (256 - weight));
+		const __m128i weight_b = _mm_set1_epi16((short) weight);
+		const __m128i round = _mm_set1_epi16(128);
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			__m128i va = _mm_loadu_si128((const __m128i*) (a + i));
+			__m128i vb = _mm_loadu_si128((const __m128i*) (b + i));
+			__m128i low = _mm_add_epi16(_mm_add_epi16(
+					_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), weight_a),
+					_mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), weight_b)
+			), round);
+			__m128i high = _mm_add_epi16(_mm_add_epi16(
+					_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), weight_a),
+					_mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), weight_b)
+			), round);
+			_mm_storeu_si128((__m128i*) (out + i), _mm_packus_epi16(_mm_srli_epi16(low, 8), _mm_srli_epi16(high, 8)));
+		}
+		lerp_scalar(a + i, b + i, out + i, count - i, weight);
+	}
+	
+	__attribute__((target("sse2")))
+	inline __m128i blend_half_sse2(__m128i dst, __m128i src, __m128i alpha) {
+		const __m128i round = _mm_set1_epi16(128);
+		const __m128i opaque = _mm_set1_epi16(255);
+		__m128i sum = _mm_add_epi16(
+				_mm_mullo_epi16(dst, _mm_sub_epi16(opaque, alpha)), _mm_mullo_epi16(src, alpha)
+		);
+		sum = _mm_add_epi16(sum, round);
+		return _mm_srli_epi16(_mm_add_epi16(sum, _mm_srli_epi16(sum, 8)), 8);
+	}
+	
+	__attribute__((target("sse2")))
+	void blend_sse2(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, size_t count) {
+		const __m128i zero = _mm_setzero_si128();
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			__m128i vd = _mm_loadu_si128((const __m128i*) (dst + i));
+			__m128i vs = _mm_loadu_si128((const __m128i*) (src + i));
+			__m128i va = _mm_loadu_si128((const __m128i*) (alpha + i));
+			__m128i low = blend_half_sse2(
+					_mm_unpacklo_epi8(vd, zero), _mm_unpacklo_epi8(vs, zero), _mm_unpacklo_epi8(va, zero)
+			);
+			__m128i high = blend_half_sse2(
+					_mm_unpackhi_epi8(vd, zero), _mm_unpackhi_epi8(vs, zero), _mm_unpackhi_epi8(va, zero)
+			);
+			_mm_storeu_si128((__m128i*) (dst + i), _mm_packus_epi16(low, high));
+		}
+		blend_scalar(dst + i, src + i, alpha + i, count - i);
+	}
+	
+	__attribute__((target("avx2")))
+	void lerp_avx2(const uint8_t *a, const uint8_t *b, uint8_t *out, size_t count, int weight) {
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i weight_a = _mm256_set1_epi16((short) (256 - weight));
+		const __m256i weight_b = _mm256_set1_epi16((short) weight);
+		const __m256i round = _mm256_set1_epi16(128);
+		size_t i = 0;
+		// Unpacks and packs both work inside 128-bit lanes, so the byte order is preserved
+		for (; i + 32 <= count; i += 32) {
+			__m256i va = _mm256_loadu_si256((const __m256i*) (a + i));
+			__m256i vb = _mm256_loadu_si256((const __m256i*) (b + i));
+			__m256i low = _mm256_add_epi16(_mm256_add_epi16(
+					_mm256_mullo_epi16(_mm256_unpacklo_epi8(va, zero), weight_a),
+					_mm256_mullo_epi16(_mm256_unpacklo_epi8(vb, zero), weight_b)
+			), round);
+			__m256i high = _mm256_add_epi16(_mm256_add_epi16(
+					_mm256_mullo_epi16(_mm256_unpackhi_epi8(va, zero), weight_a),
+					_mm256_mullo_epi16(_mm256_unpackhi_epi8(vb, zero), weight_b)
+			), round);
+			_mm256_storeu_si256(
+					(__m256i*) (out + i), _mm256_packus_epi16(_mm256_srli_epi16(low, 8), _mm256_srli_epi16(high, 8))
+			);
+		}
+		lerp_sse2(a + i, b + i, out + i, count - i, weight);
+	}
+	
+	__attribute__((target("avx2")))
+	inline __m256i blend_half_avx2(__m256i dst, __m256i src, __m256i alpha) {
+		const __m256i round = _mm256_set1_epi16(128);
+		const __m256i opaque = _mm256_set1_epi16(255);
+		__m256i sum = _mm256_add_epi16(
+				_mm256_mullo_epi16(dst, _mm256_sub_epi16(opaque, alpha)), _mm256_mullo_epi16(src, alpha)
+		);
+		sum = _mm256_add_epi16(sum, round);
+		return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_srli_epi16(sum, 8)), 8);
+	}
+	
+	__attribute__((target("avx2")))
+	void blend_avx2(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, size_t count) {
+		const __m256i zero = _mm256_setzero_si256();
+		size_t i = 0;
+		for (; i + 32 <= count; i += 32) {
+			__m256i vd = _mm256_loadu_si256((const __m256i*) (dst + i));
+			__m256i vs = _mm256_loadu_si256((const __m256i*) (src + i));
+			__m256i va = _mm256_loadu_si256((const __m256i*) (alpha + i));
+			__m256i low = blend_half_avx2(
+					_mm256_unpacklo_epi8(vd, zero), _mm256_unpacklo_epi8(vs, zero), _mm256_unpacklo_epi8(va, zero)
+			);
+			__m256i high = blend_half_avx2(
+					_mm256_unpackhi_epi8(vd, zero), _mm256_unpackhi_epi8(vs, zero), _mm256_unpackhi_epi8(va, zero)
+			);
+			_mm256_storeu_si256((__m256i*) (dst + i), _mm256_packus_epi16(low, high));
+		}
+		blend_sse2(dst + i, src + i, alpha + i, count - i);
+	}
+	
+	/*
+	 * pshufb masks splitting 16 packed 3 byte pixels (three vectors) into one vector per channel and back.
+	 * A mask byte of 0x80 produces a zero, so the parts taken from every vector are simply ORed.
+	 */
+	struct rgb_shuffle_masks {
+		alignas(16) uint8_t split[3][3][16];
+		alignas(16) uint8_t merge[3][3][16];
+	};
+	
+	rgb_shuffle_masks make_rgb_shuffle_masks() {
+		rgb_shuffle_masks masks = {};
+		for (int channel = 0; channel < 3; channel++) {
+			for (int part = 0; part < 3; part++) {
+				for (int i = 0; i < 16; i++) {
+					int from = 3 * i + channel;
+					masks.split[channel][part][i] = (uint8_t) (from / 16 == part ? from % 16 : 0x80);
+					int to = 16 * part + i;
+					masks.merge[channel][part][i] = (uint8_t) (to % 3 == channel ? to / 3 : 0x80);
+				}
+			}
+		}
+		return masks;
+	}
+	
+	const rgb_shuffle_masks rgb_masks = make_rgb_shuffle_masks();
+	
+	__attribute__((target("ssse3")))
+	inline void load_channels_ssse3(const uint8_t *pixels, __m128i channels[3]) {
+		__m128i parts[3];
+		for (int part = 0; part < 3; part++) {
+			parts[part] = _mm_loadu_si128((const __m128i*) (pixels + 16 * part));
+		}
+		for (int channel = 0; channel < 3; channel++) {
+			auto masks = rgb_masks.split[channel];
+			channels[channel] = _mm_or_si128(_mm_or_si128(
+					_mm_shuffle_epi8(parts[0], _mm_load_si128((const __m128i*) masks[0])),
+					_mm_shuffle_epi8(parts[1], _mm_load_si128((const __m128i*) masks[1]))
+			), _mm_shuffle_epi8(parts[2], _mm_load_si128((const __m128i*) masks[2])));
+		}
+	}
+	
+	__attribute__((target("ssse3")))
+	inline void store_channels_ssse3(uint8_t *pixels, const __m128i channels[3]) {
+		for (int part = 0; part < 3; part++) {
+			__m128i result = _mm_or_si128(_mm_or_si128(
+					_mm_shuffle_epi8(channels[0], _mm_load_si128((const __m128i*) rgb_masks.merge[0][part])),
+					_mm_shuffle_epi8(channels[1], _mm_load_si128((const __m128i*) rgb_masks.merge[1][part]))
+			), _mm_shuffle_epi8(channels[2], _mm_load_si128((const __m128i*) rgb_masks.merge[2][part])));
+			_mm_storeu_si128((__m128i*) (pixels + 16 * part), result);
+		}
+	}
+	
+	// Y, Cb and Cr of 8 pixels in 16-bit lanes, the sums wrap around but the results are in range
+	__attribute__((target("ssse3")))
+	inline void rgb_to_ycbcr_half_ssse3(__m128i r, __m128i g, __m128i b, __m128i out[3]) {
+		auto mul = [](__m128i value, short factor) {
+			return _mm_mullo_epi16(value, _mm_set1_epi16(factor));
+		};
+		out[0] = _mm_srli_epi16(_mm_add_epi16(
+				_mm_add_epi16(mul(r, 77), mul(g, 150)), _mm_add_epi16(mul(b, 29), _mm_set1_epi16(128))
+		), 8);
+		out[1] = _mm_srli_epi16(_mm_sub_epi16(
+				_mm_add_epi16(mul(b, 128), _mm_set1_epi16((short) 32895)), _mm_add_epi16(mul(r, 43), mul(g, 85))
+		), 8);
+		out[2] = _mm_srli_epi16(_mm_sub_epi16(
+				_mm_add_epi16(mul(r, 128), _mm_set1_epi16((short) 32895)), _mm_add_epi16(mul(g, 107), mul(b, 21))
+		), 8);
+	}
+	
+	__attribute__((target("ssse3")))
+	void rgb_to_ycbcr_ssse3(uint8_t *pixels, int count) {
+		const __m128i zero = _mm_setzero_si128();
+		int i = 0;
+		for (; i + 16 <= count; i += 16, pixels += 48) {
+			__m128i channels[3];
+			load_channels_ssse3(pixels, channels);
+			__m128i low[3], high[3];
+			rgb_to_ycbcr_half_ssse3(
+					_mm_unpacklo_epi8(channels[0], zero), _mm_unpacklo_epi8(channels[1], zero),
+					_mm_unpacklo_epi8(channels[2], zero), low
+			);
+			rgb_to_ycbcr_half_ssse3(
+					_mm_unpackhi_epi8(channels[0], zero), _mm_unpackhi_epi8(channels[1], zero),
+					_mm_unpackhi_epi8(channels[2], zero), high
+			);
+			for (int channel = 0; channel < 3; channel++) {
+				channels[channel] = _mm_packus_epi16(low[channel], high[channel]);
+			}
+			store_channels_ssse3(pixels, channels);
+		}
+		rgb_to_ycbcr_scalar(pixels, count - i);
+	}
+	
+	// R, G and B of 8 pixels in 16-bit lanes (chroma already centered on zero), not clamped yet
+	__attribute__((target("ssse3")))
+	inline void ycbcr_to_rgb_half_ssse3(__m128i y, __m128i cb, __m128i cr, __m128i out[3]) {
+		auto mul = [](__m128i value, short factor) {
+			return _mm_mullo_epi16(value, _mm_set1_epi16(factor));
+		};
+		const __m128i round = _mm_set1_epi16(32);
+		out[0] = _mm_add_epi16(y, _mm_srai_epi16(_mm_add_epi16(mul(cr, 90), round), 6));
+		out[1] = _mm_sub_epi16(
+				y, _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(mul(cb, 22), mul(cr, 46)), round), 6)
+		);
+		out[2] = _mm_add_epi16(y, _mm_srai_epi16(_mm_add_epi16(mul(cb, 113), round), 6));
+	}
+	
+	__attribute__((target("ssse3")))
+	void ycbcr_to_rgb_ssse3(uint8_t *pixels, int count) {
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i center = _mm_set1_epi16(128);
+		int i = 0;
+		for (; i + 16 <= count; i += 16, pixels += 48) {
+			__m128i channels[3];
+			load_channels_ssse3(pixels, channels);
+			__m128i low[3], high[3];
+			ycbcr_to_rgb_half_ssse3(
+					_mm_unpacklo_epi8(channels[0], zero),
+					_mm_sub_epi16(_mm_unpacklo_epi8(channels[1], zero), center),
+					_mm_sub_epi16(_mm_unpacklo_epi8(channels[2], zero), center), low
+			);
+			ycbcr_to_rgb_half_ssse3(
+					_mm_unpackhi_epi8(channels[0], zero),
+					_mm_sub_epi16(_mm_unpackhi_epi8(channels[1], zero), center),
+					_mm_sub_epi16(_mm_unpackhi_epi8(channels[2], zero), center), high
+			);
+			// Saturating packs clamp to 0..255
+			for (int channel = 0; channel < 3; channel++) {
+				channels[channel] = _mm_packus_epi16(low[channel], high[channel]);
+			}
+			store_channels_ssse3(pixels, channels);
+		}
+		ycbcr_to_rgb_scalar(pixels, count - i);
+	}
+	
+#endif
+
+#ifdef VIDEO_STREAMER_NEON
+	
+	void lerp_neon(const uint8_t *a, const uint8_t *b, uint8_t *out, size_t count, int weight) {
+		const uint16x8_t weight_a = vdupq_n_u16((uint16_t) (256 - weight));
+		const uint16x8_t weight_b = vdupq_n_u16((uint16_t) weight);
+		const uint16x8_t round = vdupq_n_u16(128);
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			uint8x16_t va = vld1q_u8(a + i);
+			uint8x16_t vb = vld1q_u8(b + i);
+			uint16x8_t low = vmlaq_u16(vmlaq_u16(round, vmovl_u8(vget_low_u8(va)), weight_a),
+					vmovl_u8(vget_low_u8(vb)), weight_b);
+			uint16x8_t high = vmlaq_u16(vmlaq_u16(round, vmovl_u8(vget_high_u8(va)), weight_a),
+					vmovl_u8(vget_high_u8(vb)), weight_b);
+			vst1q_u8(out + i, vcombine_u8(vshrn_n_u16(low, 8), vshrn_n_u16(high, 8)));
+		}
+		lerp_scalar(a + i, b + i, out + i, count - i, weight);
+	}
+	
+	inline uint8x8_t blend_half_neon(uint8x8_t dst, uint8x8_t src, uint8x8_t alpha) {
+		uint16x8_t sum = vmlal_u8(vmull_u8(dst, vmvn_u8(alpha)), src, alpha);
+		sum = vaddq_u16(sum, vdupq_n_u16(128));
+		return vshrn_n_u16(vsraq_n_u16(sum, sum, 8), 8);
+	}
+	
+	void blend_neon(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, size_t count) {
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			uint8x16_t vd = vld1q_u8(dst + i);
+			uint8x16_t vs = vld1q_u8(src + i);
+			uint8x16_t va = vld1q_u8(alpha + i);
+			vst1q_u8(dst + i, vcombine_u8(
+					blend_half_neon(vget_low_u8(vd), vget_low_u8(vs), vget_low_u8(va)),
+					blend_half_neon(vget_high_u8(vd), vget_high_u8(vs), vget_high_u8(va))
+			));
+		}
+		blend_scalar(dst + i, src + i, alpha + i, count - i);
+	}
+	
+	inline void rgb_to_ycbcr_half_neon(uint16x8_t r, uint16x8_t g, uint16x8_t b, uint8x8_t out[3]) {
+		uint16x8_t y = vmlaq_n_u16(vmlaq_n_u16(vmlaq_n_u16(vdupq_n_u16(128), r, 77), g, 150), b, 29);
+		uint16x8_t cb = vmlsq_n_u16(vmlsq_n_u16(vmlaq_n_u16(vdupq_n_u16(32895), b, 128), r, 43), g, 85);
+		uint16x8_t cr = vmlsq_n_u16(vmlsq_n_u16(vmlaq_n_u16(vdupq_n_u16(32895), r, 128), g, 107), b, 21);
+		out[0] = vshrn_n_u16(y, 8);
+		out[1] = vshrn_n_u16(cb, 8);
+		out[2] = vshrn_n_u16(cr, 8);
+	}
+	
+	void rgb_to_ycbcr_neon(uint8_t *pixels, int count) {
+		int i = 0;
+		for (; i + 16 <= count; i += 16, pixels += 48) {
+			uint8x16x3_t channels = vld3q_u8(pixels);
+			uint8x8_t low[3], high[3];
+			rgb_to_ycbcr_half_neon(
+					vmovl_u8(vget_low_u8(channels.val[0])), vmovl_u8(vget_low_u8(channels.val[1])),
+					vmovl_u8(vget_low_u8(channels.val[2])), low
+			);
+			rgb_to_ycbcr_half_neon(
+					vmovl_u8(vget_high_u8(channels.val[0])), vmovl_u8(vget_high_u8(channels.val[1])),
+					vmovl_u8(vget_high_u8(channels.val[2])), high
+			);
+			for (int channel = 0; channel < 3; channel++) {
+				channels.val[channel] = vcombine_u8(low[channel], high[channel]);
+			}
+			vst3q_u8(pixels, channels);
+		}
+		rgb_to_ycbcr_scalar(pixels, count - i);
+	}
+	
+	inline void ycbcr_to_rgb_half_neon(int16x8_t y, int16x8_t cb, int16x8_t cr, uint8x8_t out[3]) {
+		const int16x8_t round = vdupq_n_s16(32);
+		int16x8_t r = vaddq_s16(y, vshrq_n_s16(vmlaq_n_s16(round, cr, 90), 6));
+		int16x8_t g = vsubq_s16(y, vshrq_n_s16(vmlaq_n_s16(vmlaq_n_s16(round, cb, 22), cr, 46), 6));
+		int16x8_t b = vaddq_s16(y, vshrq_n_s16(vmlaq_n_s16(round, cb, 113), 6));
+		out[0] = vqmovun_s16(r);
+		out[1] = vqmovun_s16(g);
+		out[2] = vqmovun_s16(b);
+	}
+	
+	void ycbcr_to_rgb_neon(uint8_t *pixels, int count) {
+		const int16x8_t center = vdupq_n_s16(128);
+		int i = 0;
+		for (; i + 16 <= count; i += 16, pixels += 48) {
+			uint8x16x3_t channels = vld3q_u8(pixels);
+			int16x8_t wide[2][3];
+			for (int channel = 0; channel < 3; channel++) {
+				wide[0][channel] = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(channels.val[channel])));
+				wide[1][channel] = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(channels.val[channel])));
+			}
+			uint8x8_t low[3], high[3];
+			ycbcr_to_rgb_half_neon(
+					wide[0][0], vsubq_s16(wide[0][1], center), vsubq_s16(wide[0][2], center), low
+			);
+			ycbcr_to_rgb_half_neon(
+					wide[1][0], vsubq_s16(wide[1][1], center), vsubq_s16(wide[1][2], center), high
+			);
+			for (int channel = 0; channel < 3; channel++) {
+				channels.val[channel] = vcombine_u8(low[channel], high[channel]);
+			}
+			vst3q_u8(pixels, channels);
+		}
+		ycbcr_to_rgb_scalar(pixels, count - i);
+	}
+	
+#endif
+	
+	const video_streamer::pixel_kernel_set &kernels() {
+		static const auto kernels = video_streamer::supported_pixel_kernels().front();
+		return kernels;
+	}
+	
+	// Clips a rectangle placed at (x, y) of the frame, the source position follows its top left corner
+	bool clip_rect(
+			const video_streamer::uncompressed_frame &frame, int &x, int &y, int &width, int &height,
+			int &src_x, int &src_y
+	) {
+		if (x < 0) {
+			width += x;
+			src_x -= x;
+			x = 0;
+		}
+		if (y < 0) {
+			height += y;
+			src_y -= y;
+			y = 0;
+		}
+		width = std::min(width, frame.width() - x);
+		height = std::min(height, frame.height() - y);
+		return width > 0 && height > 0;
+	}
+	
+	/*
+	 * Source position and weight of the next pixel (0 to 256) for every destination pixel, in bytes.
+	 * The last source pixel has no next one, its weight is 0.
+	 */
+	void bilinear_steps(
+			int src_size, int dst_size, int bytes_per_pixel, std::vector<int> &offsets, std::vector<int> &weights
+	) {
+		offsets.resize(dst_size);
+		weights.resize(dst_size);
+		for (int i = 0; i < dst_size; i++) {
+			// Center of the destination pixel in source pixels, 8 fractional bits
+			int64_t position = ((2 * (int64_t) i + 1) * src_size * 256) / (2 * (int64_t) dst_size) - 128;
+			position = std::min<int64_t>(std::max<int64_t>(position, 0), (int64_t) (src_size - 1) * 256);
+			offsets[i] = (int) (position >> 8) * bytes_per_pixel;
+			weights[i] = (int) (position & 255);
+		}
+	}
+	
+}
+
+void video_streamer::fill_rect(uncompressed_frame &frame, int x, int y, int width, int height, uint32_t color) {
+	int src_x = 0;
+	int src_y = 0;
+	if (!clip_rect(frame, x, y, width, height, src_x, src_y)) return;
+	int bytes_per_pixel = frame.bytes_per_pixel();
+	size_t span = (size_t) width * bytes_per_pixel;
+	auto first_row = frame.row(y) + (size_t) x * bytes_per_pixel;
+	for (int i = 0; i < bytes_per_pixel; i++) {
+		first_row[i] = (uint8_t) (color >> (8 * i));
+	}
+	// Double the filled part of the first row, then copy it to the others
+	size_t filled = (size_t) bytes_per_pixel;
+	while (filled < span) {
+		size_t part = std::min(filled, span - filled);
+		memcpy(first_row + filled, first_row, part);
+		filled += part;
+	}
+	for (int i = 1; i < height; i++) {
+		memcpy(frame.row(y + i) + (size_t) x * bytes_per_pixel, first_row, span);
+	}
+}
+
+void video_streamer::blit(const uncompressed_frame &src, uncompressed_frame &dst, int x, int y) {
+	if (src.bytes_per_pixel() != dst.bytes_per_pixel()) {
+		throw std::invalid_argument("Frames have different pixel formats");
+	}
+	int width = src.width();
+	int height = src.height();
+	int src_x = 0;
+	int src_y = 0;
+	if (!clip_rect(dst, x, y, width, height, src_x, src_y)) return;
+	int bytes_per_pixel = dst.bytes_per_pixel();
+	size_t span = (size_t) width * bytes_per_pixel;
+	// Copying a frame into itself downwards goes from the bottom, so rows aren't overwritten before they are read
+	bool backwards = &src == &dst && y > src_y;
+	for (int i = 0; i < height; i++) {
+		int row = backwards ? height - 1 - i : i;
+		memmove(
+				dst.row(y + row) + (size_t) x * bytes_per_pixel,
+				src.row(src_y + row) + (size_t) src_x * bytes_per_pixel,
+				span
+		);
+	}
+}
+
+video_streamer::uncompressed_frame video_streamer::crop(
+		const uncompressed_frame &frame, int x, int y, int width, int height
+) {
+	int src_x = 0;
+	int src_y = 0;
+	if (!clip_rect(frame, x, y, width, height, src_x, src_y)) {
+		throw std::invalid_argument("The crop rectangle is outside of the frame");
+	}
+	int bytes_per_pixel = frame.bytes_per_pixel();
+	auto result = frame_pool::instance().acquire(width, height, bytes_per_pixel);
+	for (int i = 0; i < height; i++) {
+		memcpy(result.row(i), frame.row(y + i) + (size_t) x * bytes_per_pixel, (size_t) width * bytes_per_pixel);
+	}
+	result.metadata() = frame.metadata();
+	return result;
+}
+
+video_streamer::uncompressed_frame video_streamer::scale_bilinear(
+		const uncompressed_frame &frame, int width, int height
+) {
+	if (width < 1 || height < 1 || frame.width() < 1 || frame.height() < 1) {
+		throw std::invalid_argument("Frames must have at least one pixel");
+	}
+	int bytes_per_pixel = frame.bytes_per_pixel();
+	auto result = frame_pool::instance().acquire(width, height, bytes_per_pixel);
+	result.metadata() = frame.metadata();
+	static thread_local std::vector<int> x_offsets, x_weights, y_offsets, y_weights;
+	static thread_local std::vector<uint8_t> row;
+	bilinear_steps(frame.width(), width, bytes_per_pixel, x_offsets, x_weights);
+	bilinear_steps(frame.height(), height, 1, y_offsets, y_weights);
+	size_t span = (size_t) frame.width() * bytes_per_pixel;
+	row.resize(span);
+	auto lerp = kernels().lerp;
+	for (int y = 0; y < height; y++) {
+		// Rows are mixed by the vector kernel, then pixels of the mixed row
+		int src_y = y_offsets[y];
+		const uint8_t *mixed = frame.row(src_y);
+		if (y_weights[y] > 0) {
+			lerp(frame.row(src_y), frame.row(src_y + 1), row.data(), span, y_weights[y]);
+			mixed = row.data();
+		}
+		auto out = result.row(y);
+		for (int x = 0; x < width; x++) {
+			auto pixel = mixed + x_offsets[x];
+			int weight = x_weights[x];
+			int inverse = 256 - weight;
+			// A zero weight is only given to the last pixel, which has no next one
+			int next = weight > 0 ? bytes_per_pixel : 0;
+			for (int i = 0; i < bytes_per_pixel; i++) {
+				*out++ = (uint8_t) ((pixel[i] * inverse + pixel[i + next] * weight + 128) >> 8);
+			}
+		}
+	}
+	return result;
+}
+
+void video_streamer::rgb_to_ycbcr(uncompressed_frame &frame) {
+	if (frame.bytes_per_pixel() != 3) {
+		throw std::invalid_argument("Only 3 bytes per pixel frames can be converted to YCbCr");
+	}
+	auto convert = kernels().rgb_to_ycbcr;
+	for (int y = 0; y < frame.height(); y++) {
+		convert(frame.row(y), frame.width());
+	}
+}
+
+void video_streamer::ycbcr_to_rgb(uncompressed_frame &frame) {
+	if (frame.bytes_per_pixel() != 3) {
+		throw std::invalid_argument("Only 3 bytes per pixel frames can be converted to RGB");
+	}
+	auto convert = kernels().ycbcr_to_rgb;
+	for (int y = 0; y < frame.height(); y++) {
+		convert(frame.row(y), frame.width());
+	}
+}
+
+void video_streamer::overlay_rgba(const uncompressed_frame &image, uncompressed_frame &frame, int x, int y) {
+	int bytes_per_pixel = frame.bytes_per_pixel();
+	if (image.bytes_per_pixel() != 4 || (bytes_per_pixel != 3 && bytes_per_pixel != 4)) {
+		throw std::invalid_argument("An RGBA image can only be put over an RGB or RGBA frame");
+	}
+	int width = image.width();
+	int height = image.height();
+	int src_x = 0;
+	int src_y = 0;
+	if (!clip_rect(frame, x, y, width, height, src_x, src_y)) return;
+	// The kernel blends bytes, so colors and alpha are spread to the layout of the frame first
+	static thread_local std::vector<uint8_t> colors, alphas;
+	size_t span = (size_t) width * bytes_per_pixel;
+	colors.resize(span);
+	alphas.resize(span);
+	auto blend = kernels().blend;
+	for (int i = 0; i < height; i++) {
+		auto src = image.row(src_y + i) + (size_t) src_x * 4;
+		auto color = colors.data();
+		auto alpha = alphas.data();
+		for (int j = 0; j < width; j++, src += 4) {
+			for (int k = 0; k < 3; k++) {
+				*color++ = src[k];
+				*alpha++ = src[3];
+			}
+			if (bytes_per_pixel == 4) {
+				// Alpha of the result is a + (1 - a) * frame alpha
+				*color++ = 255;
+				*alpha++ = src[3];
+			}
+		}
+		blend(frame.row(y + i) + (size_t) x * bytes_per_pixel, colors.data(), alphas.data(), span);
+	}
+}
+
+std::vector<video_streamer::pixel_kernel_set> video_streamer::supported_pixel_kernels() {
+	std::vector<pixel_kernel_set> result;
+#ifdef VIDEO_STREAMER_X86
+	__builtin_cpu_init();
+	// Color conversion shuffles bytes within 128-bit lanes, it has no AVX2 version of its own
+	if (__builtin_cpu_supports("avx2")) {
+		result.push_back(pixel_kernel_set { lerp_avx2, blend_avx2, rgb_to_ycbcr_ssse3, ycbcr_to_rgb_ssse3, "AVX2" });
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		result.push_back(pixel_kernel_set { lerp_sse2, blend_sse2, rgb_to_ycbcr_ssse3, ycbcr_to_rgb_ssse3, "SSSE3" });
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		result.push_back(
+				pixel_kernel_set { lerp_sse2, blend_sse2, rgb_to_ycbcr_scalar, ycbcr_to_rgb_scalar, "SSE2" }
+		);
+	}
+#endif
+#ifdef VIDEO_STREAMER_NEON
+	result.push_back(pixel_kernel_set { lerp_neon, blend_neon, rgb_to_ycbcr_neon, ycbcr_to_rgb_neon, "NEON" });
+#endif
+	result.push_back(
+			pixel_kernel_set { lerp_scalar, blend_scalar, rgb_to_ycbcr_scalar, ycbcr_to_rgb_scalar, "scalar" }
+	);
+	return result;
+}
+
+const char *video_streamer::pixel_kernel_name() {
+	return kernels().name;
+}
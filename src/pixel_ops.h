@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include "video_streamer.h"
+
+namespace video_streamer {
+	
+	/*
+	 * Bulk operations on uncompressed frames for frame processors. They work on whole row spans, the per byte
+	 * arithmetic runs in AVX2, SSSE3, SSE2 or NEON kernels when available (selected at runtime).
+	 * Rectangles are clipped to the frames, colors are packed the same way as uncompressed_frame::pixel().
+	 */
+	
+	// Sets every pixel of the rectangle to the color
+	void fill_rect(uncompressed_frame &frame, int x, int y, int width, int height, uint32_t color);
+	// Copies the source to (x, y) of the destination, both must have the same number of bytes per pixel
+	void blit(const uncompressed_frame &src, uncompressed_frame &dst, int x, int y);
+	// Returns a copy of the rectangle in a pooled frame
+	uncompressed_frame crop(const uncompressed_frame &frame, int x, int y, int width, int height);
+	// Returns a resized copy in a pooled frame, filtered bilinearly (pixel centers are aligned)
+	uncompressed_frame scale_bilinear(const uncompressed_frame &frame, int width, int height);
+	/*
+	 * Convert 3 bytes per pixel frames in place between RGB and YCbCr (full range BT.601, as in JPEG).
+	 * Fixed point math, a round trip changes a channel by a couple of levels at most.
+	 */
+	void rgb_to_ycbcr(uncompressed_frame &frame);
+	void ycbcr_to_rgb(uncompressed_frame &frame);
+	/*
+	 * Blends an RGBA overlay (4 bytes per pixel, alpha not premultiplied) over the frame at (x, y).
+	 * The frame is either RGB or RGBA, its alpha is composited too.
+	 */
+	void overlay_rgba(const uncompressed_frame &image, uncompressed_frame &frame, int x, int y);
+	
+	// Name of the instruction set used by the kernels
+	const char *pixel_kernel_name();
+	
+}
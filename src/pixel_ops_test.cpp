@@ -0,0 +1,103 @@
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <easylogging++.h>
+#include "pixel_kernels.h"
+
+INITIALIZE_EASYLOGGINGPP
+
+/*
+ * Runs every kernel set the CPU supports against the scalar kernels on random bytes. Spans have every length
+ * shorter than a vector or odd longer ones and start at unaligned addresses, so the tails handled by the scalar
+ * code after the vector loops are checked too.
+ */
+
+namespace {
+	
+	const int rounds = 2000;
+	const size_t max_count = 300;
+	
+	std::mt19937 random_engine(12345);
+	
+	size_t random_count() {
+		// Every short length (shorter than any vector) and longer odd ones
+		std::uniform_int_distribution<size_t> short_count(0, 40);
+		std::uniform_int_distribution<size_t> long_count(0, max_count / 2 - 1);
+		return random_engine() % 2 ? short_count(random_engine) : 2 * long_count(random_engine) + 1;
+	}
+	
+	std::vector<uint8_t> random_bytes(size_t size) {
+		std::uniform_int_distribution<int> byte(0, 255);
+		std::vector<uint8_t> result(size);
+		for (auto &value : result) {
+			value = (uint8_t) byte(random_engine);
+		}
+		return result;
+	}
+	
+	bool fail(const video_streamer::pixel_kernel_set &kernels, const char *kernel, size_t count, size_t offset) {
+		std::cerr << kernels.name << " " << kernel << " differs from the scalar one for " << count <<
+				" elements at offset " << offset << std::endl;
+		return false;
+	}
+	
+	bool test_kernels(const video_streamer::pixel_kernel_set &kernels, const video_streamer::pixel_kernel_set &scalar) {
+		std::uniform_int_distribution<size_t> random_offset(0, 31);
+		std::uniform_int_distribution<int> random_weight(0, 256);
+		for (int round = 0; round < rounds; round++) {
+			size_t count = random_count();
+			size_t offset = random_offset(random_engine);
+			// A few bytes behind the span catch writes past its end
+			auto a = random_bytes(offset + 3 * count + 32);
+			auto b = random_bytes(a.size());
+			auto alpha = random_bytes(a.size());
+			auto expected = random_bytes(a.size());
+			auto actual = expected;
+			int weight = round < 2 ? round * 256 : random_weight(random_engine);
+			scalar.lerp(a.data() + offset, b.data() + offset, expected.data() + offset, count, weight);
+			kernels.lerp(a.data() + offset, b.data() + offset, actual.data() + offset, count, weight);
+			if (actual != expected) {
+				return fail(kernels, "lerp", count, offset);
+			}
+			expected = a;
+			actual = a;
+			scalar.blend(expected.data() + offset, b.data() + offset, alpha.data() + offset, count);
+			kernels.blend(actual.data() + offset, b.data() + offset, alpha.data() + offset, count);
+			if (actual != expected) {
+				return fail(kernels, "blend", count, offset);
+			}
+			expected = a;
+			actual = a;
+			scalar.rgb_to_ycbcr(expected.data() + offset, (int) count);
+			kernels.rgb_to_ycbcr(actual.data() + offset, (int) count);
+			if (actual != expected) {
+				return fail(kernels, "rgb_to_ycbcr", count, offset);
+			}
+			expected = a;
+			actual = a;
+			scalar.ycbcr_to_rgb(expected.data() + offset, (int) count);
+			kernels.ycbcr_to_rgb(actual.data() + offset, (int) count);
+			if (actual != expected) {
+				return fail(kernels, "ycbcr_to_rgb", count, offset);
+			}
+		}
+		return true;
+	}
+	
+}
+
+int main() {
+	auto sets = video_streamer::supported_pixel_kernels();
+	auto &scalar = sets.back();
+	bool ok = true;
+	for (auto &kernels : sets) {
+		if (test_kernels(kernels, scalar)) {
+			std::cout << kernels.name << " kernels OK" << std::endl;
+		} else {
+			ok = false;
+		}
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,52 @@
+#include <algorithm>
+#include <cmath>
+#include "rate_controller.h"
+
+video_streamer::rate_controller::rate_controller(
+		uint64_t target_bitrate, int initial_quality, int min_quality, int max_quality,
+		std::chrono::steady_clock::duration window
+): m_target_bitrate(target_bitrate), m_window(window), m_min_quality(min_quality), m_max_quality(max_quality),
+	m_window_bytes(0), m_scale(quality_to_scale(initial_quality)), m_quality(initial_quality),
+	m_frame_budget(0), m_measured_bitrate(0)
+{
+}
+
+// The same mapping as jpeg_quality_scaling(): percentage applied to the standard quantization tables
+double video_streamer::rate_controller::quality_to_scale(double quality) {
+	return quality < 50 ? 5000.0 / quality : 200.0 - 2.0 * quality;
+}
+
+double video_streamer::rate_controller::scale_to_quality(double scale) {
+	return scale >= 100.0 ? 5000.0 / scale : (200.0 - scale) / 2.0;
+}
+
+void video_streamer::rate_controller::record(size_t bytes, std::chrono::steady_clock::time_point time) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_samples.push_back(sample { time, bytes });
+	m_window_bytes += bytes;
+	while (m_samples.size() > 1 && time - m_samples.front().time > m_window) {
+		m_window_bytes -= m_samples.front().bytes;
+		m_samples.pop_front();
+	}
+	if (m_samples.size() < 2) return;
+	// N samples span N - 1 frame intervals, the newest frame is not a part of the measured period
+	double span = std::chrono::duration<double>(time - m_samples.front().time).count();
+	if (span <= 0) return;
+	double frame_rate = (double) (m_samples.size() - 1) / span;
+	double bitrate = 8.0 * (double) (m_window_bytes - bytes) / span;
+	m_measured_bitrate.store((uint64_t) bitrate, std::memory_order_relaxed);
+	if (!enabled()) return;
+	size_t budget = (size_t) ((double) m_target_bitrate / 8.0 / frame_rate);
+	m_frame_budget.store(budget, std::memory_order_relaxed);
+	if (!budget || !bytes) return;
+	// React to every frame (the window average lags behind too much for a stable loop): compressed
+	// size is sublinear in the quantization scale, so a partial step in the log domain converges
+	// over a few frames without oscillating
+	double error = (double) bytes / (double) budget;
+	double correction = std::pow(error, 0.3);
+	double min_scale = quality_to_scale(m_max_quality);
+	double max_scale = quality_to_scale(m_min_quality);
+	m_scale = std::min(std::max(m_scale * correction, min_scale), max_scale);
+	int quality = (int) std::lround(scale_to_quality(m_scale));
+	m_quality.store(std::min(std::max(quality, m_min_quality), m_max_quality), std::memory_order_relaxed);
+}
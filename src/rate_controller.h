@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+
+namespace video_streamer {
+	
+	/*
+	 * Holds the stream bitrate near the target by adjusting JPEG quality. Output bytes and frame
+	 * rate are measured over a sliding window, which gives the per-frame byte budget; every
+	 * recorded frame moves the libjpeg quality scale towards the budget (with damping).
+	 * A zero target disables the controller, quality stays at its initial value then.
+	 */
+	class rate_controller final {
+		struct sample {
+			std::chrono::steady_clock::time_point time;
+			size_t bytes;
+		};
+		
+		uint64_t m_target_bitrate;
+		std::chrono::steady_clock::duration m_window;
+		int m_min_quality;
+		int m_max_quality;
+		std::mutex m_mutex;
+		std::deque<sample> m_samples;
+		uint64_t m_window_bytes;
+		double m_scale;
+		std::atomic<int> m_quality;
+		std::atomic<size_t> m_frame_budget;
+		std::atomic<uint64_t> m_measured_bitrate;
+		
+		static double quality_to_scale(double quality);
+		static double scale_to_quality(double scale);
+		
+	public:
+		explicit rate_controller(
+				uint64_t target_bitrate,
+				int initial_quality = 80,
+				int min_quality = 10,
+				int max_quality = 95,
+				std::chrono::steady_clock::duration window = std::chrono::seconds(1)
+		);
+		
+		bool enabled() const {
+			return m_target_bitrate > 0;
+		}
+		
+		uint64_t target_bitrate() const {
+			return m_target_bitrate;
+		}
+		
+		// Quality to use for the next encoded frame
+		int quality() const {
+			return m_quality.load(std::memory_order_relaxed);
+		}
+		
+		// Bytes a single frame may take at the measured frame rate, 0 until it is known
+		size_t frame_budget() const {
+			return m_frame_budget.load(std::memory_order_relaxed);
+		}
+		
+		uint64_t measured_bitrate() const {
+			return m_measured_bitrate.load(std::memory_order_relaxed);
+		}
+		
+		// Accounts a frame which is going to be sent
+		void record(size_t bytes, std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now());
+		
+	};
+	
+}
@@ -0,0 +1,291 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <easylogging++.h>
+#include "recorder.h"
+#include "frame_pool.h"
+
+static const char recording_index_magic[8] = { 'V', 'S', 'R', 'I', 'D', 'X', '0', '1' };
+
+static_assert(sizeof(video_streamer::recording_index_header) == 24, "The index header is a file format");
+static_assert(sizeof(video_streamer::recording_index_entry) == 24, "Index entries are a file format");
+
+bool video_streamer::read_recording_index(
+		const std::string &path, recording_index_header &header, std::vector<recording_index_entry> &entries
+) {
+	posix::unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+	struct stat st = {};
+	if (fd < 0 || fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(header)) {
+		return false;
+	}
+	if (pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+		return false;
+	}
+	if (memcmp(header.magic, recording_index_magic, sizeof(recording_index_magic)) != 0) {
+		return false;
+	}
+	// A trailing partial entry is left by a crash in the middle of a write
+	entries.resize(((size_t) st.st_size - sizeof(header)) / sizeof(recording_index_entry));
+	size_t size = entries.size() * sizeof(recording_index_entry);
+	return pread(fd, entries.data(), size, sizeof(header)) == (ssize_t) size;
+}
+
+video_streamer::segment_recorder::segment_recorder(
+		std::string directory, uint64_t segment_size, size_t chunk_size, size_t chunk_count,
+		std::chrono::steady_clock::duration flush_interval
+): m_directory(std::move(directory)), m_segment_size(segment_size), m_chunk_size(chunk_size),
+	m_flush_interval(flush_interval), m_stopping(false), m_segment(0), m_segment_used(segment_size), m_open_segment(0), m_data_fd(-1), m_index_fd(-1), m_data_size(0),
+	m_frames_recorded(0), m_frames_dropped(0), m_bytes_written(0), m_segments(0), m_write_errors(0)
+{
+	struct stat st = {};
+	if (stat(m_directory.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+		throw std::invalid_argument("Recording directory " + m_directory + " doesn't exist");
+	}
+	for (size_t i = 0; i < chunk_count; i++) {
+		std::unique_ptr<chunk> item(new chunk());
+		item->data = frame_pool::instance().acquire_buffer(m_chunk_size);
+		item->used = 0;
+		item->flushed = 0;
+		m_free_chunks.emplace_back(std::move(item));
+	}
+	m_thread = std::thread([this] {
+		run();
+	});
+}
+
+video_streamer::segment_recorder::~segment_recorder() {
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_current && m_current->used > 0) {
+			submit_current();
+		}
+		m_stopping = true;
+	}
+	m_cond.notify_one();
+	m_thread.join();
+}
+
+void video_streamer::segment_recorder::submit_current() {
+	m_full_chunks.emplace_back(std::move(m_current));
+	m_cond.notify_one();
+}
+
+bool video_streamer::segment_recorder::current_is_stale(std::chrono::steady_clock::time_point now) const {
+	return m_current && m_current->used > m_current->flushed && now - m_current->started >= m_flush_interval;
+}
+
+void video_streamer::segment_recorder::flush_current() {
+	if (m_free_chunks.empty()) {
+		// The I/O thread is behind anyway, try again with the next frame
+		return;
+	}
+	auto copy = std::move(m_free_chunks.back());
+	m_free_chunks.pop_back();
+	memcpy(copy->data.data(), m_current->data.data(), m_current->used);
+	copy->used = m_current->used;
+	copy->segment = m_current->segment;
+	copy->segment_offset = m_current->segment_offset;
+	// Every index entry is written once, by the first write covering its frame
+	copy->entries.swap(m_current->entries);
+	m_current->flushed = m_current->used;
+	m_full_chunks.emplace_back(std::move(copy));
+	m_cond.notify_one();
+}
+
+void video_streamer::segment_recorder::record(const image_buffer &buffer, const frame_metadata &metadata) {
+	size_t size = buffer.size();
+	if (size == 0 || size > m_segment_size) {
+		m_frames_dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	// Held while copying, the I/O thread takes it only to hand chunks over and never while writing
+	std::unique_lock<std::mutex> lock(m_mutex);
+	auto now = std::chrono::steady_clock::now();
+	if (current_is_stale(now)) {
+		flush_current();
+	}
+	if (m_segment_used + size > m_segment_size) {
+		if (m_current && m_current->used > 0) {
+			submit_current();
+		}
+		m_current.reset();
+		m_segment++;
+		m_segment_used = 0;
+	}
+	// Reserve every chunk the frame spans up front, a frame is either recorded as a whole or dropped
+	size_t available = m_current ? m_chunk_size - m_current->used : 0;
+	size_t needed = size > available ? (size - available + m_chunk_size - 1) / m_chunk_size : 0;
+	std::vector<std::unique_ptr<chunk>> reserved;
+	if (m_free_chunks.size() < needed) {
+		m_frames_dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	for (size_t i = 0; i < needed; i++) {
+		reserved.emplace_back(std::move(m_free_chunks.back()));
+		m_free_chunks.pop_back();
+	}
+	recording_index_entry entry = {
+			m_segment_used,
+			(uint32_t) size,
+			metadata.sequence,
+			std::chrono::duration_cast<std::chrono::nanoseconds>(metadata.timestamp.time_since_epoch()).count()
+	};
+	auto data = buffer.data();
+	while (size > 0) {
+		if (!m_current) {
+			m_current = std::move(reserved.back());
+			reserved.pop_back();
+			m_current->used = 0;
+			m_current->segment = m_segment;
+			m_current->segment_offset = m_segment_used;
+			m_current->flushed = 0;
+		}
+		if (m_current->used == m_current->flushed) {
+			m_current->started = now;
+		}
+		size_t part = std::min(size, m_chunk_size - m_current->used);
+		memcpy(m_current->data.data() + m_current->used, data, part);
+		m_current->used += part;
+		m_segment_used += part;
+		data += part;
+		size -= part;
+		if (size == 0) {
+			m_current->entries.push_back(entry);
+		}
+		if (m_current->used == m_chunk_size) {
+			submit_current();
+		}
+	}
+	m_frames_recorded.fetch_add(1, std::memory_order_relaxed);
+}
+
+void video_streamer::segment_recorder::run() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		m_cond.wait_for(lock, m_flush_interval, [this] {
+			return !m_full_chunks.empty() || m_stopping;
+		});
+		if (m_full_chunks.empty()) {
+			if (m_stopping) break;
+			// Frames stopped coming (or come rarely), don't keep the last ones in memory only
+			if (current_is_stale(std::chrono::steady_clock::now())) {
+				flush_current();
+			}
+			continue;
+		}
+		auto item = std::move(m_full_chunks.front());
+		m_full_chunks.pop_front();
+		lock.unlock();
+		write_chunk(*item);
+		item->used = 0;
+		item->entries.clear();
+		lock.lock();
+		m_free_chunks.emplace_back(std::move(item));
+	}
+	lock.unlock();
+	close_segment();
+}
+
+void video_streamer::segment_recorder::write_chunk(chunk &chunk) {
+	if (chunk.segment != m_open_segment) {
+		close_segment();
+		open_segment(chunk.segment);
+	}
+	if (m_data_fd < 0) {
+		m_write_errors.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	size_t written = 0;
+	while (written < chunk.used) {
+		ssize_t r = pwrite(
+				m_data_fd, chunk.data.data() + written, chunk.used - written, (off_t) (chunk.segment_offset + written)
+		);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			LOG(ERROR) << "Unable to write recording: " << strerror(errno);
+			m_write_errors.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		written += (size_t) r;
+	}
+	m_data_size = std::max(m_data_size, chunk.segment_offset + chunk.used);
+	m_bytes_written.fetch_add(chunk.used, std::memory_order_relaxed);
+	// The index only refers to data which has been written
+	if (!chunk.entries.empty()) {
+		size_t size = chunk.entries.size() * sizeof(recording_index_entry);
+		if (write(m_index_fd, chunk.entries.data(), size) != (ssize_t) size) {
+			LOG(ERROR) << "Unable to write recording index: " << strerror(errno);
+			m_write_errors.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+}
+
+void video_streamer::segment_recorder::open_segment(uint64_t segment) {
+	m_open_segment = segment;
+	m_data_size = 0;
+	auto wall_clock = std::chrono::system_clock::now();
+	auto steady_clock = std::chrono::steady_clock::now();
+	time_t now = std::chrono::system_clock::to_time_t(wall_clock);
+	tm utc = {};
+	gmtime_r(&now, &utc);
+	char name[64];
+	snprintf(
+			name, sizeof(name), "%04d%02d%02d-%02d%02d%02d-%06llu",
+			utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec,
+			(unsigned long long) segment
+	);
+	std::string base = m_directory + "/" + name;
+	m_data_fd = posix::unique_fd(open((base + ".mjpg").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+	if (m_data_fd < 0) {
+		LOG(ERROR) << "Unable to create " << base << ".mjpg: " << strerror(errno);
+		return;
+	}
+	// Reserve the whole segment at once, so that the file isn't fragmented by small extents
+	int error = posix_fallocate(m_data_fd, 0, (off_t) m_segment_size);
+	if (error != 0) {
+		LOG(WARNING) << "Unable to preallocate " << base << ".mjpg: " << strerror(error);
+	}
+	m_index_fd = posix::unique_fd(open((base + ".idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+	recording_index_header header = {};
+	memcpy(header.magic, recording_index_magic, sizeof(recording_index_magic));
+	header.wall_clock_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			wall_clock.time_since_epoch()
+	).count();
+	header.steady_clock_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			steady_clock.time_since_epoch()
+	).count();
+	if (m_index_fd < 0 || write(m_index_fd, &header, sizeof(header)) != (ssize_t) sizeof(header)) {
+		LOG(ERROR) << "Unable to create " << base << ".idx: " << strerror(errno);
+		m_data_fd = posix::unique_fd(-1);
+		m_index_fd = posix::unique_fd(-1);
+		return;
+	}
+	m_segments.fetch_add(1, std::memory_order_relaxed);
+	LOG(INFO) << "Recording to " << base << ".mjpg";
+}
+
+void video_streamer::segment_recorder::close_segment() {
+	if (m_data_fd >= 0) {
+		// Give back the preallocated space which wasn't used
+		if (ftruncate(m_data_fd, (off_t) m_data_size) != 0) {
+			LOG(WARNING) << "Unable to truncate recording: " << strerror(errno);
+		}
+	}
+	m_data_fd = posix::unique_fd(-1);
+	m_index_fd = posix::unique_fd(-1);
+}
+
+video_streamer::recorder_stats video_streamer::segment_recorder::stats() const {
+	return recorder_stats {
+			m_frames_recorded.load(std::memory_order_relaxed),
+			m_frames_dropped.load(std::memory_order_relaxed),
+			m_bytes_written.load(std::memory_order_relaxed),
+			m_segments.load(std::memory_order_relaxed),
+			m_write_errors.load(std::memory_order_relaxed)
+	};
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "video_streamer.h"
+#include "unique_fd.h"
+
+namespace video_streamer {
+	
+	/*
+	 * Sidecar index of a recorded segment ("<segment>.idx" next to "<segment>.mjpg"): a header followed by
+	 * one fixed size entry per frame, in recording order. Timestamps are steady clock nanoseconds (the
+	 * capture timestamps), the header maps them to the wall clock.
+	 */
+	struct recording_index_header {
+		char magic[8];
+		int64_t wall_clock_ns;
+		int64_t steady_clock_ns;
+	};
+	
+	struct recording_index_entry {
+		uint64_t offset;
+		uint32_t size;
+		uint32_t sequence;
+		int64_t timestamp_ns;
+	};
+	
+	// Returns false if the file is missing or isn't a recording index
+	bool read_recording_index(
+			const std::string &path, recording_index_header &header, std::vector<recording_index_entry> &entries
+	);
+	
+	struct recorder_stats {
+		uint64_t frames_recorded;
+		// Frames skipped because the I/O thread was behind and all chunks were full
+		uint64_t frames_dropped;
+		uint64_t bytes_written;
+		uint64_t segments;
+		uint64_t write_errors;
+	};
+	
+	/*
+	 * Appends frames to segment files of a fixed (preallocated) size in a directory. record() only copies
+	 * the frame into a chunk of memory, full chunks are written by a separate I/O thread with a single
+	 * aligned pwrite() each. When the disk stalls and every chunk is waiting for the I/O thread,
+	 * new frames are dropped from the recording, so capture and streaming never wait for the disk.
+	 * A partly filled chunk is written as well once its oldest frame is flush_interval old, so that
+	 * at low bitrates the files and the index (which may be read while recording) don't lag behind.
+	 * Such a chunk is written from a copy and stays current (to be written again, whole, later),
+	 * so writes always start at chunk boundaries.
+	 */
+	class segment_recorder final {
+		struct chunk {
+			image_buffer data { nullptr, 0 };
+			size_t used;
+			// Position of the chunk in its segment
+			uint64_t segment_offset;
+			uint64_t segment;
+			// Bytes already written from a copy while the chunk was being filled
+			size_t flushed;
+			// When the first byte which isn't written yet was copied to the chunk
+			std::chrono::steady_clock::time_point started;
+			// Frames completed in this chunk
+			std::vector<recording_index_entry> entries;
+		};
+		
+		std::string m_directory;
+		uint64_t m_segment_size;
+		size_t m_chunk_size;
+		std::chrono::steady_clock::duration m_flush_interval;
+		
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+		std::vector<std::unique_ptr<chunk>> m_free_chunks;
+		std::deque<std::unique_ptr<chunk>> m_full_chunks;
+		bool m_stopping;
+		
+		// Filled by the recording thread, flushed by the I/O thread when no frame came for flush_interval
+		std::unique_ptr<chunk> m_current;
+		uint64_t m_segment;
+		uint64_t m_segment_used;
+		
+		// Owned by the I/O thread
+		uint64_t m_open_segment;
+		posix::unique_fd m_data_fd;
+		posix::unique_fd m_index_fd;
+		uint64_t m_data_size;
+		
+		std::atomic<uint64_t> m_frames_recorded;
+		std::atomic<uint64_t> m_frames_dropped;
+		std::atomic<uint64_t> m_bytes_written;
+		std::atomic<uint64_t> m_segments;
+		std::atomic<uint64_t> m_write_errors;
+		std::thread m_thread;
+		
+		// Called with m_mutex locked
+		void submit_current();
+		bool current_is_stale(std::chrono::steady_clock::time_point now) const;
+		void flush_current();
+		void run();
+		void write_chunk(chunk &chunk);
+		void open_segment(uint64_t segment);
+		void close_segment();
+	
+	public:
+		segment_recorder(
+				std::string directory,
+				uint64_t segment_size = 256 * 1024 * 1024,
+				size_t chunk_size = 1024 * 1024,
+				size_t chunk_count = 32,
+				std::chrono::steady_clock::duration flush_interval = std::chrono::seconds(1)
+		);
+		segment_recorder(const segment_recorder&) = delete;
+		// Writes everything recorded so far
+		~segment_recorder();
+		// Must be called from a single thread
+		void record(const image_buffer &buffer, const frame_metadata &metadata);
+		recorder_stats stats() const;
+		
+	};
+	
+}
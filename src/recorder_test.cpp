@@ -0,0 +1,159 @@
+#include <dirent.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <easylogging++.h>
+#include "recorder.h"
+
+INITIALIZE_EASYLOGGINGPP
+
+/*
+ * Records frames of odd sizes with a short flush interval, so that partly filled chunks are flushed
+ * while frames keep coming, and checks that every data write starts at a chunk boundary, that the index
+ * follows the recording and that the segment holds every frame at its indexed offset.
+ */
+
+namespace {
+	
+	const size_t chunk_size = 64 * 1024;
+	const uint64_t segment_size = 16 * chunk_size;
+	const auto flush_interval = std::chrono::milliseconds(50);
+	
+	std::mutex write_offsets_mutex;
+	std::vector<off_t> write_offsets;
+	
+	// Every pwrite() of the process comes from the recorder
+	ssize_t record_pwrite(int fd, const void *data, size_t size, off_t offset) {
+		typedef ssize_t (*pwrite_function)(int, const void*, size_t, off_t);
+		static auto next = (pwrite_function) dlsym(RTLD_NEXT, "pwrite");
+		{
+			std::unique_lock<std::mutex> lock(write_offsets_mutex);
+			write_offsets.push_back(offset);
+		}
+		return next(fd, data, size, offset);
+	}
+	
+	std::vector<uint8_t> make_frame(int index) {
+		std::vector<uint8_t> frame(3001 + (size_t) index * 997 % 20011);
+		for (size_t i = 0; i < frame.size(); i++) {
+			frame[i] = (uint8_t) (index * 31 + i);
+		}
+		return frame;
+	}
+	
+	std::string find_segment(const std::string &directory, const char *extension) {
+		std::string result;
+		DIR *dir = opendir(directory.c_str());
+		while (auto entry = readdir(dir)) {
+			std::string name = entry->d_name;
+			if (name.size() > 4 && name.compare(name.size() - 4, 4, extension) == 0) {
+				result = directory + "/" + name;
+			}
+		}
+		closedir(dir);
+		return result;
+	}
+	
+	bool fail(const std::string &message) {
+		std::cerr << message << std::endl;
+		return false;
+	}
+	
+	bool check_index(const std::string &directory, size_t expected) {
+		video_streamer::recording_index_header header;
+		std::vector<video_streamer::recording_index_entry> entries;
+		if (!video_streamer::read_recording_index(find_segment(directory, ".idx"), header, entries)) {
+			return fail("No recording index");
+		}
+		if (entries.size() != expected) {
+			return fail("The index has " + std::to_string(entries.size()) + " entries, expected " +
+					std::to_string(expected));
+		}
+		return true;
+	}
+	
+	bool run_test(const std::string &directory) {
+		const int frame_count = 60;
+		{
+			video_streamer::segment_recorder recorder(directory, segment_size, chunk_size, 8, flush_interval);
+			for (int i = 0; i < frame_count; i++) {
+				auto frame = make_frame(i);
+				video_streamer::frame_metadata metadata;
+				metadata.index = (uint64_t) i;
+				metadata.sequence = (uint32_t) i;
+				recorder.record(video_streamer::image_buffer(frame.data(), frame.size()), metadata);
+				if (i % 10 == 9) {
+					// The last frames are in a partly filled chunk, only the stale flush writes them
+					std::this_thread::sleep_for(flush_interval * 4);
+					if (!check_index(directory, (size_t) i + 1)) {
+						return false;
+					}
+				}
+			}
+			if (recorder.stats().frames_dropped != 0) {
+				return fail("Frames were dropped");
+			}
+		}
+		for (auto offset : write_offsets) {
+			if (offset % chunk_size != 0) {
+				return fail("A write at " + std::to_string(offset) + " doesn't start at a chunk boundary");
+			}
+		}
+		video_streamer::recording_index_header header;
+		std::vector<video_streamer::recording_index_entry> entries;
+		video_streamer::read_recording_index(find_segment(directory, ".idx"), header, entries);
+		std::ifstream file(find_segment(directory, "mjpg"), std::ios::binary);
+		std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		uint64_t offset = 0;
+		for (size_t i = 0; i < entries.size(); i++) {
+			auto frame = make_frame((int) i);
+			if (entries[i].offset != offset || entries[i].size != frame.size() || entries[i].sequence != i) {
+				return fail("Index entry #" + std::to_string(i) + " doesn't describe the frame");
+			}
+			if (offset + frame.size() > data.size() || memcmp(data.data() + offset, frame.data(), frame.size()) != 0) {
+				return fail("Frame #" + std::to_string(i) + " differs from the recorded one");
+			}
+			offset += frame.size();
+		}
+		if (entries.size() != (size_t) frame_count || data.size() != offset) {
+			return fail("The segment doesn't end with the last frame");
+		}
+		std::cout << frame_count << " frames in " << write_offsets.size() << " chunk aligned writes OK" << std::endl;
+		return true;
+	}
+	
+}
+
+extern "C" ssize_t pwrite(int fd, const void *data, size_t size, off_t offset) {
+	return record_pwrite(fd, data, size, offset);
+}
+
+extern "C" ssize_t pwrite64(int fd, const void *data, size_t size, off_t offset) {
+	return record_pwrite(fd, data, size, offset);
+}
+
+int main() {
+	char directory[] = "/tmp/recorder_test.XXXXXX";
+	if (!mkdtemp(directory)) {
+		std::cerr << "Unable to create a temporary directory" << std::endl;
+		return 1;
+	}
+	bool ok = run_test(directory);
+	for (auto extension : { ".idx", "mjpg" }) {
+		auto path = find_segment(directory, extension);
+		if (!path.empty()) {
+			unlink(path.c_str());
+		}
+	}
+	rmdir(directory);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+
+namespace video_streamer {
+	
+	/*
+	 * Releases items pushed by several threads in the order of their indices. Every index
+	 * should be either pushed or skipped. When an index is missing for longer than max_wait
+	 * (or too many items are pending) it is given up and the following items are released;
+	 * if it arrives later it is discarded. The check happens on every push.
+	 */
+	template<typename T> class reorder_buffer final {
+		struct pending_item {
+			T item;
+			bool skipped;
+			std::chrono::steady_clock::time_point arrived_at;
+		};
+		
+		std::mutex m_mutex;
+		std::map<uint64_t, pending_item> m_pending;
+		uint64_t m_next_index;
+		std::chrono::steady_clock::duration m_max_wait;
+		size_t m_max_pending;
+		std::function<void(T&)> m_output;
+		uint64_t m_late_count = 0;
+		uint64_t m_lost_count = 0;
+		
+		void add(uint64_t index, T item, bool skipped) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (index < m_next_index) {
+				if (!skipped) {
+					m_late_count++;
+				}
+				return;
+			}
+			auto now = std::chrono::steady_clock::now();
+			m_pending.emplace(index, pending_item { std::move(item), skipped, now });
+			while (!m_pending.empty()) {
+				auto it = m_pending.begin();
+				if (it->first != m_next_index) {
+					if (it->second.arrived_at + m_max_wait > now && m_pending.size() <= m_max_pending) {
+						break;
+					}
+					m_lost_count += it->first - m_next_index;
+					m_next_index = it->first;
+				}
+				if (!it->second.skipped) {
+					m_output(it->second.item);
+				}
+				m_pending.erase(it);
+				m_next_index++;
+			}
+		}
+		
+	public:
+		reorder_buffer(
+				std::function<void(T&)> output,
+				std::chrono::steady_clock::duration max_wait,
+				size_t max_pending = 16,
+				uint64_t first_index = 0
+		): m_next_index(first_index), m_max_wait(max_wait), m_max_pending(max_pending),
+			m_output(std::move(output)) {
+		}
+		
+		void push(uint64_t index, T item) {
+			add(index, std::move(item), false);
+		}
+		
+		void skip(uint64_t index) {
+			add(index, T(), true);
+		}
+		
+		// Items which arrived after they had been given up
+		uint64_t late_count() {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			return m_late_count;
+		}
+		
+		// Indices which were given up without being pushed or skipped
+		uint64_t lost_count() {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			return m_lost_count;
+		}
+		
+	};
+	
+}
@@ -0,0 +1,73 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <easylogging++.h>
+#include "replay_source.h"
+#include "recorder.h"
+#include "unique_fd.h"
+
+video_streamer::replay_source::replay_source(
+		std::string path, double fps
+): m_path(std::move(path)), m_data(nullptr), m_size(0), m_width(0), m_height(0), m_pacer(fps),
+	m_next_frame_index(0)
+{
+	posix::unique_fd fd(open(m_path.c_str(), O_RDONLY | O_CLOEXEC));
+	struct stat st = {};
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		throw std::runtime_error("Unable to open " + m_path + ": " + strerror(errno));
+	}
+	m_size = (size_t) st.st_size;
+	if (m_size == 0) {
+		throw std::runtime_error(m_path + " is empty");
+	}
+	m_data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m_data == MAP_FAILED) {
+		m_data = nullptr;
+		throw std::runtime_error("Unable to map " + m_path + ": " + strerror(errno));
+	}
+	madvise(m_data, m_size, MADV_WILLNEED);
+	auto data = (const uint8_t*) m_data;
+	// Recordings come with an index, there is no need to look for images then
+	recording_index_header index_header = {};
+	std::vector<recording_index_entry> index;
+	auto extension = m_path.rfind('.');
+	auto index_path = m_path.substr(0, extension) + ".idx";
+	if (extension != std::string::npos && read_recording_index(index_path, index_header, index)) {
+		for (auto &entry : index) {
+			if (entry.offset + entry.size > m_size) break;
+			m_frames.emplace_back(entry.offset, entry.size);
+		}
+	}
+	size_t offset = 0;
+	while (m_frames.empty() && offset < m_size) {
+		// Skip anything between the images (e.g. multipart headers)
+		auto start = (const uint8_t*) memmem(data + offset, m_size - offset, "\xFF\xD8\xFF", 3);
+		if (start == nullptr) break;
+		offset = start - data;
+		auto size = measure_jpeg(start, m_size - offset);
+		if (!size) break;
+		m_frames.emplace_back(offset, size);
+		offset += size;
+	}
+	if (m_frames.empty() || !scan_jpeg_geometry(data + m_frames[0].first, m_frames[0].second, m_width, m_height)) {
+		munmap(m_data, m_size);
+		throw std::runtime_error(m_path + " doesn't contain JPEG images");
+	}
+	LOG(INFO) << "Replaying " << m_frames.size() << " frames (" << m_width << "x" << m_height << ") from " << m_path;
+}
+
+video_streamer::replay_source::~replay_source() {
+	munmap(m_data, m_size);
+}
+
+video_streamer::image_buffer video_streamer::replay_source::read_buffer(frame_metadata &metadata) {
+	metadata.timestamp = m_pacer.wait();
+	metadata.sequence = (uint32_t) m_next_frame_index;
+	metadata.index = m_next_frame_index++;
+	auto &frame = m_frames[metadata.index % m_frames.size()];
+	// The mapping is read-only and lives as long as the source
+	return image_buffer((uint8_t*) m_data + frame.first, frame.second);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+#include "capture_source.h"
+
+namespace video_streamer {
+	
+	/*
+	 * Plays back a recorded MJPEG stream (concatenated JPEG images, as received by a raw TCP client)
+	 * from a memory mapped file, at the given rate or as fast as possible. Playback loops.
+	 */
+	class replay_source final: public capture_source {
+		std::string m_path;
+		void *m_data;
+		size_t m_size;
+		// Offset and size of every image in the file
+		std::vector<std::pair<size_t, size_t>> m_frames;
+		int m_width;
+		int m_height;
+		frame_pacer m_pacer;
+		uint64_t m_next_frame_index;
+		
+	public:
+		replay_source(std::string path, double fps);
+		~replay_source() override;
+		v4l2::format pixel_format() const override {
+			return v4l2::format::MJPEG;
+		}
+		int frame_width() const override {
+			return m_width;
+		}
+		int frame_height() const override {
+			return m_height;
+		}
+		int frame_stride() const override {
+			return 0;
+		}
+		size_t frame_count() const {
+			return m_frames.size();
+		}
+		image_buffer read_buffer(frame_metadata &metadata) override;
+		
+	};
+	
+}
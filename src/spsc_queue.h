@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace video_streamer {
+	
+	/*
+	 * Bounded lock-free queue for exactly one producer thread and one consumer thread.
+	 * Head and tail are free running counters kept on separate cache lines.
+	 */
+	template<typename T> class spsc_queue final {
+		typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type slot;
+		
+		std::unique_ptr<slot[]> m_slots;
+		size_t m_capacity;
+		// Written by the consumer only
+		std::atomic<size_t> m_head;
+		char m_head_padding[64 - sizeof(std::atomic<size_t>)];
+		// Written by the producer only
+		std::atomic<size_t> m_tail;
+		char m_tail_padding[64 - sizeof(std::atomic<size_t>)];
+		
+		T *item(size_t position) {
+			return reinterpret_cast<T*>(&m_slots[position % m_capacity]);
+		}
+		
+	public:
+		explicit spsc_queue(size_t capacity): m_slots(new slot[capacity]), m_capacity(capacity), m_head(0), m_tail(0) {
+		}
+		spsc_queue(const spsc_queue&) = delete;
+		~spsc_queue() {
+			for (auto position = m_head.load(); position != m_tail.load(); position++) {
+				item(position)->~T();
+			}
+		}
+		
+		// Producer side, the value is moved from only if there is room for it
+		bool try_push(T &&value) {
+			auto tail = m_tail.load(std::memory_order_relaxed);
+			if (tail - m_head.load(std::memory_order_acquire) >= m_capacity) {
+				return false;
+			}
+			new (item(tail)) T(std::move(value));
+			m_tail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+		
+		// Consumer side
+		bool try_pop(T &value) {
+			auto head = m_head.load(std::memory_order_relaxed);
+			if (head == m_tail.load(std::memory_order_acquire)) {
+				return false;
+			}
+			value = std::move(*item(head));
+			item(head)->~T();
+			m_head.store(head + 1, std::memory_order_release);
+			return true;
+		}
+		
+		// Approximate when called concurrently with push or pop
+		size_t size() const {
+			auto head = m_head.load(std::memory_order_relaxed);
+			auto tail = m_tail.load(std::memory_order_relaxed);
+			return tail > head ? tail - head : 0;
+		}
+		
+		size_t capacity() const {
+			return m_capacity;
+		}
+		
+	};
+	
+	/*
+	 * Lets the consumer of one or more queues sleep while they are empty (or a producer while its queue
+	 * is full). The other side calls notify() after every push (pop) and only touches the mutex when
+	 * somebody actually sleeps.
+	 */
+	class queue_signal final {
+		std::atomic<bool> m_waiting;
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+		
+	public:
+		queue_signal(): m_waiting(false) {
+		}
+		queue_signal(const queue_signal&) = delete;
+		
+		void notify() {
+			// Pairs with the fence in wait(): either the consumer sees the new item or we see it waiting
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (m_waiting.load(std::memory_order_relaxed)) {
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_cond.notify_one();
+			}
+		}
+		
+		template<typename Predicate> void wait(Predicate ready, std::chrono::steady_clock::duration timeout) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_waiting.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!ready()) {
+				m_cond.wait_for(lock, timeout);
+			}
+			m_waiting.store(false, std::memory_order_relaxed);
+		}
+		
+	};
+	
+}
@@ -0,0 +1,96 @@
+#include <stdexcept>
+#include "synthetic_source.h"
+
+static const int synthetic_frame_count = 8;
+
+// Eight vertical bars (like SMPTE color bars) scrolling to the right with the frame number
+static void synthetic_color(int x, int y, int width, int height, int frame, uint8_t &r, uint8_t &g, uint8_t &b) {
+	int bar = ((x + frame * width / (8 * synthetic_frame_count)) * 8 / width) % 8;
+	int level = 64 + 160 * (height - y) / height;
+	r = (uint8_t) (bar & 4 ? level : 16);
+	g = (uint8_t) (bar & 2 ? level : 16);
+	b = (uint8_t) (bar & 1 ? level : 16);
+}
+
+video_streamer::synthetic_source::synthetic_source(
+		int width, int height, v4l2::format format, double fps, int quality
+): m_width(width & ~1), m_height(height), m_format(format), m_pacer(fps), m_next_frame_index(0) {
+	if (m_width <= 0 || m_height <= 0) {
+		throw std::invalid_argument("Synthetic frame size must be positive");
+	}
+	if (!supports_format(format)) {
+		throw std::invalid_argument("Synthetic frames can be either MJPEG or packed YUV 4:2:2");
+	}
+	for (int frame = 0; frame < synthetic_frame_count; frame++) {
+		uint8_t r, g, b;
+		if (format == v4l2::format::MJPEG) {
+			uncompressed_frame image(m_width, m_height, 3);
+			for (int y = 0; y < m_height; y++) {
+				auto row = image.row(y);
+				for (int x = 0; x < m_width; x++) {
+					synthetic_color(x, y, m_width, m_height, frame, r, g, b);
+					row[x * 3] = r;
+					row[x * 3 + 1] = g;
+					row[x * 3 + 2] = b;
+				}
+			}
+			jpeg_frame encoded(image, JCS_RGB, 3, quality);
+			m_frames.emplace_back(encoded.buffer().data(), encoded.buffer().data() + encoded.buffer().size());
+			continue;
+		}
+		// Byte positions of Y0, U, Y1, V in a macropixel
+		int y0, u, y1, v;
+		switch (format) {
+			case v4l2::format::YUYV:
+				y0 = 0, u = 1, y1 = 2, v = 3;
+				break;
+			case v4l2::format::YVYU:
+				y0 = 0, v = 1, y1 = 2, u = 3;
+				break;
+			case v4l2::format::UYVY:
+				u = 0, y0 = 1, v = 2, y1 = 3;
+				break;
+			case v4l2::format::VYUY:
+				v = 0, y0 = 1, u = 2, y1 = 3;
+				break;
+			default:
+				throw std::invalid_argument("Synthetic frames can be either MJPEG or packed YUV 4:2:2");
+		}
+		std::vector<uint8_t> pixels((size_t) frame_stride() * m_height);
+		for (int y = 0; y < m_height; y++) {
+			auto row = pixels.data() + (size_t) y * frame_stride();
+			for (int x = 0; x < m_width; x += 2) {
+				// BT.601 full range, chroma of the left pixel
+				synthetic_color(x, y, m_width, m_height, frame, r, g, b);
+				row[x * 2 + y0] = (uint8_t) ((77 * r + 150 * g + 29 * b) >> 8);
+				row[x * 2 + u] = (uint8_t) ((-43 * r - 85 * g + 128 * b + 32768) >> 8);
+				row[x * 2 + v] = (uint8_t) ((128 * r - 107 * g - 21 * b + 32768) >> 8);
+				synthetic_color(x + 1, y, m_width, m_height, frame, r, g, b);
+				row[x * 2 + y1] = (uint8_t) ((77 * r + 150 * g + 29 * b) >> 8);
+			}
+		}
+		m_frames.emplace_back(std::move(pixels));
+	}
+}
+
+video_streamer::image_buffer video_streamer::synthetic_source::read_buffer(frame_metadata &metadata) {
+	metadata.timestamp = m_pacer.wait();
+	metadata.sequence = (uint32_t) m_next_frame_index;
+	metadata.index = m_next_frame_index++;
+	auto &frame = m_frames[metadata.index % m_frames.size()];
+	// Frames are immutable and live as long as the source
+	return image_buffer(const_cast<uint8_t*>(frame.data()), frame.size());
+}
+
+bool video_streamer::synthetic_source::supports_format(v4l2::format format) {
+	switch (format) {
+		case v4l2::format::MJPEG:
+		case v4l2::format::YUYV:
+		case v4l2::format::YVYU:
+		case v4l2::format::UYVY:
+		case v4l2::format::VYUY:
+			return true;
+		default:
+			return false;
+	}
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vector>
+#include "capture_source.h"
+
+namespace video_streamer {
+	
+	/*
+	 * Produces a looping animation (moving color bars) of the given size and rate without any hardware.
+	 * A handful of distinct frames are rendered in advance, in MJPEG or packed YUV 4:2:2, so that generating
+	 * frames costs nothing and the rest of the pipeline can be measured.
+	 */
+	class synthetic_source final: public capture_source {
+		int m_width;
+		int m_height;
+		v4l2::format m_format;
+		std::vector<std::vector<uint8_t>> m_frames;
+		frame_pacer m_pacer;
+		uint64_t m_next_frame_index;
+		
+	public:
+		synthetic_source(int width, int height, v4l2::format format, double fps, int quality = 80);
+		// MJPEG and the packed YUV 4:2:2 formats
+		static bool supports_format(v4l2::format format);
+		v4l2::format pixel_format() const override {
+			return m_format;
+		}
+		int frame_width() const override {
+			return m_width;
+		}
+		int frame_height() const override {
+			return m_height;
+		}
+		int frame_stride() const override {
+			return m_width * 2;
+		}
+		image_buffer read_buffer(frame_metadata &metadata) override;
+		
+	};
+	
+}
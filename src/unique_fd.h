@@ -17,6 +17,9 @@ namespace video_streamer {
 			}
 			
 			unique_fd &operator=(unique_fd &&fd) noexcept {
+				if (m_value >= 0 && m_value != fd.m_value) {
+					close(m_value);
+				}
 				m_value = fd.m_value;
 				fd.m_value = -1;
 				return *this;
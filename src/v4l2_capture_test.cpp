@@ -0,0 +1,134 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <easylogging++.h>
+#include "v4l2_device.h"
+#include "unique_fd.h"
+
+INITIALIZE_EASYLOGGINGPP
+
+/*
+ * Captures a few frames from the vivid virtual camera (modprobe vivid) with every streaming method.
+ * The device is found by its driver name or given as the only argument. Exits with 77 (skipped)
+ * when there is no vivid capture device.
+ */
+
+namespace {
+	
+	const int skip_exit_code = 77;
+	const int frames_per_method = 8;
+	const int width = 640;
+	const int height = 480;
+	
+	bool is_vivid_capture(const std::string &path) {
+		video_streamer::posix::unique_fd fd(open(path.c_str(), O_RDWR));
+		if (fd < 0) {
+			return false;
+		}
+		v4l2_capability cap = {};
+		if (ioctl(fd, VIDIOC_QUERYCAP, &cap) != 0) {
+			return false;
+		}
+		uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+		return strcmp((const char*) cap.driver, "vivid") == 0 && (caps & V4L2_CAP_VIDEO_CAPTURE) &&
+				(caps & V4L2_CAP_STREAMING);
+	}
+	
+	std::string find_vivid() {
+		for (int i = 0; i < 64; i++) {
+			std::string path = "/dev/video" + std::to_string(i);
+			if (is_vivid_capture(path)) {
+				return path;
+			}
+		}
+		return std::string();
+	}
+	
+	bool fail(video_streamer::v4l2::capture_method method, const std::string &message) {
+		std::cerr << method << ": " << message << std::endl;
+		return false;
+	}
+	
+	// The exported descriptor must map the same memory the frame was captured to
+	bool check_dmabuf(
+			const video_streamer::v4l2::capture_device &device, const video_streamer::image_buffer &buffer
+	) {
+		int fd = device.dmabuf_fd(buffer);
+		if (fd < 0) {
+			return fail(device.method(), "no DMABUF descriptor for a captured frame");
+		}
+		void *ptr = mmap(nullptr, buffer.size(), PROT_READ, MAP_SHARED, fd, 0);
+		if (ptr == MAP_FAILED) {
+			return fail(device.method(), std::string("mmap() of the DMABUF descriptor failed: ") + strerror(errno));
+		}
+		bool same = memcmp(ptr, buffer.data(), buffer.size()) == 0;
+		munmap(ptr, buffer.size());
+		if (!same) {
+			return fail(device.method(), "DMABUF content differs from the frame");
+		}
+		return true;
+	}
+	
+	bool test_method(const std::string &path, video_streamer::v4l2::capture_method method) {
+		video_streamer::v4l2::capture_device device(path, method);
+		if (device.method() != method) {
+			return fail(method, "the device fell back to READ");
+		}
+		device.set_format(width, height, video_streamer::v4l2::format::YUYV);
+		size_t frame_size = (size_t) device.frame_stride() * device.frame_height();
+		uint32_t last_sequence = 0;
+		for (int i = 0; i < frames_per_method; i++) {
+			video_streamer::frame_metadata metadata;
+			auto buffer = device.read_buffer(metadata);
+			if (buffer.size() != frame_size) {
+				return fail(method, "frame of " + std::to_string(buffer.size()) + " bytes, expected " +
+						std::to_string(frame_size));
+			}
+			if (metadata.index != (uint64_t) i) {
+				return fail(method, "frame index " + std::to_string(metadata.index) + ", expected " + std::to_string(i));
+			}
+			if (i > 0 && metadata.sequence <= last_sequence) {
+				return fail(method, "sequence " + std::to_string(metadata.sequence) + " after " +
+						std::to_string(last_sequence));
+			}
+			last_sequence = metadata.sequence;
+			if (method == video_streamer::v4l2::capture_method::DMABUF) {
+				if (!check_dmabuf(device, buffer)) {
+					return false;
+				}
+			} else if (device.dmabuf_fd(buffer) != -1) {
+				return fail(method, "DMABUF descriptor without the DMABUF method");
+			}
+		}
+		std::cout << method << ": " << frames_per_method << " frames of " << device.frame_width() << "x" <<
+				device.frame_height() << " OK" << std::endl;
+		return true;
+	}
+	
+}
+
+int main(int argc, char *argv[]) {
+	std::string path = argc > 1 ? argv[1] : find_vivid();
+	if (path.empty()) {
+		std::cout << "No vivid capture device, skipping (modprobe vivid)" << std::endl;
+		return skip_exit_code;
+	}
+	bool ok = true;
+	for (auto method : {
+			video_streamer::v4l2::capture_method::MMAP,
+			video_streamer::v4l2::capture_method::USERPTR,
+			video_streamer::v4l2::capture_method::DMABUF
+	}) {
+		try {
+			ok = test_method(path, method) && ok;
+		} catch (const std::exception &e) {
+			ok = fail(method, e.what());
+		}
+	}
+	return ok ? 0 : 1;
+}
@@ -8,6 +8,7 @@
 #include <thread>
 #include <easylogging++.h>
 #include "v4l2_device.h"
+#include "frame_pool.h"
 
 video_streamer::v4l2::exception::exception(std::string message, int errNo): m_message(std::move(message)) {
 	if (errNo) {
@@ -20,8 +21,14 @@ video_streamer::v4l2::exception::exception(std::string message, int errNo): m_me
 video_streamer::v4l2::capture_device::capture_device(
 		std::string path,
 		bool forceRead
+): capture_device(std::move(path), forceRead ? capture_method::READ : capture_method::MMAP) {
+}
+
+video_streamer::v4l2::capture_device::capture_device(
+		std::string path,
+		capture_method method
 ): m_path(std::move(path)), m_fd(open(m_path.c_str(), O_RDWR)), m_format(),
-   m_buffer_count(0), m_last_used_buffer(0)
+   m_buffer_count(0), m_last_used_buffer(0), m_next_frame_index(0), m_queued_buffers(0)
 {
 	LOG(INFO) << "Opened " << m_path << " V4L2 capture device";
 	if (m_fd < 0) {
@@ -37,10 +44,10 @@ video_streamer::v4l2::capture_device::capture_device(
 	query_format();
 	m_method = video_streamer::v4l2::capture_method::READ;
 	if (cap.capabilities & V4L2_CAP_STREAMING) {
-		if (forceRead) {
+		if (method == capture_method::READ) {
 			LOG(WARNING) << "The device supports streaming, but read_buffer will be forced";
 		} else {
-			m_method = video_streamer::v4l2::capture_method::MMAP;
+			m_method = method;
 		}
 	}
 	if (m_method == video_streamer::v4l2::capture_method::READ) {
@@ -53,15 +60,15 @@ video_streamer::v4l2::capture_device::capture_device(
 video_streamer::v4l2::capture_device::~capture_device() {
 	std::unique_lock<std::mutex> lock(m_read_mutex);
 	if (m_buffer_count) {
-		for (auto i = 0; i < m_buffer_count; i++) {
-			std::unique_lock<std::mutex>(m_buffers[i].mutex);
-		}
+		wait_buffers_released();
 		switch (m_method) {
 			case video_streamer::v4l2::capture_method::READ:
 				finish_read();
 				break;
 			case video_streamer::v4l2::capture_method::MMAP:
-				stop_mmap();
+			case video_streamer::v4l2::capture_method::USERPTR:
+			case video_streamer::v4l2::capture_method::DMABUF:
+				stop_streaming();
 				break;
 		}
 	}
@@ -118,6 +125,10 @@ int video_streamer::v4l2::capture_device::frame_height() const {
 	return m_format.fmt.pix.height;
 }
 
+int video_streamer::v4l2::capture_device::frame_stride() const {
+	return m_format.fmt.pix.bytesperline;
+}
+
 void video_streamer::v4l2::capture_device::set_format(int width, int height, format pixel_format) {
 	switch (pixel_format) {
 		case format::YVYU:
@@ -151,6 +162,7 @@ void video_streamer::v4l2::capture_device::set_format(int width, int height, for
 		throw exception("VIDIOC_S_FMT failed", errno);
 	}
 	query_format();
+	reset_jpeg_geometry();
 	if (pixel_format != format::UNKNOWN && this->pixel_format() != pixel_format) {
 		throw exception("Unable to set desired pixel format");
 	}
@@ -164,55 +176,109 @@ unsigned int video_streamer::v4l2::capture_device::compute_buffer_count() {
 	if (count < 2) {
 		count = 2;
 	}
-	return count;
+	// Frames are shared with the clients until they are transmitted, so keep a few spare buffers
+	return count + 2;
+}
+
+size_t video_streamer::v4l2::capture_device::payload_length(const void *data, size_t length) const {
+	if (m_format.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG) {
+		while (length > 0 && ((const char*) data)[length - 1] == 0) {
+			length--;
+		}
+	}
+	return length;
 }
 
 video_streamer::image_buffer video_streamer::v4l2::capture_device::wrap_buffer(
 		capture_buffer &buffer,
 		size_t length
 ) const {
-	if (m_format.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG) {
-		while (length > 0 && ((const char*) buffer.base)[length - 1] == 0) {
-			length--;
-		}
+	return image_buffer((uint8_t*) buffer.base, payload_length(buffer.base, length), &buffer);
+}
+
+v4l2_memory video_streamer::v4l2::capture_device::memory_type() const {
+	return m_method == capture_method::USERPTR ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+}
+
+void video_streamer::v4l2::capture_device::queue_buffer(unsigned int index) {
+	v4l2_buffer buf = {};
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = memory_type();
+	buf.index = index;
+	if (m_method == capture_method::USERPTR) {
+		buf.m.userptr = (unsigned long) m_buffers[index].base;
+		buf.length = m_buffers[index].length;
 	}
-	return image_buffer((uint8_t*) buffer.base, (size_t) length, &buffer);
+	if (ioctl(VIDIOC_QBUF, &buf) < 0) {
+		LOG(WARNING) << "VIDIOC_QBUF failed for buffer #" << index << ": " << strerror(errno);
+		return;
+	}
+	m_queued_buffers++;
+}
+
+void video_streamer::v4l2::capture_device::release_buffer(capture_buffer &buffer) {
+	if (m_method != capture_method::READ) {
+		queue_buffer(buffer.index);
+	}
+	std::unique_lock<std::mutex> lock(m_release_mutex);
+	buffer.in_use = false;
+	m_release_cond.notify_all();
+}
+
+void video_streamer::v4l2::capture_device::wait_buffers_released() {
+	std::unique_lock<std::mutex> lock(m_release_mutex);
+	m_release_cond.wait(lock, [this] {
+		for (unsigned int i = 0; i < m_buffer_count; i++) {
+			if (m_buffers[i].in_use) return false;
+		}
+		return true;
+	});
 }
 
 void video_streamer::v4l2::capture_device::init_read() {
 	unsigned long count = compute_buffer_count();
 	m_buffer_count = count;
-	m_buffers = std::unique_ptr<video_streamer::v4l2::capture_buffer[]>(new video_streamer::v4l2::capture_buffer[count]);
+	m_buffers = std::unique_ptr<video_streamer::v4l2::capture_buffer[]>(new video_streamer::v4l2::capture_buffer[count]());
 	for (unsigned int i = 0; i < count; i++) {
-		m_buffers[i].length = m_format.fmt.pix.sizeimage;
-		m_buffers[i].base = new char[m_buffers[i].length];
+		m_buffers[i].device = this;
+		m_buffers[i].index = i;
+		m_buffers[i].storage = frame_pool::instance().acquire_buffer(m_format.fmt.pix.sizeimage);
+		m_buffers[i].length = m_buffers[i].storage.size();
+		m_buffers[i].base = m_buffers[i].storage.data();
 	}
 	LOG(INFO) << "Using " << m_buffer_count << " capture buffers for READ";
 }
 
 video_streamer::image_buffer video_streamer::v4l2::capture_device::read_read() {
-	m_last_used_buffer = (m_last_used_buffer + 1) % m_buffer_count;
-	video_streamer::v4l2::capture_buffer &buffer = m_buffers[m_last_used_buffer];
-	std::unique_lock<std::mutex> lock(buffer.mutex);
-	ssize_t result = ::read(m_fd, buffer.base, buffer.length);
+	for (unsigned int i = 0; i < m_buffer_count; i++) {
+		m_last_used_buffer = (m_last_used_buffer + 1) % m_buffer_count;
+		video_streamer::v4l2::capture_buffer &buffer = m_buffers[m_last_used_buffer];
+		if (buffer.in_use.exchange(true)) continue;
+		ssize_t result = ::read(m_fd, buffer.base, buffer.length);
+		if (result < 0) {
+			release_buffer(buffer);
+			throw video_streamer::v4l2::exception("Unable to read_buffer a frame from the capture device", errno);
+		}
+		return wrap_buffer(buffer, result);
+	}
+	// All buffers are still held by slow clients, don't wait for them
+	video_streamer::image_buffer buffer(m_format.fmt.pix.sizeimage);
+	ssize_t result = ::read(m_fd, buffer.data(), buffer.size());
 	if (result < 0) {
 		throw video_streamer::v4l2::exception("Unable to read_buffer a frame from the capture device", errno);
 	}
-	lock.release();
-	return wrap_buffer(buffer, result);
+	buffer.truncate(payload_length(buffer.data(), result));
+	return buffer;
 }
 
 void video_streamer::v4l2::capture_device::finish_read() {
-	for (auto i = 0; i < m_buffer_count; i++) {
-		delete[] (char*) m_buffers[i].base;
-	}
 	m_buffers = nullptr;
 }
 
-void video_streamer::v4l2::capture_device::start_mmap() {
+void video_streamer::v4l2::capture_device::start_streaming() {
 	v4l2_requestbuffers req = {};
 	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	req.memory = V4L2_MEMORY_MMAP;
+	req.memory = memory_type();
 	req.count = compute_buffer_count();
 	if (ioctl(VIDIOC_REQBUFS, &req) < 0) {
 		throw video_streamer::v4l2::exception("VIDIOC_REQBUFS failed", errno);
@@ -221,13 +287,20 @@ void video_streamer::v4l2::capture_device::start_mmap() {
 		throw video_streamer::v4l2::exception("Insufficient capture_buffer memory on the device");
 	}
 	m_buffer_count = req.count;
-	m_buffers = std::unique_ptr<video_streamer::v4l2::capture_buffer[]>(new video_streamer::v4l2::capture_buffer[m_buffer_count]);
-	LOG(INFO) << "Using " << req.count << " capture buffers";
+	m_buffers = std::unique_ptr<video_streamer::v4l2::capture_buffer[]>(new video_streamer::v4l2::capture_buffer[m_buffer_count]());
+	LOG(INFO) << "Using " << req.count << " capture buffers for " << m_method;
 	for (unsigned int i = 0; i < req.count; i++) {
 		m_buffers[i].device = this;
 		m_buffers[i].index = i;
 	}
 	for (unsigned int i = 0; i < req.count; i++) {
+		if (m_method == capture_method::USERPTR) {
+			// Capture and decoded frames share the allocator
+			m_buffers[i].storage = frame_pool::instance().acquire_buffer(m_format.fmt.pix.sizeimage);
+			m_buffers[i].length = m_buffers[i].storage.size();
+			m_buffers[i].base = m_buffers[i].storage.data();
+			continue;
+		}
 		v4l2_buffer buf = {};
 		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		buf.memory = V4L2_MEMORY_MMAP;
@@ -241,16 +314,31 @@ void video_streamer::v4l2::capture_device::start_mmap() {
 			throw video_streamer::v4l2::exception("mmap() failed for capture_buffer #" + std::to_string(i), errno);
 		}
 		m_buffers[i].base = ptr;
+		if (m_method == capture_method::DMABUF) {
+			v4l2_exportbuffer expbuf = {};
+			expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			expbuf.index = i;
+			expbuf.flags = O_RDONLY | O_CLOEXEC;
+			if (ioctl(VIDIOC_EXPBUF, &expbuf) < 0) {
+				throw video_streamer::v4l2::exception("VIDIOC_EXPBUF failed for capture_buffer #" + std::to_string(i), errno);
+			}
+			m_buffers[i].dmabuf = posix::unique_fd(expbuf.fd);
+		}
 	}
 	for (int i = 0; i < m_buffer_count; i++) {
 		if (!m_buffers[i].base) continue;
 		v4l2_buffer buf = {};
 		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_MMAP;
+		buf.memory = memory_type();
 		buf.index = i;
+		if (m_method == capture_method::USERPTR) {
+			buf.m.userptr = (unsigned long) m_buffers[i].base;
+			buf.length = m_buffers[i].length;
+		}
 		if (ioctl(VIDIOC_QBUF, &buf) < 0) {
 			throw video_streamer::v4l2::exception("VIDIOC_QBUF failed for capture_buffer #" + std::to_string(i), errno);
 		}
+		m_queued_buffers++;
 	}
 	v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	if (ioctl(VIDIOC_STREAMON, &type) != 0) {
@@ -258,10 +346,10 @@ void video_streamer::v4l2::capture_device::start_mmap() {
 	}
 }
 
-video_streamer::image_buffer video_streamer::v4l2::capture_device::read_mmap() {
+video_streamer::image_buffer video_streamer::v4l2::capture_device::read_streaming(frame_metadata &metadata) {
 	v4l2_buffer buf = {};
 	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf.memory = V4L2_MEMORY_MMAP;
+	buf.memory = memory_type();
 	if (ioctl(VIDIOC_DQBUF, &buf) < 0) {
 		throw video_streamer::v4l2::exception("VIDIOC_DQBUF failed", errno);
 	}
@@ -271,16 +359,42 @@ video_streamer::image_buffer video_streamer::v4l2::capture_device::read_mmap() {
 				std::to_string(m_buffer_count) + ")"
 		);
 	}
+	m_queued_buffers--;
+	metadata.sequence = buf.sequence;
+	if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+		// steady_clock is CLOCK_MONOTONIC on Linux
+		metadata.timestamp = std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::seconds(buf.timestamp.tv_sec) + std::chrono::microseconds(buf.timestamp.tv_usec)
+		));
+	} else {
+		metadata.timestamp = std::chrono::steady_clock::now();
+	}
 	capture_buffer &buffer = m_buffers[buf.index];
+	// When most of the buffers are held by the clients the driver is about to run out of them,
+	// so give this one back immediately and let the frame live in a private copy
+	if (m_queued_buffers < std::max(1u, m_buffer_count / 4)) {
+		size_t length = payload_length(buffer.base, buf.bytesused);
+		video_streamer::image_buffer copy(length);
+		memcpy(copy.data(), buffer.base, length);
+		queue_buffer(buffer.index);
+		return copy;
+	}
+	buffer.in_use = true;
 	return wrap_buffer(buffer, buf.bytesused);
 }
 
-void video_streamer::v4l2::capture_device::stop_mmap() {
+void video_streamer::v4l2::capture_device::stop_streaming() {
 	v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	if (ioctl(VIDIOC_STREAMOFF, &type) != 0) {
 		LOG(WARNING) << "VIDIOC_STREAMOFF failed: " << strerror(errno);
 	}
+	if (m_method == capture_method::USERPTR) {
+		// The driver doesn't touch the buffers after STREAMOFF, give them back to the pool
+		m_buffers = nullptr;
+		return;
+	}
 	for (auto i = 0; i < m_buffer_count; i++) {
+		m_buffers[i].dmabuf = posix::unique_fd(-1);
 		if (!m_buffers[i].base) continue;
 		if (munmap(m_buffers[i].base, m_buffers[i].length) == 0) {
 			m_buffers[i].base = nullptr;
@@ -292,37 +406,63 @@ void video_streamer::v4l2::capture_device::stop_mmap() {
 }
 
 video_streamer::image_buffer video_streamer::v4l2::capture_device::read_buffer() {
+	frame_metadata metadata;
+	return read_buffer(metadata);
+}
+
+video_streamer::image_buffer video_streamer::v4l2::capture_device::read_buffer(frame_metadata &metadata) {
 	std::unique_lock<std::mutex> lock(m_read_mutex);
 	switch (m_method) {
-		case video_streamer::v4l2::capture_method::READ:
+		case video_streamer::v4l2::capture_method::READ: {
 			if (!m_buffer_count) {
 				init_read();
 			}
-			return read_read();
+			auto buffer = read_read();
+			metadata.timestamp = std::chrono::steady_clock::now();
+			metadata.sequence = (uint32_t) m_next_frame_index;
+			metadata.index = m_next_frame_index++;
+			return buffer;
+		}
 		case video_streamer::v4l2::capture_method::MMAP:
+		case video_streamer::v4l2::capture_method::USERPTR:
+		case video_streamer::v4l2::capture_method::DMABUF: {
 			if (!m_buffer_count) {
-				start_mmap();
+				start_streaming();
 			}
-			return read_mmap();
+			auto buffer = read_streaming(metadata);
+			metadata.index = m_next_frame_index++;
+			return buffer;
+		}
 	}
+	throw exception("Unknown capture method");
 }
 
-video_streamer::jpeg_frame video_streamer::v4l2::capture_device::read_jpeg() {
-	if (pixel_format() != format::MJPEG) {
-		throw video_streamer::v4l2::exception("Pixel format is not MJPEG");
+video_streamer::jpeg_frame video_streamer::v4l2::capture_device::read_jpeg(int quality) {
+	switch (pixel_format()) {
+		case format::MJPEG:
+		case format::YUYV:
+		case format::YVYU:
+		case format::UYVY:
+		case format::VYUY:
+			break;
+		default:
+			throw video_streamer::v4l2::exception("Pixel format is neither MJPEG nor packed YUV 4:2:2");
 	}
-	return jpeg_frame(read_buffer());
+	frame_metadata metadata;
+	auto frame = make_jpeg(read_buffer(metadata), quality);
+	frame.metadata() = metadata;
+	return frame;
 }
 
-void video_streamer::v4l2::capture_buffer::release(image_buffer &buffer) {
-	if (device->pixel_format() == format::MJPEG) {
-		v4l2_buffer buf = {};
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_MMAP;
-		buf.index = index;
-		if (device->ioctl(VIDIOC_QBUF, &buf) < 0) {
-			LOG(WARNING) << "VIDIOC_QBUF failed for buffer #1" << index << ": " << strerror(errno);
+int video_streamer::v4l2::capture_device::dmabuf_fd(const image_buffer &buffer) const {
+	for (unsigned int i = 0; i < m_buffer_count; i++) {
+		if (buffer.releaser() == &m_buffers[i]) {
+			return m_buffers[i].dmabuf;
 		}
 	}
-	mutex.unlock();
+	return -1;
+}
+
+void video_streamer::v4l2::capture_buffer::release(image_buffer &buffer) {
+	device->release_buffer(*this);
 }
@@ -5,10 +5,13 @@
 #include <vector>
 #include <memory>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <stdexcept>
 #include "unique_fd.h"
 #include "video_streamer.h"
 #include "jpeg_frame.h"
+#include "capture_source.h"
 
 namespace video_streamer {
 	
@@ -18,16 +21,11 @@ namespace video_streamer {
 		
 		enum class capture_method {
 			READ,
-			MMAP
-		};
-		enum class format {
-			UNKNOWN,
-			YVYU,
-			YUYV,
-			VYUY,
-			UYVY,
-			MJPEG,
-			H264
+			MMAP,
+			// Driver writes into page aligned buffers of frame_pool
+			USERPTR,
+			// MMAP buffers additionally exported as DMABUF file descriptors (VIDIOC_EXPBUF)
+			DMABUF
 		};
 		
 		class capture_buffer: public image_buffer_releaser {
@@ -36,13 +34,16 @@ namespace video_streamer {
 			unsigned int index;
 			void *base;
 			size_t length;
-			std::mutex mutex;
+			std::atomic<bool> in_use;
+			// Memory of READ and USERPTR buffers
+			image_buffer storage { nullptr, 0 };
+			posix::unique_fd dmabuf { -1 };
 			
 			void release(image_buffer &buffer) override;
 		
 		};
 		
-		class capture_device {
+		class capture_device: public capture_source {
 			std::string m_path;
 			posix::unique_fd m_fd;
 			capture_method m_method;
@@ -51,27 +52,59 @@ namespace video_streamer {
 			std::unique_ptr<capture_buffer[]> m_buffers;
 			std::mutex m_read_mutex;
 			unsigned int m_last_used_buffer;
+			uint64_t m_next_frame_index;
+			std::atomic<unsigned int> m_queued_buffers;
+			std::mutex m_release_mutex;
+			std::condition_variable m_release_cond;
 			
 			static unsigned int compute_buffer_count();
 			void query_format();
+			size_t payload_length(const void *data, size_t length) const;
 			video_streamer::image_buffer wrap_buffer(capture_buffer &buffer, size_t length) const;
+			void queue_buffer(unsigned int index);
+			void release_buffer(capture_buffer &buffer);
+			void wait_buffers_released();
+			v4l2_memory memory_type() const;
 			void init_read();
 			video_streamer::image_buffer read_read();
 			void finish_read();
-			void start_mmap();
-			video_streamer::image_buffer read_mmap();
-			void stop_mmap();
+			void start_streaming();
+			video_streamer::image_buffer read_streaming(frame_metadata &metadata);
+			void stop_streaming();
 			
 		public:
 			explicit capture_device(std::string path, bool forceRead = false);
-			~capture_device();
+			// Streaming methods fall back to READ if the device can't stream
+			capture_device(std::string path, capture_method method);
+			~capture_device() override;
 			int ioctl(unsigned long request, void *param);
-			format pixel_format() const;
-			int frame_width() const;
-			int frame_height() const;
+			capture_method method() const {
+				return m_method;
+			}
+			unsigned int buffer_count() const override {
+				return m_buffer_count;
+			}
+			// Buffers owned by the driver and available for capturing new frames
+			unsigned int queued_buffer_count() const override {
+				return m_queued_buffers;
+			}
+			format pixel_format() const override;
+			int frame_width() const override;
+			int frame_height() const override;
+			int frame_stride() const override;
 			void set_format(int width, int height, format pixel_format);
 			video_streamer::image_buffer read_buffer();
-			jpeg_frame read_jpeg();
+			video_streamer::image_buffer read_buffer(frame_metadata &metadata) override;
+			jpeg_frame read_jpeg(int quality = 80);
+			/*
+			 * DMABUF file descriptor of the capture buffer behind a frame returned by read_buffer()
+			 * (with the DMABUF method) or -1. It may be passed to another process over a UNIX socket
+			 * and stays valid while the device is open; the content is valid until the frame is released.
+			 * This is a hook for applications embedding the library, the streamer itself doesn't use it.
+			 */
+			int dmabuf_fd(const image_buffer &buffer) const;
+			
+			friend class capture_buffer;
 			
 		};
 		
@@ -90,11 +123,7 @@ namespace video_streamer {
 }
 
 inline std::ostream &operator<<(std::ostream &ostream, video_streamer::v4l2::capture_method method) {
-	static const char *methods[] = { "READ", "MMAP" };
+	static const char *methods[] = { "READ", "MMAP", "USERPTR", "DMABUF" };
 	return ostream << methods[(int) method];
 }
 
-inline std::ostream &operator<<(std::ostream &ostream, video_streamer::v4l2::format format) {
-	static const char *formats[] = { "UNKNOWN", "YVYU", "YUYV", "VYUY", "UYVY", "MJPEG", "H264" };
-	return ostream << formats[(int) format];
-}
@@ -1,10 +1,26 @@
-#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <cstring>
+#include <chrono>
+#include <deque>
+#include <map>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <easylogging++.h>
 #include <atomic>
 #include "video_streamer.h"
 #include "v4l2_device.h"
+#include "synthetic_source.h"
+#include "replay_source.h"
+#include "recorder.h"
+#include "h264.h"
+#include "reorder_buffer.h"
+#include "metrics.h"
+#include "rate_controller.h"
+#include "frame_pool.h"
+#include "spsc_queue.h"
 
 namespace video_streamer {
 	
@@ -25,92 +41,285 @@ video_streamer::image_buffer::image_buffer(size_t size): video_streamer::image_b
 ) {
 }
 
-video_streamer::stream_server::stream_server(
-		std::vector<std::string> server_addresses, int send_buffer_size
-): std::thread(&stream_server::run, this), m_send_buffer_size(send_buffer_size) {
-	std::unique_lock<std::mutex> lock(m_client_sockets_mutex);
-	int one = 1;
-	for (auto &address : server_addresses) {
-		size_t dot_pos = address.rfind(':');
-		if (dot_pos == std::string::npos) {
-			throw stream_server_exception("Port number is missing in " + address);
-		}
-		if (dot_pos == 0) {
-			throw stream_server_exception("Hostname or IP address is missing in " + address);
-		}
-		size_t address_start = 0;
-		size_t address_end = dot_pos;
-		if (address[address_start] == '[' && address[address_end - 1] == ']') {
-			address_start++;
-			address_end--;
-		}
-		std::string host(address, address_start, address_end - address_start);
-		std::string port(address, dot_pos + 1);
-		addrinfo hints = {};
-		hints.ai_socktype = SOCK_STREAM;
-		addrinfo *result;
-		int error = getaddrinfo(host.data(), port.data(), &hints, &result);
-		if (error != 0) {
-			if (error == EAI_SYSTEM) {
-				LOG(ERROR) << "getaddrinfo() failed for host=" << host << ", port=" << port << ": " << strerror(errno);
-			} else {
-				LOG(ERROR) << "getaddrinfo() failed for host=" << host << ", port=" << port << ": " << gai_strerror(errno);
+namespace video_streamer {
+	
+	/*
+	 * A unit of the outgoing stream: optional inline prefix (multipart part headers),
+	 * optional shared frame data and optional static suffix.
+	 */
+	struct pending_frame {
+		char prefix[96];
+		size_t prefix_size;
+		std::shared_ptr<const image_buffer> buffer;
+		frame_dependency dependency;
+		// Part of the group of frames a client joined with, it is never discarded
+		bool pinned;
+		const char *suffix;
+		size_t suffix_size;
+		size_t offset;
+		std::chrono::steady_clock::time_point captured_at;
+		std::chrono::steady_clock::time_point enqueued_at;
+		std::chrono::steady_clock::time_point started_at;
+		
+		size_t size() const {
+			return prefix_size + (buffer ? buffer->size() : 0) + suffix_size;
+		}
+		
+		int fill_iov(iovec *iov, int max_count) const {
+			int count = 0;
+			size_t skip = offset;
+			const void *parts[] = { prefix, buffer ? buffer->data() : nullptr, suffix };
+			size_t sizes[] = { prefix_size, buffer ? buffer->size() : 0, suffix_size };
+			for (int i = 0; i < 3 && count < max_count; i++) {
+				if (skip >= sizes[i]) {
+					skip -= sizes[i];
+					continue;
+				}
+				iov[count].iov_base = (uint8_t*) parts[i] + skip;
+				iov[count].iov_len = sizes[i] - skip;
+				skip = 0;
+				count++;
 			}
-			throw stream_server_exception("getaddrinfo() failed for host=" + host + ", port=" + port);
+			return count;
 		}
-		posix::unique_fd socket = posix::unique_fd(::socket(
-				result->ai_family, result->ai_socktype, result->ai_protocol
-		));
-		if (socket < 0) {
-			LOG(ERROR) << "socket() failed for host=" << host << ", port=" << port << ": " << strerror(errno);
-			throw stream_server_exception(std::string("Unable to create a socket: ") + strerror(errno));
+		
+	};
+	
+	enum class client_protocol {
+		UNKNOWN,
+		RAW,
+		HTTP
+	};
+	
+	class stream_listener: public event_handler {
+	public:
+		stream_server &server;
+		posix::unique_fd socket;
+		
+		stream_listener(stream_server &server, posix::unique_fd socket): server(server), socket(std::move(socket)) {
+		}
+		
+		void handle_events(uint32_t) override {
+			server.accept_clients(*this);
+		}
+		
+	};
+	
+	// Gives up waiting for a request from new clients, so that raw clients don't wait for the next frame
+	class stream_detection_timer: public event_handler {
+	public:
+		stream_server &server;
+		posix::unique_fd timer;
+		bool armed = false;
+		
+		explicit stream_detection_timer(
+				stream_server &server
+		): server(server), timer(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) {
+			if (timer < 0) {
+				throw stream_server_exception(std::string("timerfd_create() failed: ") + strerror(errno));
+			}
 		}
-		if (setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int)) < 0) {
-			LOG(WARNING) << "setsockopt(SO_REUSEADDR) failed: "<< strerror(errno);
+		
+		void arm(std::chrono::steady_clock::duration delay) {
+			auto ns = std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(delay).count(), 1);
+			itimerspec spec = {};
+			spec.it_value.tv_sec = (time_t) (ns / 1000000000);
+			spec.it_value.tv_nsec = (long) (ns % 1000000000);
+			timerfd_settime(timer, 0, &spec, nullptr);
+			armed = true;
 		}
-		if (bind(socket, result->ai_addr, result->ai_addrlen) != 0) {
-			LOG(ERROR) << "bind() failed for host=" << host << ", port=" << port << ": " << strerror(errno);
-			throw stream_server_exception(std::string("Unable to bind a socket: ") + strerror(errno));
+		
+		void handle_events(uint32_t) override {
+			uint64_t expirations;
+			while (read(timer, &expirations, sizeof(expirations)) > 0) {
+			}
+			armed = false;
+			server.detect_protocols();
 		}
-		if (listen(socket, 5) != 0) {
-			LOG(ERROR) << "listen() failed for host=" << host << ", port=" << port << ": " << strerror(errno);
-			throw stream_server_exception(std::string("Unable to listen a socket: ") + strerror(errno));
+		
+	};
+	
+	class stream_client: public event_handler {
+	public:
+		stream_server &server;
+		posix::unique_fd socket;
+		std::string address;
+		std::chrono::steady_clock::time_point connected_at;
+		client_protocol protocol = client_protocol::UNKNOWN;
+		std::string request;
+		std::deque<pending_frame> queue;
+		backpressure_policy policy;
+		size_t max_queued_frames;
+		uint64_t frames_sent = 0;
+		uint64_t frames_dropped = 0;
+		uint64_t bytes_sent = 0;
+		// Frames of a compressed video stream are skipped until the next key frame once one of them is lost
+		bool waiting_for_key = true;
+		latency_histogram queue_wait_latency;
+		latency_histogram send_latency;
+		bool want_write = false;
+		bool closed = false;
+		
+		stream_client(
+				stream_server &server, posix::unique_fd socket, std::string address
+		): server(server), socket(std::move(socket)), address(std::move(address)),
+			connected_at(std::chrono::steady_clock::now()),
+			policy(server.m_backpressure_policy), max_queued_frames(server.m_max_queued_frames) {
 		}
-		freeaddrinfo(result);
-		LOG(INFO) << "Listening on address " << host << ", port " << port;
-		m_server_sockets.push_back(std::move(socket));
+		
+		void handle_events(uint32_t events) override;
+		void receive_request(const char *data, size_t size);
+		// Moment to give up waiting for a request and start a raw stream
+		std::chrono::steady_clock::time_point detection_deadline() const;
+		void start_raw();
+		void start_http(const std::string &target);
+		void push_join_frames();
+		void push(
+				const std::shared_ptr<const image_buffer> &buffer,
+				frame_dependency dependency,
+				std::chrono::steady_clock::time_point captured_at,
+				std::chrono::steady_clock::time_point enqueued_at
+		);
+		void enqueue(
+				const std::shared_ptr<const image_buffer> &buffer,
+				frame_dependency dependency,
+				std::chrono::steady_clock::time_point captured_at,
+				std::chrono::steady_clock::time_point enqueued_at,
+				bool pinned
+		);
+		bool flush();
+		
+	};
+	
+}
+
+video_streamer::posix::unique_fd video_streamer::open_server_socket(const std::string &address) {
+	int one = 1;
+	size_t dot_pos = address.rfind(':');
+	if (dot_pos == std::string::npos) {
+		throw stream_server_exception("Port number is missing in " + address);
+	}
+	if (dot_pos == 0) {
+		throw stream_server_exception("Hostname or IP address is missing in " + address);
 	}
+	size_t address_start = 0;
+	size_t address_end = dot_pos;
+	if (address[address_start] == '[' && address[address_end - 1] == ']') {
+		address_start++;
+		address_end--;
+	}
+	std::string host(address, address_start, address_end - address_start);
+	std::string port(address, dot_pos + 1);
+	addrinfo hints = {};
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo *result;
+	int error = getaddrinfo(host.data(), port.data(), &hints, &result);
+	if (error != 0) {
+		if (error == EAI_SYSTEM) {
+			LOG(ERROR) << "getaddrinfo() failed for host=" << host << ", port=" << port << ": " << strerror(errno);
+		} else {
+			LOG(ERROR) << "getaddrinfo() failed for host=" << host << ", port=" << port << ": " << gai_strerror(error);
+		}
+		throw stream_server_exception("getaddrinfo() failed for host=" + host + ", port=" + port);
+	}
+	posix::unique_fd socket = posix::unique_fd(::socket(
+			result->ai_family, result->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, result->ai_protocol
+	));
+	if (socket < 0) {
+		LOG(ERROR) << "socket() failed for host=" << host << ", port=" << port << ": " << strerror(errno);
+		throw stream_server_exception(std::string("Unable to create a socket: ") + strerror(errno));
+	}
+	if (setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int)) < 0) {
+		LOG(WARNING) << "setsockopt(SO_REUSEADDR) failed: "<< strerror(errno);
+	}
+	if (bind(socket, result->ai_addr, result->ai_addrlen) != 0) {
+		LOG(ERROR) << "bind() failed for host=" << host << ", port=" << port << ": " << strerror(errno);
+		throw stream_server_exception(std::string("Unable to bind a socket: ") + strerror(errno));
+	}
+	if (listen(socket, 5) != 0) {
+		LOG(ERROR) << "listen() failed for host=" << host << ", port=" << port << ": " << strerror(errno);
+		throw stream_server_exception(std::string("Unable to listen a socket: ") + strerror(errno));
+	}
+	freeaddrinfo(result);
+	LOG(INFO) << "Listening on address " << host << ", port " << port;
+	return socket;
 }
 
-video_streamer::stream_server::~stream_server() {
-	if (joinable()) {
-		m_quit = true;
-		join();
+video_streamer::stream_server::stream_server(
+		std::vector<std::string> server_addresses, int send_buffer_size, size_t max_queued_frames,
+		backpressure_policy policy
+): stream_server(
+		std::unique_ptr<event_loop>(new event_loop()), nullptr,
+		std::move(server_addresses), send_buffer_size, max_queued_frames, policy
+) {
+}
+
+video_streamer::stream_server::stream_server(
+		event_loop &loop, std::vector<std::string> server_addresses, int send_buffer_size, size_t max_queued_frames,
+		backpressure_policy policy
+): stream_server(nullptr, &loop, std::move(server_addresses), send_buffer_size, max_queued_frames, policy) {
+}
+
+video_streamer::stream_server::stream_server(
+		std::unique_ptr<event_loop> own_loop, event_loop *loop, std::vector<std::string> server_addresses,
+		int send_buffer_size, size_t max_queued_frames, backpressure_policy policy
+): m_own_loop(std::move(own_loop)), m_loop(loop ? loop : m_own_loop.get()), m_flush_scheduled(false),
+	m_send_buffer_size(send_buffer_size), m_max_queued_frames(std::max<size_t>(max_queued_frames, 1)),
+	m_backpressure_policy(policy), m_format(stream_format::MJPEG), m_join_frames_size(0),
+	m_detection_timer(new stream_detection_timer(*this))
+{
+	for (auto &address : server_addresses) {
+		m_listeners.emplace_back(new stream_listener(*this, open_server_socket(address)));
 	}
+	m_loop->invoke([this] {
+		m_loop->add(m_detection_timer->timer, EPOLLIN, m_detection_timer.get());
+		for (auto &listener : m_listeners) {
+			m_loop->add(listener->socket, EPOLLIN, listener.get());
+		}
+	});
 }
 
-void video_streamer::stream_server::send(const void *data, size_t data_size) {
-	std::unique_lock<std::mutex> lock(m_client_sockets_mutex);
-	auto it = m_client_sockets.begin();
-	while (it != m_client_sockets.end()) {
-		errno = 0;
-		size_t offset = 0;
-		while (offset < data_size) {
-			ssize_t r = ::send(*it, (const char*) data + offset, data_size - offset, MSG_NOSIGNAL);
-			if (r <= 0) {
-				break;
-			}
-			offset += r;
+video_streamer::stream_server::~stream_server() {
+	m_loop->invoke([this] {
+		m_loop->remove(m_detection_timer->timer);
+		for (auto &listener : m_listeners) {
+			m_loop->remove(listener->socket);
 		}
-		if (offset < data_size) {
-			LOG(INFO) << "The client disconnected: " << strerror(errno);
-			it = m_client_sockets.erase(it);
-		} else {
-			++it;
+		std::unique_lock<std::mutex> lock(m_clients_mutex);
+		for (auto &client : m_clients) {
+			m_loop->remove(client.second->socket);
 		}
+		m_clients.clear();
+	});
+	LOG(INFO) << "Stopped listening for incoming connections";
+}
+
+// A group of frames longer than that isn't kept, new clients wait for the next key frame instead
+static const size_t max_join_frames_size = 16 * 1024 * 1024;
+
+void video_streamer::stream_server::send(
+		std::shared_ptr<const image_buffer> buffer, const frame_metadata &metadata, frame_dependency dependency
+) {
+	auto now = std::chrono::steady_clock::now();
+	{
+		// Never held during I/O, so the producer doesn't wait for slow sockets
+		std::unique_lock<std::mutex> lock(m_incoming_mutex);
+		m_incoming.push_back(incoming_frame { std::move(buffer), dependency, metadata.timestamp, now });
+	}
+	if (!m_flush_scheduled.exchange(true)) {
+		m_loop->post([this] {
+			m_flush_scheduled = false;
+			flush_clients();
+		});
 	}
 }
 
+void video_streamer::stream_server::send(const void *data, size_t data_size) {
+	auto buffer = std::make_shared<image_buffer>(data_size);
+	memcpy(buffer->data(), data, data_size);
+	send(std::shared_ptr<const image_buffer>(std::move(buffer)));
+}
+
 void video_streamer::stream_server::send(const image_buffer &buffer) {
 	send(buffer.data(), buffer.size());
 }
@@ -119,68 +328,461 @@ void video_streamer::stream_server::send(const frame &frame) {
 	send(frame.buffer());
 }
 
-void video_streamer::stream_server::accept_client(posix::unique_fd &server_socket) {
-	sockaddr_storage socket_addr = {};
-	socklen_t socket_addr_len = sizeof(socket_addr);
-	posix::unique_fd socket = accept(server_socket, (sockaddr*) &socket_addr, &socket_addr_len);
-	if (socket < 0) {
-		LOG(ERROR) << "accept() failed: " << strerror(errno);
-		throw stream_server_exception("accept() failed");
-	}
-	char address_buffer[std::max(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)];
-	const char *address = inet_ntop(
-			socket_addr.ss_family,
-			socket_addr.ss_family == AF_INET6 ?
-			(void*) &((sockaddr_in6*) &socket_addr)->sin6_addr :
-			(void*) &((sockaddr_in*) &socket_addr)->sin_addr,
-			address_buffer,
-			sizeof(address_buffer)
-	);
-	uint16_t port = ntohs(
-			socket_addr.ss_family == AF_INET6 ?
-			((sockaddr_in6*) &socket_addr)->sin6_port :
-			((sockaddr_in*) &socket_addr)->sin_port
-	);
-	LOG(INFO) << "New client connected from " << address << ", port " << port;
-	if (m_send_buffer_size > 0) {
-		if (setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &m_send_buffer_size, sizeof(int)) < 0) {
-			LOG(WARNING) << "Unable to update socket send buffer size";
+size_t video_streamer::stream_server::client_count() {
+	std::unique_lock<std::mutex> lock(m_clients_mutex);
+	return m_clients.size();
+}
+
+std::vector<video_streamer::stream_client_stats> video_streamer::stream_server::client_stats() {
+	std::vector<stream_client_stats> result;
+	// Client counters and queues are updated by the network thread without locking
+	m_loop->invoke([this, &result] {
+		result.reserve(m_clients.size());
+		for (auto &it : m_clients) {
+			auto &client = *it.second;
+			result.push_back(stream_client_stats {
+					client.address, client.frames_sent, client.frames_dropped, client.queue.size(), client.bytes_sent,
+					client.queue_wait_latency.snapshot(), client.send_latency.snapshot()
+			});
+		}
+	});
+	return result;
+}
+
+video_streamer::stream_server_latency video_streamer::stream_server::latency() {
+	return stream_server_latency {
+			m_queue_wait_latency.snapshot(),
+			m_send_latency.snapshot(),
+			m_capture_to_wire_latency.snapshot()
+	};
+}
+
+void video_streamer::stream_server::flush_clients() {
+	{
+		std::unique_lock<std::mutex> lock(m_incoming_mutex);
+		m_incoming_batch.swap(m_incoming);
+	}
+	for (auto &frame : m_incoming_batch) {
+		for (auto &it : m_clients) {
+			it.second->push(frame.buffer, frame.dependency, frame.captured_at, frame.enqueued_at);
+		}
+		if (frame.dependency != frame_dependency::DELTA) {
+			m_join_frames.clear();
+			m_join_frames_size = 0;
+		}
+		if (
+				(frame.dependency != frame_dependency::DELTA || !m_join_frames.empty()) &&
+				m_join_frames_size + frame.buffer->size() <= max_join_frames_size
+		) {
+			m_join_frames_size += frame.buffer->size();
+			m_join_frames.emplace_back(std::move(frame.buffer), frame.dependency);
+		} else {
+			m_join_frames.clear();
+			m_join_frames_size = 0;
+		}
+	}
+	m_incoming_batch.clear();
+	auto it = m_clients.begin();
+	while (it != m_clients.end()) {
+		auto &client = *it->second;
+		++it;
+		if (!client.want_write && !client.flush()) {
+			close_client(client, strerror(errno));
 		}
 	}
-	std::unique_lock<std::mutex> lock(m_client_sockets_mutex);
-	m_client_sockets.push_back(std::move(socket));
 }
 
-void video_streamer::stream_server::run() {
-	usleep(100);
-	while (!m_quit) {
-		fd_set read_fds;
-		FD_ZERO(&read_fds);
-		int max_fd = -1;
-		{
-			std::unique_lock<std::mutex> lock(m_server_sockets_mutex);
-			for (auto &&socket : m_server_sockets) {
-				FD_SET(socket, &read_fds);
-				if (socket > max_fd) {
-					max_fd = socket;
-				}
+void video_streamer::stream_server::close_client(stream_client &client, const char *reason) {
+	LOG(INFO) << "The client " << client.address << " disconnected: " << reason <<
+			" (" << client.frames_sent << " frames sent, " << client.frames_dropped << " frames dropped)";
+	client.closed = true;
+	m_loop->remove(client.socket);
+	stream_client *ptr;
+	{
+		std::unique_lock<std::mutex> lock(m_clients_mutex);
+		auto it = m_clients.find(client.socket);
+		ptr = it->second.release();
+		m_clients.erase(it);
+	}
+	m_loop->post([ptr] {
+		delete ptr;
+	});
+}
+
+// Raw TCP clients never send anything, HTTP clients send a request right after connecting
+static const auto protocol_detection_timeout = std::chrono::milliseconds(200);
+// A request which has started to arrive may come in slowly (e.g. over a lossy link or typed by hand)
+static const auto request_completion_timeout = std::chrono::seconds(5);
+static const size_t max_request_size = 8192;
+static const char http_boundary[] = "videostreamerframe";
+static const char http_response[] =
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: multipart/x-mixed-replace; boundary=videostreamerframe\r\n"
+		"Cache-Control: no-cache, no-store, must-revalidate\r\n"
+		"Pragma: no-cache\r\n"
+		"Connection: close\r\n"
+		"\r\n";
+// H.264 is sent as a plain Annex B byte stream, it needs no framing
+static const char http_h264_response[] =
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: video/h264\r\n"
+		"Cache-Control: no-cache, no-store, must-revalidate\r\n"
+		"Pragma: no-cache\r\n"
+		"Connection: close\r\n"
+		"\r\n";
+static const char http_part_suffix[] = "\r\n";
+
+void video_streamer::stream_server::detect_protocols() {
+	auto now = std::chrono::steady_clock::now();
+	auto next_deadline = std::chrono::steady_clock::time_point::max();
+	auto it = m_clients.begin();
+	while (it != m_clients.end()) {
+		auto &client = *it->second;
+		++it;
+		if (client.protocol != client_protocol::UNKNOWN) continue;
+		auto deadline = client.detection_deadline();
+		if (deadline > now) {
+			next_deadline = std::min(next_deadline, deadline);
+			continue;
+		}
+		client.start_raw();
+		client.push_join_frames();
+		if (!client.want_write && !client.flush()) {
+			close_client(client, strerror(errno));
+		}
+	}
+	if (next_deadline != std::chrono::steady_clock::time_point::max()) {
+		m_detection_timer->arm(next_deadline - now);
+	}
+}
+
+void video_streamer::stream_client::push(
+		const std::shared_ptr<const image_buffer> &buffer,
+		frame_dependency dependency,
+		std::chrono::steady_clock::time_point captured_at,
+		std::chrono::steady_clock::time_point enqueued_at
+) {
+	if (protocol == client_protocol::UNKNOWN) {
+		if (std::chrono::steady_clock::now() < detection_deadline()) {
+			return;
+		}
+		start_raw();
+		// The current group of frames is needed to decode this one
+		if (dependency == frame_dependency::DELTA) {
+			push_join_frames();
+		}
+	}
+	if (dependency == frame_dependency::KEY) {
+		waiting_for_key = false;
+	} else if (dependency == frame_dependency::DELTA && waiting_for_key) {
+		frames_dropped++;
+		return;
+	}
+	// The frame at the front may be partially transmitted, it must never be discarded
+	// otherwise the client would receive a truncated image. Protocol headers are never discarded too.
+	size_t first_droppable = 0;
+	while (
+			first_droppable < queue.size() &&
+			(queue[first_droppable].offset > 0 || !queue[first_droppable].buffer || queue[first_droppable].pinned)
+	) {
+		first_droppable++;
+	}
+	if (dependency != frame_dependency::INDEPENDENT) {
+		// Skipping a single frame would break decoding of the following ones, so a client which falls behind
+		// gives up every waiting frame at once and resumes from the next key frame
+		size_t max_waiting = policy == backpressure_policy::LATEST_ONLY ? 1 : max_queued_frames;
+		if (queue.size() - first_droppable >= max_waiting) {
+			frames_dropped += queue.size() - first_droppable;
+			queue.erase(queue.begin() + first_droppable, queue.end());
+			if (dependency == frame_dependency::DELTA) {
+				waiting_for_key = true;
+				frames_dropped++;
+				return;
+			}
+		}
+		enqueue(buffer, dependency, captured_at, enqueued_at, false);
+		return;
+	}
+	switch (policy) {
+		case backpressure_policy::BOUNDED_QUEUE:
+			if (queue.size() >= max_queued_frames) {
+				frames_dropped++;
+				return;
+			}
+			break;
+		case backpressure_policy::DROP_OLDEST:
+			while (queue.size() >= max_queued_frames && queue.size() > first_droppable) {
+				queue.erase(queue.begin() + first_droppable);
+				frames_dropped++;
+			}
+			break;
+		case backpressure_policy::LATEST_ONLY:
+			while (queue.size() > first_droppable) {
+				queue.erase(queue.begin() + first_droppable);
+				frames_dropped++;
+			}
+			break;
+	}
+	enqueue(buffer, dependency, captured_at, enqueued_at, false);
+}
+
+void video_streamer::stream_client::enqueue(
+		const std::shared_ptr<const image_buffer> &buffer,
+		frame_dependency dependency,
+		std::chrono::steady_clock::time_point captured_at,
+		std::chrono::steady_clock::time_point enqueued_at,
+		bool pinned
+) {
+	queue.emplace_back();
+	auto &frame = queue.back();
+	frame.buffer = buffer;
+	frame.dependency = dependency;
+	frame.pinned = pinned;
+	frame.offset = 0;
+	frame.captured_at = captured_at;
+	frame.enqueued_at = enqueued_at;
+	if (protocol == client_protocol::HTTP && server.m_format == stream_format::MJPEG) {
+		frame.prefix_size = (size_t) snprintf(
+				frame.prefix, sizeof(frame.prefix),
+				"--%s\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n",
+				http_boundary, buffer->size()
+		);
+		frame.suffix = http_part_suffix;
+		frame.suffix_size = sizeof(http_part_suffix) - 1;
+	} else {
+		frame.prefix_size = 0;
+		frame.suffix = nullptr;
+		frame.suffix_size = 0;
+	}
+}
+
+void video_streamer::stream_client::receive_request(const char *data, size_t size) {
+	static const char method[] = "GET ";
+	request.append(data, size);
+	size_t prefix_length = std::min(request.size(), sizeof(method) - 1);
+	if (request.compare(0, prefix_length, method, prefix_length) != 0 || request.size() > max_request_size) {
+		start_raw();
+		push_join_frames();
+		return;
+	}
+	size_t end = request.find("\r\n\r\n");
+	if (end == std::string::npos) {
+		end = request.find("\n\n");
+		if (end == std::string::npos) return;
+	}
+	size_t target_end = request.find_first_of(" \r\n", sizeof(method) - 1);
+	start_http(request.substr(sizeof(method) - 1, target_end - (sizeof(method) - 1)));
+	request.clear();
+	push_join_frames();
+}
+
+std::chrono::steady_clock::time_point video_streamer::stream_client::detection_deadline() const {
+	// Only a client which hasn't sent anything is taken for a raw one after the short timeout
+	return connected_at + (request.empty() ? protocol_detection_timeout : request_completion_timeout);
+}
+
+void video_streamer::stream_client::start_raw() {
+	LOG(INFO) << "The client " << address << " receives raw " <<
+			(server.m_format == stream_format::H264 ? "H.264" : "MJPEG") << " stream";
+	protocol = client_protocol::RAW;
+	request.clear();
+}
+
+void video_streamer::stream_client::push_join_frames() {
+	// Capture time of a cached frame would distort the capture to wire latency
+	auto now = std::chrono::steady_clock::now();
+	for (auto &it : server.m_join_frames) {
+		if (it.second == frame_dependency::INDEPENDENT) {
+			push(it.first, it.second, std::chrono::steady_clock::time_point(), now);
+			continue;
+		}
+		// The whole group is needed to decode the current frame, so it doesn't count against the queue limit
+		if (it.second == frame_dependency::KEY) {
+			waiting_for_key = false;
+		}
+		enqueue(it.first, it.second, std::chrono::steady_clock::time_point(), now, true);
+	}
+}
+
+void video_streamer::stream_client::start_http(const std::string &target) {
+	LOG(INFO) << "The client " << address << " requested " << target << " over HTTP";
+	protocol = client_protocol::HTTP;
+	// The stream is served on any path, but the query allows to override the backpressure settings
+	size_t query_start = target.find('?');
+	while (query_start != std::string::npos) {
+		size_t param_end = target.find('&', query_start + 1);
+		std::string param = target.substr(
+				query_start + 1, param_end == std::string::npos ? std::string::npos : param_end - query_start - 1
+		);
+		query_start = param_end;
+		size_t eq_pos = param.find('=');
+		if (eq_pos == std::string::npos) continue;
+		std::string name = param.substr(0, eq_pos);
+		std::string value = param.substr(eq_pos + 1);
+		if (name == "policy") {
+			if (value == "bounded") {
+				policy = backpressure_policy::BOUNDED_QUEUE;
+			} else if (value == "drop-oldest") {
+				policy = backpressure_policy::DROP_OLDEST;
+			} else if (value == "latest") {
+				policy = backpressure_policy::LATEST_ONLY;
+			}
+		} else if (name == "queue") {
+			int value_int = atoi(value.c_str());
+			if (value_int > 0) {
+				max_queued_frames = (size_t) value_int;
 			}
 		}
-		timeval timeout { .tv_sec = 1, .tv_usec = 0 };
-		int r = select(max_fd + 1, &read_fds, nullptr, nullptr, &timeout);
+	}
+	queue.emplace_back();
+	auto &response = queue.back();
+	response.prefix_size = 0;
+	if (server.m_format == stream_format::H264) {
+		response.suffix = http_h264_response;
+		response.suffix_size = sizeof(http_h264_response) - 1;
+	} else {
+		response.suffix = http_response;
+		response.suffix_size = sizeof(http_response) - 1;
+	}
+	response.offset = 0;
+	response.pinned = false;
+}
+
+bool video_streamer::stream_client::flush() {
+	while (!queue.empty()) {
+		iovec iov[64];
+		int count = 0;
+		for (auto it = queue.begin(); it != queue.end() && count < 62; ++it) {
+			count += it->fill_iov(iov + count, 64 - count);
+		}
+		msghdr msg = {};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		ssize_t r = sendmsg(socket, &msg, MSG_NOSIGNAL);
 		if (r < 0) {
-			LOG(ERROR) << "select() failed: " << strerror(errno);
-			throw stream_server_exception("select() failed");
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				return false;
+			}
+			break;
 		}
-		if (r == 0) continue;
-		std::unique_lock<std::mutex> lock(m_server_sockets_mutex);
-		for (auto &&server_socket : m_server_sockets) {
-			if (!FD_ISSET(server_socket, &read_fds)) continue;
-			accept_client(server_socket);
+		auto written = (size_t) r;
+		bytes_sent += written;
+		auto now = std::chrono::steady_clock::now();
+		while (written > 0) {
+			auto &front = queue.front();
+			if (front.offset == 0 && front.buffer) {
+				front.started_at = now;
+				queue_wait_latency.record(now - front.enqueued_at);
+				server.m_queue_wait_latency.record(now - front.enqueued_at);
+			}
+			size_t left = front.size() - front.offset;
+			if (written < left) {
+				front.offset += written;
+				break;
+			}
+			written -= left;
+			if (front.buffer) {
+				frames_sent++;
+				send_latency.record(now - front.started_at);
+				server.m_send_latency.record(now - front.started_at);
+				if (front.captured_at.time_since_epoch().count()) {
+					server.m_capture_to_wire_latency.record(now - front.captured_at);
+				}
+			}
+			queue.pop_front();
+		}
+	}
+	bool want_write = !queue.empty();
+	if (want_write != this->want_write) {
+		this->want_write = want_write;
+		server.m_loop->modify(socket, want_write ? EPOLLIN | EPOLLOUT : EPOLLIN, this);
+	}
+	return true;
+}
+
+void video_streamer::stream_client::handle_events(uint32_t events) {
+	if (closed) return;
+	if (events & EPOLLIN) {
+		char buffer[1024];
+		while (true) {
+			ssize_t r = recv(socket, buffer, sizeof(buffer), 0);
+			if (r > 0) {
+				if (protocol == client_protocol::UNKNOWN) {
+					receive_request(buffer, (size_t) r);
+				}
+				continue;
+			}
+			if (r == 0) {
+				server.close_client(*this, "connection closed by peer");
+				return;
+			}
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			server.close_client(*this, strerror(errno));
+			return;
+		}
+		if (!want_write && !queue.empty() && !flush()) {
+			server.close_client(*this, strerror(errno));
+			return;
+		}
+	}
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		server.close_client(*this, "connection reset");
+		return;
+	}
+	if ((events & EPOLLOUT) && !flush()) {
+		server.close_client(*this, strerror(errno));
+	}
+}
+
+void video_streamer::stream_server::accept_clients(stream_listener &listener) {
+	while (true) {
+		sockaddr_storage socket_addr = {};
+		socklen_t socket_addr_len = sizeof(socket_addr);
+		posix::unique_fd socket = accept4(
+				listener.socket, (sockaddr*) &socket_addr, &socket_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC
+		);
+		if (socket < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				LOG(ERROR) << "accept() failed: " << strerror(errno);
+			}
+			return;
+		}
+		char address_buffer[std::max(INET_ADDRSTRLEN, INET6_ADDRSTRLEN)];
+		const char *address = inet_ntop(
+				socket_addr.ss_family,
+				socket_addr.ss_family == AF_INET6 ?
+				(void*) &((sockaddr_in6*) &socket_addr)->sin6_addr :
+				(void*) &((sockaddr_in*) &socket_addr)->sin_addr,
+				address_buffer,
+				sizeof(address_buffer)
+		);
+		uint16_t port = ntohs(
+				socket_addr.ss_family == AF_INET6 ?
+				((sockaddr_in6*) &socket_addr)->sin6_port :
+				((sockaddr_in*) &socket_addr)->sin_port
+		);
+		LOG(INFO) << "New client connected from " << address << ", port " << port;
+		if (m_send_buffer_size > 0) {
+			if (setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &m_send_buffer_size, sizeof(int)) < 0) {
+				LOG(WARNING) << "Unable to update socket send buffer size";
+			}
+		}
+		int fd = socket;
+		std::unique_ptr<stream_client> client(new stream_client(
+				*this, std::move(socket), std::string(address) + ":" + std::to_string(port)
+		));
+		m_loop->add(fd, EPOLLIN, client.get());
+		{
+			std::unique_lock<std::mutex> lock(m_clients_mutex);
+			m_clients[fd] = std::move(client);
+		}
+		if (!m_detection_timer->armed) {
+			m_detection_timer->arm(protocol_detection_timeout);
 		}
 	}
-	m_quit = false;
-	LOG(INFO) << "Stopped listening for incoming connections";
 }
 
 static void configure_loggers(const char *config_file_name, bool traceLibJpeg) {
@@ -222,96 +824,954 @@ static void setup_signal_handlers() {
 	sigaction(SIGPIPE, &sigint_action, nullptr); */
 }
 
-static std::atomic<int> frame_counter, byte_counter, jpeg_quality(80);
+static video_streamer::sharded_counter frames_captured, frames_sent, frame_bytes_sent, frames_recompressed,
+		libjpeg_errors, pipeline_frames_dropped;
 
-int video_streamer::main(int argc, char **argv, std::function<uncompressed_frame(uncompressed_frame)> frame_processor) {
-	std::vector<std::string> listen_addresses;
-	std::string capture_device_path = "/dev/video0";
-	int capture_frame_width = -1;
-	int capture_frame_height = -1;
+enum pipeline_stage {
+	STAGE_DEQUEUE,
+	STAGE_DISPATCH,
+	STAGE_HEADER_PARSE,
+	STAGE_DECODE,
+	STAGE_PROCESS,
+	STAGE_ENCODE,
+	STAGE_SCALE,
+	STAGE_REORDER,
+	STAGE_COUNT
+};
+
+static const char *const stage_names[] = { "dequeue", "dispatch", "header_parse", "decode", "process", "encode", "scale", "reorder" };
+static video_streamer::latency_histogram stage_latency[STAGE_COUNT];
+
+namespace video_streamer {
+	
+	// Reduced resolution copy of the stream with listeners of its own
+	struct stream_tier {
+		int scale_denom;
+		std::unique_ptr<stream_server> server;
+		// Frames of the tier are much smaller than the full size ones, so they get buffers of their own
+		std::shared_ptr<jpeg_buffer_pool> jpeg_buffers;
+	};
+	
+	struct encoded_frame {
+		std::shared_ptr<const image_buffer> buffer;
+		frame_metadata metadata;
+		std::chrono::steady_clock::time_point encoded_at;
+		// One entry per tier, empty if the tier had no clients
+		std::vector<std::shared_ptr<const image_buffer>> tier_buffers;
+	};
+	
+	struct captured_frame {
+		image_buffer buffer { nullptr, 0 };
+		frame_metadata metadata;
+		std::chrono::steady_clock::time_point dequeued_at;
+	};
+	
+	// Frames waiting for a worker hold capture buffers, so the input queue is short
+	static const size_t worker_input_capacity = 2;
+	static const size_t worker_output_capacity = 4;
+	
+	// Queues between a camera and one worker of the shared pool
+	struct pipeline_lane {
+		spsc_queue<captured_frame> input;
+		spsc_queue<encoded_frame> output;
+		// Notified by the send thread when it takes frames from a full output
+		queue_signal output_space;
+		
+		pipeline_lane(): input(worker_input_capacity), output(worker_output_capacity) {
+		}
+	};
+	
+	struct pipeline_worker {
+		queue_signal input_signal;
+		// Frames waiting in the inputs of all cameras, capture threads prefer the least loaded worker
+		std::atomic<size_t> pending { 0 };
+	};
+	
+	// Command line settings of a camera, the ones given before its source are inherited from the previous camera
+	struct camera_options {
+		std::string device_path = "/dev/video0";
+		bool synthetic = false;
+		std::string replay_path;
+		bool has_source = false;
+		double fps = 30;
+		int width = -1;
+		int height = -1;
+		v4l2::format format = v4l2::format::MJPEG;
+		v4l2::capture_method method = v4l2::capture_method::MMAP;
+		int target_bitrate = -1;
+		int record_segment_size = 256;
+		std::vector<std::string> listen_addresses;
+		std::map<int, std::vector<std::string>> tier_addresses;
+		std::string record_directory;
+	};
+	
+	// A capture source with everything serving its stream, one capture thread and one send thread
+	struct camera {
+		std::string name;
+		std::unique_ptr<capture_source> source;
+		v4l2::format format;
+		std::unique_ptr<stream_server> server;
+		// Encoded full size frames, the pool learns their typical size
+		std::shared_ptr<jpeg_buffer_pool> jpeg_buffers;
+		std::vector<stream_tier> tiers;
+		std::unique_ptr<rate_controller> rate;
+		// Archives the full size stream, writes happen on a thread of its own
+		std::unique_ptr<segment_recorder> recorder;
+		std::unique_ptr<reorder_buffer<encoded_frame>> reorder;
+		// Set for H.264 cameras, their access units are passed through by the capture thread
+		std::unique_ptr<h264_packetizer> h264;
+		// One per worker
+		std::vector<std::unique_ptr<pipeline_lane>> lanes;
+		queue_signal output_signal;
+		// Frames dropped by the capture thread, so that the reorder stage doesn't wait for them
+		spsc_queue<uint64_t> dropped_indices { 64 };
+	};
+	
+	// User code changing every frame, either on RGB pixels or on YCbCr planes
+	struct frame_processors {
+		std::function<uncompressed_frame(uncompressed_frame)> rgb;
+		std::vector<ycbcr_processor> ycbcr;
+		
+		bool empty() const {
+			return !rgb && ycbcr.empty();
+		}
+	};
+	
+	static std::vector<std::shared_ptr<const image_buffer>> encode_tiers(
+			jpeg_frame &frame, std::vector<stream_tier> &tiers, int quality
+	) {
+		std::vector<std::shared_ptr<const image_buffer>> result(tiers.size());
+		for (size_t i = 0; i < tiers.size(); i++) {
+			if (!tiers[i].server->client_count()) continue;
+			auto stage_start = std::chrono::steady_clock::now();
+			auto scaled_frame = frame.uncompress(JCS_RGB, 3, tiers[i].scale_denom);
+			result[i] = jpeg_frame(scaled_frame, JCS_RGB, 3, quality, *tiers[i].jpeg_buffers).shared_buffer();
+			stage_latency[STAGE_SCALE].record_since(stage_start);
+		}
+		return result;
+	}
+	
+	static encoded_frame encode_frame(
+			camera &camera, captured_frame &captured, bool reduce_chroma,
+			const frame_processors &processors
+	) {
+		auto &metadata = captured.metadata;
+		auto &rate = *camera.rate;
+		auto stage_start = std::chrono::steady_clock::now();
+		stage_latency[STAGE_DISPATCH].record(stage_start - captured.dequeued_at);
+		auto frame = camera.source->make_jpeg(std::move(captured.buffer), rate.quality(), *camera.jpeg_buffers);
+		frame.metadata() = metadata;
+		stage_latency[
+				camera.format == v4l2::format::MJPEG ? STAGE_HEADER_PARSE : STAGE_ENCODE
+		].record_since(stage_start);
+		if (!processors.ycbcr.empty()) {
+			stage_start = std::chrono::steady_clock::now();
+			auto planes = frame.uncompress_ycbcr();
+			stage_latency[STAGE_DECODE].record_since(stage_start);
+			stage_start = std::chrono::steady_clock::now();
+			for (auto &processor : processors.ycbcr) {
+				processor(planes);
+			}
+			stage_latency[STAGE_PROCESS].record_since(stage_start);
+			stage_start = std::chrono::steady_clock::now();
+			auto compressed_frame = jpeg_frame(planes, rate.quality(), *camera.jpeg_buffers);
+			compressed_frame.metadata() = metadata;
+			stage_latency[STAGE_ENCODE].record_since(stage_start);
+			auto tier_buffers = encode_tiers(compressed_frame, camera.tiers, rate.quality());
+			return encoded_frame {
+					compressed_frame.shared_buffer(), metadata, std::chrono::steady_clock::now(),
+					std::move(tier_buffers)
+			};
+		}
+		if (processors.rgb) {
+			stage_start = std::chrono::steady_clock::now();
+			auto uncompressed_frame = frame.uncompress(JCS_RGB, 3);
+			stage_latency[STAGE_DECODE].record_since(stage_start);
+			stage_start = std::chrono::steady_clock::now();
+			auto processed_frame = processors.rgb(std::move(uncompressed_frame));
+			stage_latency[STAGE_PROCESS].record_since(stage_start);
+			stage_start = std::chrono::steady_clock::now();
+			auto compressed_frame = jpeg_frame(
+					processed_frame, JCS_RGB, 3, rate.quality(), *camera.jpeg_buffers
+			);
+			compressed_frame.metadata() = metadata;
+			stage_latency[STAGE_ENCODE].record_since(stage_start);
+			auto tier_buffers = encode_tiers(compressed_frame, camera.tiers, rate.quality());
+			return encoded_frame {
+					compressed_frame.shared_buffer(), metadata, std::chrono::steady_clock::now(),
+					std::move(tier_buffers)
+			};
+		}
+		auto output = frame.shared_buffer();
+		size_t budget = rate.frame_budget();
+		if (camera.format == v4l2::format::MJPEG && budget && output->size() > budget) {
+			// The camera encoder doesn't know about our uplink
+			stage_start = std::chrono::steady_clock::now();
+			auto recompressed_frame = frame.recompress(rate.quality(), reduce_chroma, *camera.jpeg_buffers);
+			stage_latency[STAGE_ENCODE].record_since(stage_start);
+			if (recompressed_frame.buffer().size() < output->size()) {
+				output = recompressed_frame.shared_buffer();
+				frames_recompressed.add();
+			}
+		}
+		auto tier_buffers = encode_tiers(frame, camera.tiers, rate.quality());
+		return encoded_frame {
+				std::move(output), metadata, std::chrono::steady_clock::now(), std::move(tier_buffers)
+		};
+	}
+	
+	static void capture_frames(camera &camera, std::vector<std::unique_ptr<pipeline_worker>> &workers) {
+		size_t next_worker = 0;
+		std::vector<size_t> order(workers.size());
+		while (running) {
+			captured_frame frame;
+			frame.buffer = camera.source->read_buffer(frame.metadata);
+			frame.dequeued_at = std::chrono::steady_clock::now();
+			frames_captured.add();
+			stage_latency[STAGE_DEQUEUE].record(frame.dequeued_at - frame.metadata.timestamp);
+			if (camera.h264) {
+				// Nothing to encode and the stream order matters, so the worker pool is skipped
+				frame_dependency dependency;
+				auto buffer = camera.h264->packetize(frame.buffer, dependency);
+				frame.buffer = image_buffer(nullptr, 0);
+				if (buffer) {
+					frame_bytes_sent.add(buffer->size());
+					frames_sent.add();
+					camera.server->send(std::move(buffer), frame.metadata, dependency);
+				}
+				continue;
+			}
+			// The least loaded worker (round robin among equally loaded ones) gets the frame
+			for (size_t i = 0; i < workers.size(); i++) {
+				order[i] = (next_worker + i) % workers.size();
+			}
+			std::stable_sort(order.begin(), order.end(), [&workers](size_t a, size_t b) {
+				return workers[a]->pending.load(std::memory_order_relaxed) <
+						workers[b]->pending.load(std::memory_order_relaxed);
+			});
+			bool dispatched = false;
+			for (size_t i = 0; i < workers.size() && !dispatched; i++) {
+				auto &worker = *workers[order[i]];
+				worker.pending.fetch_add(1, std::memory_order_relaxed);
+				if (camera.lanes[order[i]]->input.try_push(std::move(frame))) {
+					worker.input_signal.notify();
+					next_worker = (order[i] + 1) % workers.size();
+					dispatched = true;
+				} else {
+					worker.pending.fetch_sub(1, std::memory_order_relaxed);
+				}
+			}
+			if (!dispatched) {
+				// Every worker is busy, give the buffer back to the driver right away
+				pipeline_frames_dropped.add();
+				if (camera.dropped_indices.try_push(std::move(frame.metadata.index))) {
+					camera.output_signal.notify();
+				}
+			}
+		}
+	}
+	
+	static void process_frames(
+			size_t worker_index, pipeline_worker &worker, std::vector<std::unique_ptr<camera>> &cameras,
+			bool reduce_chroma, const frame_processors &processors
+	) {
+		auto has_input = [worker_index, &cameras] {
+			for (auto &camera : cameras) {
+				if (camera->lanes[worker_index]->input.size() > 0) return true;
+			}
+			return !running;
+		};
+		size_t next_camera = 0;
+		while (running) {
+			// Take one frame from every camera in turn, so that a busy camera doesn't starve the others
+			bool idle = true;
+			for (size_t i = 0; i < cameras.size(); i++) {
+				auto &camera = *cameras[(next_camera + i) % cameras.size()];
+				auto &lane = *camera.lanes[worker_index];
+				captured_frame captured;
+				if (!lane.input.try_pop(captured)) continue;
+				worker.pending.fetch_sub(1, std::memory_order_relaxed);
+				idle = false;
+				auto metadata = captured.metadata;
+				encoded_frame frame;
+				bool failed = false;
+				try {
+					frame = encode_frame(camera, captured, reduce_chroma, processors);
+				} catch (const libjpeg_exception &e) {
+					libjpeg_errors.add();
+					LOG(WARNING) << "libjpeg error: " << e.what();
+					failed = true;
+				} catch (const std::exception &e) {
+					// Frame processors are user code, an exception must not take the worker down
+					LOG(ERROR) << "Unable to process frame #" << metadata.index << ": " << e.what();
+					failed = true;
+				}
+				if (failed) {
+					// A frame without a buffer tells the send thread to skip the index
+					frame = encoded_frame { nullptr, metadata, std::chrono::steady_clock::now(), {} };
+				}
+				// The send thread is behind, sleep until it takes a frame from this lane
+				while (!lane.output.try_push(std::move(frame)) && running) {
+					lane.output_space.wait([&lane] {
+						return lane.output.size() < lane.output.capacity() || !running;
+					}, std::chrono::milliseconds(100));
+				}
+				camera.output_signal.notify();
+			}
+			next_camera = (next_camera + 1) % cameras.size();
+			if (idle) {
+				worker.input_signal.wait(has_input, std::chrono::milliseconds(100));
+			}
+		}
+	}
+	
+	static void send_frames(camera &camera) {
+		auto has_output = [&camera] {
+			for (auto &lane : camera.lanes) {
+				if (lane->output.size() > 0) return true;
+			}
+			return camera.dropped_indices.size() > 0 || !running;
+		};
+		encoded_frame frame;
+		uint64_t index;
+		while (running) {
+			bool idle = true;
+			for (auto &lane : camera.lanes) {
+				bool popped = false;
+				while (lane->output.try_pop(frame)) {
+					popped = true;
+					if (frame.buffer) {
+						camera.reorder->push(frame.metadata.index, std::move(frame));
+					} else {
+						camera.reorder->skip(frame.metadata.index);
+					}
+				}
+				if (popped) {
+					idle = false;
+					lane->output_space.notify();
+				}
+			}
+			while (camera.dropped_indices.try_pop(index)) {
+				idle = false;
+				camera.reorder->skip(index);
+			}
+			if (idle) {
+				camera.output_signal.wait(has_output, std::chrono::milliseconds(100));
+			}
+		}
+	}
+	
+	static int run_streamer(int argc, char **argv, const frame_processors &processors);
+
+}
+
+static void register_metrics(
+		video_streamer::metrics_registry &metrics,
+		std::vector<std::unique_ptr<video_streamer::camera>> &cameras,
+		std::vector<std::unique_ptr<video_streamer::pipeline_worker>> &workers
+) {
+	using video_streamer::metrics_writer;
+	auto camera_label = [](const video_streamer::camera &camera) {
+		return metrics_writer::label("camera", camera.name);
+	};
+	metrics.add_counter("video_streamer_frames_captured_total", "Frames dequeued from the capture device", frames_captured);
+	metrics.add_counter("video_streamer_frames_sent_total", "Frames passed to the stream server", frames_sent);
+	metrics.add_counter(
+			"video_streamer_frame_bytes_sent_total", "Bytes of frames passed to the stream server", frame_bytes_sent
+	);
+	metrics.add_counter(
+			"video_streamer_frames_recompressed_total", "Camera frames recompressed to fit the target bitrate",
+			frames_recompressed
+	);
+	metrics.add_counter("video_streamer_libjpeg_errors_total", "Frames lost because of libjpeg errors", libjpeg_errors);
+	metrics.add_counter(
+			"video_streamer_pipeline_frames_dropped_total", "Captured frames dropped because all workers were busy",
+			pipeline_frames_dropped
+	);
+	metrics.add("video_streamer_pipeline_queue_depth", "gauge", "Frames waiting between pipeline stages", [&cameras](
+			metrics_writer &writer, const std::string &name
+	) {
+		uint64_t input = 0, output = 0;
+		for (auto &camera : cameras) {
+			for (auto &lane : camera->lanes) {
+				input += lane->input.size();
+				output += lane->output.size();
+			}
+		}
+		writer.sample(name, "queue=\"workers\"", input);
+		writer.sample(name, "queue=\"send\"", output);
+	});
+	metrics.add("video_streamer_worker_pending_frames", "gauge", "Frames waiting for a worker", [&workers](
+			metrics_writer &writer, const std::string &name
+	) {
+		for (size_t i = 0; i < workers.size(); i++) {
+			writer.sample(
+					name, metrics_writer::label("worker", std::to_string(i)),
+					(uint64_t) workers[i]->pending.load(std::memory_order_relaxed)
+			);
+		}
+	});
+	metrics.add("video_streamer_reorder_frames_total", "counter", "Frames given up by the reorder stage", [=, &cameras](
+			metrics_writer &writer, const std::string &name
+	) {
+		for (auto &camera : cameras) {
+			writer.sample(name, camera_label(*camera) + ",reason=\"late\"", camera->reorder->late_count());
+			writer.sample(name, camera_label(*camera) + ",reason=\"lost\"", camera->reorder->lost_count());
+		}
+	});
+	metrics.add("video_streamer_jpeg_quality", "gauge", "Current JPEG encoding quality", [=, &cameras](
+			metrics_writer &writer, const std::string &name
+	) {
+		for (auto &camera : cameras) {
+			writer.sample(name, camera_label(*camera), (uint64_t) camera->rate->quality());
+		}
+	});
+	metrics.add("video_streamer_bitrate_bits", "gauge", "Measured stream bitrate", [=, &cameras](
+			metrics_writer &writer, const std::string &name
+	) {
+		for (auto &camera : cameras) {
+			writer.sample(name, camera_label(*camera), camera->rate->measured_bitrate());
+		}
+	});
+	// Every camera (its H.264 packetizer instead for H.264 cameras) and tier has a pool of encoded frame buffers
+	auto for_each_jpeg_pool = [&cameras](
+			const std::function<void(const std::string&, const video_streamer::jpeg_buffer_pool&)> &fn
+	) {
+		for (auto &camera : cameras) {
+			auto label = metrics_writer::label("camera", camera->name);
+			fn(label + ",tier=\"1/1\"", camera->h264 ? camera->h264->pool() : *camera->jpeg_buffers);
+			for (auto &tier : camera->tiers) {
+				fn(
+						label + "," + metrics_writer::label("tier", "1/" + std::to_string(tier.scale_denom)),
+						*tier.jpeg_buffers
+				);
+			}
+		}
+	};
+	metrics.add("video_streamer_jpeg_buffer_allocations_total", "counter", "Encoded frame buffers allocated", [=](
+			metrics_writer &writer, const std::string &name
+	) {
+		for_each_jpeg_pool([&](const std::string &label, const video_streamer::jpeg_buffer_pool &pool) {
+			writer.sample(name, label, pool.allocations());
+		});
+	});
+	metrics.add("video_streamer_libjpeg_codecs_total", "counter", "Events of the libjpeg codec cache", [](
+			metrics_writer &writer, const std::string &name
+	) {
+		auto write = [&writer, &name](const char *codec, const video_streamer::libjpeg_cache_stats &stats) {
+			auto label = metrics_writer::label("codec", codec);
+			writer.sample(name, label + ",event=\"created\"", stats.created);
+			writer.sample(name, label + ",event=\"shared_hit\"", stats.shared_hits);
+			writer.sample(name, label + ",event=\"discarded\"", stats.discarded);
+		};
+		write("decompressor", video_streamer::libjpeg_instance<video_streamer::jpeg_decompressor_impl>::stats());
+		write("compressor", video_streamer::libjpeg_instance<video_streamer::jpeg_compressor_impl>::stats());
+	});
+	metrics.add("video_streamer_frame_buffer_allocations_total", "counter", "Decoded frame buffers allocated", [](
+			metrics_writer &writer, const std::string &name
+	) {
+		writer.sample(name, "", video_streamer::frame_pool::instance().allocations());
+	});
+	metrics.add("video_streamer_jpeg_buffer_typical_bytes", "gauge", "Typical size of an encoded frame", [=](
+			metrics_writer &writer, const std::string &name
+	) {
+		for_each_jpeg_pool([&](const std::string &label, const video_streamer::jpeg_buffer_pool &pool) {
+			writer.sample(name, label, (uint64_t) pool.typical_size());
+		});
+	});
+	metrics.add("video_streamer_recorder_frames_total", "counter", "Frames passed to the recorder", [=, &cameras](
+			metrics_writer &writer, const std::string &name
+	) {
+		for (auto &camera : cameras) {
+			if (!camera->recorder) continue;
+			auto stats = camera->recorder->stats();
+			writer.sample(name, camera_label(*camera) + ",state=\"recorded\"", stats.frames_recorded);
+			writer.sample(name, camera_label(*camera) + ",state=\"dropped\"", stats.frames_dropped);
+		}
+	});
+	metrics.add("video_streamer_recorder_bytes_written_total", "counter", "Bytes written to segments", [=, &cameras](
+			metrics_writer &writer, const std::string &name
+	) {
+		for (auto &camera : cameras) {
+			if (!camera->recorder) continue;
+			writer.sample(name, camera_label(*camera), camera->recorder->stats().bytes_written);
+		}
+	});
+	metrics.add("video_streamer_recorder_write_errors_total", "counter", "Failed recording writes", [=, &cameras](
+			metrics_writer &writer, const std::string &name
+	) {
+		for (auto &camera : cameras) {
+			if (!camera->recorder) continue;
+			writer.sample(name, camera_label(*camera), camera->recorder->stats().write_errors);
+		}
+	});
+	metrics.add("video_streamer_capture_buffers", "gauge", "Capture buffers of the device", [=, &cameras](
+			metrics_writer &writer, const std::string &name
+	) {
+		for (auto &camera : cameras) {
+			auto total = camera->source->buffer_count();
+			auto queued = camera->source->queued_buffer_count();
+			writer.sample(name, camera_label(*camera) + ",state=\"queued\"", (uint64_t) queued);
+			writer.sample(
+					name, camera_label(*camera) + ",state=\"in_use\"", (uint64_t) (total > queued ? total - queued : 0)
+			);
+		}
+	});
+	metrics.add("video_streamer_stage_latency_seconds", "summary", "Latency of the pipeline stages", [=, &cameras](
+			metrics_writer &writer, const std::string &name
+	) {
+		for (int i = 0; i < STAGE_COUNT; i++) {
+			writer.summary(name, metrics_writer::label("stage", stage_names[i]), stage_latency[i].snapshot());
+		}
+		for (auto &camera : cameras) {
+			auto label = camera_label(*camera);
+			auto server_latency = camera->server->latency();
+			writer.summary(name, label + ",stage=\"queue_wait\"", server_latency.queue_wait);
+			writer.summary(name, label + ",stage=\"send\"", server_latency.send);
+			writer.summary(name, label + ",stage=\"capture_to_wire\"", server_latency.capture_to_wire);
+		}
+	});
+	metrics.add("video_streamer_clients", "gauge", "Connected clients", [=, &cameras](
+			metrics_writer &writer, const std::string &name
+	) {
+		for (auto &camera : cameras) {
+			auto label = camera_label(*camera);
+			writer.sample(name, label + ",tier=\"1/1\"", (uint64_t) camera->server->client_count());
+			for (auto &tier : camera->tiers) {
+				writer.sample(
+						name, label + "," + metrics_writer::label("tier", "1/" + std::to_string(tier.scale_denom)),
+						(uint64_t) tier.server->client_count()
+				);
+			}
+		}
+	});
+	// Every client of the full size streams
+	auto for_each_client = [&cameras](
+			const std::function<void(const std::string&, const video_streamer::stream_client_stats&)> &fn
+	) {
+		for (auto &camera : cameras) {
+			auto label = metrics_writer::label("camera", camera->name);
+			for (auto &client : camera->server->client_stats()) {
+				fn(label + "," + metrics_writer::label("client", client.address), client);
+			}
+		}
+	};
+	metrics.add("video_streamer_client_frames_sent_total", "counter", "Frames sent to the client", [=](
+			metrics_writer &writer, const std::string &name
+	) {
+		for_each_client([&](const std::string &label, const video_streamer::stream_client_stats &client) {
+			writer.sample(name, label, client.frames_sent);
+		});
+	});
+	metrics.add("video_streamer_client_frames_dropped_total", "counter", "Frames dropped for the client", [=](
+			metrics_writer &writer, const std::string &name
+	) {
+		for_each_client([&](const std::string &label, const video_streamer::stream_client_stats &client) {
+			writer.sample(name, label, client.frames_dropped);
+		});
+	});
+	metrics.add("video_streamer_client_bytes_sent_total", "counter", "Bytes sent to the client", [=](
+			metrics_writer &writer, const std::string &name
+	) {
+		for_each_client([&](const std::string &label, const video_streamer::stream_client_stats &client) {
+			writer.sample(name, label, client.bytes_sent);
+		});
+	});
+	metrics.add("video_streamer_client_queue_depth", "gauge", "Frames waiting in the client queue", [=](
+			metrics_writer &writer, const std::string &name
+	) {
+		for_each_client([&](const std::string &label, const video_streamer::stream_client_stats &client) {
+			writer.sample(name, label, (uint64_t) client.frames_queued);
+		});
+	});
+	metrics.add("video_streamer_client_latency_seconds", "summary", "Latency of the client queue", [=](
+			metrics_writer &writer, const std::string &name
+	) {
+		for_each_client([&](const std::string &label, const video_streamer::stream_client_stats &client) {
+			writer.summary(name, label + ",stage=\"queue_wait\"", client.queue_wait);
+			writer.summary(name, label + ",stage=\"send\"", client.send);
+		});
+	});
+}
+
+int video_streamer::run_streamer(int argc, char **argv, const frame_processors &processors) {
+	std::vector<camera_options> camera_groups(1);
 	bool show_stats = false;
 	const char *log_config_file = nullptr;
 	bool trace_libjpeg = false;
-	int target_bitrate = -1;
+	bool reduce_chroma = false;
+	bool hugepages = false;
+	int worker_count = -1;
 	int send_buffer_size = -1;
+	int max_queued_frames = 4;
+	auto policy = backpressure_policy::DROP_OLDEST;
+	int max_reorder_delay = 100;
+	std::vector<std::string> metrics_addresses;
+	// A source option starts the next camera once the current one has a source
+	auto source_group = [&camera_groups]() -> camera_options& {
+		if (camera_groups.back().has_source) {
+			camera_options options = camera_groups.back();
+			options.synthetic = false;
+			options.replay_path.clear();
+			options.listen_addresses.clear();
+			options.tier_addresses.clear();
+			options.record_directory.clear();
+			camera_groups.push_back(std::move(options));
+		}
+		camera_groups.back().has_source = true;
+		return camera_groups.back();
+	};
 	for (auto i = 0; i < argc; i++) {
 		std::string arg(argv[i]);
+		auto &group = camera_groups.back();
 		if (arg == "--listen" && i < argc - 1) {
-			listen_addresses.emplace_back(argv[++i]);
+			group.listen_addresses.emplace_back(argv[++i]);
 		} else if (arg == "--device" && i < argc - 1) {
-			capture_device_path = argv[++i];
+			source_group().device_path = argv[++i];
 		} else if (arg == "--width" && i < argc - 1) {
-			capture_frame_width = atoi(argv[++i]);
+			group.width = atoi(argv[++i]);
 		} else if (arg == "--height" && i < argc - 1) {
-			capture_frame_height = atoi(argv[++i]);
+			group.height = atoi(argv[++i]);
+		} else if (arg == "--format" && i < argc - 1) {
+			std::string name(argv[++i]);
+			if (name == "MJPEG") {
+				group.format = video_streamer::v4l2::format::MJPEG;
+			} else if (name == "YUYV") {
+				group.format = video_streamer::v4l2::format::YUYV;
+			} else if (name == "YVYU") {
+				group.format = video_streamer::v4l2::format::YVYU;
+			} else if (name == "UYVY") {
+				group.format = video_streamer::v4l2::format::UYVY;
+			} else if (name == "VYUY") {
+				group.format = video_streamer::v4l2::format::VYUY;
+			} else if (name == "H264") {
+				group.format = video_streamer::v4l2::format::H264;
+			} else {
+				std::cerr << "Invalid pixel format: " << name << std::endl;
+			}
 		} else if (arg == "--stats") {
 			show_stats = true;
 		} else if (arg == "--log-config" && i < argc - 1) {
 			log_config_file = argv[++i];
 		} else if (arg == "--trace-libjpeg") {
 			trace_libjpeg = true;
-		} else if (arg == "--target-bitrate") {
-			target_bitrate = atoi(argv[++i]);
+		} else if (arg == "--target-bitrate" && i < argc - 1) {
+			group.target_bitrate = atoi(argv[++i]);
+		} else if (arg == "--reduce-chroma") {
+			reduce_chroma = true;
+		} else if (arg == "--capture-method" && i < argc - 1) {
+			std::string name(argv[++i]);
+			if (name == "read") {
+				group.method = video_streamer::v4l2::capture_method::READ;
+			} else if (name == "mmap") {
+				group.method = video_streamer::v4l2::capture_method::MMAP;
+			} else if (name == "userptr") {
+				group.method = video_streamer::v4l2::capture_method::USERPTR;
+			} else if (name == "dmabuf") {
+				group.method = video_streamer::v4l2::capture_method::DMABUF;
+			} else {
+				std::cerr << "Invalid capture method: " << name << std::endl;
+			}
+		} else if (arg == "--workers" && i < argc - 1) {
+			worker_count = atoi(argv[++i]);
+		} else if (arg == "--hugepages") {
+			hugepages = true;
+		} else if (arg == "--synthetic") {
+			source_group().synthetic = true;
+		} else if (arg == "--replay" && i < argc - 1) {
+			source_group().replay_path = argv[++i];
+		} else if (arg == "--fps" && i < argc - 1) {
+			group.fps = atof(argv[++i]);
+		} else if (arg == "--record" && i < argc - 1) {
+			group.record_directory = argv[++i];
+		} else if (arg == "--record-segment-size" && i < argc - 1) {
+			group.record_segment_size = atoi(argv[++i]);
 		} else if (arg == "--send-buffer" && i < argc - 1) {
 			send_buffer_size = atoi(argv[++i]);
+		} else if (arg == "--max-queued-frames" && i < argc - 1) {
+			max_queued_frames = atoi(argv[++i]);
+		} else if (arg == "--tier" && i < argc - 2) {
+			int scale_denom = atoi(argv[++i]);
+			if (scale_denom == 2 || scale_denom == 4 || scale_denom == 8) {
+				group.tier_addresses[scale_denom].emplace_back(argv[++i]);
+			} else {
+				std::cerr << "Invalid tier scale (2, 4 or 8 expected): " << argv[i++] << std::endl;
+			}
+		} else if (arg == "--metrics-listen" && i < argc - 1) {
+			metrics_addresses.emplace_back(argv[++i]);
+		} else if (arg == "--max-reorder-delay" && i < argc - 1) {
+			max_reorder_delay = atoi(argv[++i]);
+		} else if (arg == "--backpressure" && i < argc - 1) {
+			std::string name(argv[++i]);
+			if (name == "bounded") {
+				policy = backpressure_policy::BOUNDED_QUEUE;
+			} else if (name == "drop-oldest") {
+				policy = backpressure_policy::DROP_OLDEST;
+			} else if (name == "latest") {
+				policy = backpressure_policy::LATEST_ONLY;
+			} else {
+				std::cerr << "Invalid backpressure policy: " << name << std::endl;
+			}
 		} else if (!arg.empty()) {
 			std::cerr << "Invalid command line argument: " << arg << std::endl;
 		}
 	}
-	if (listen_addresses.empty()) {
+	bool valid = true;
+	for (size_t i = 0; i < camera_groups.size(); i++) {
+		if (camera_groups[i].listen_addresses.empty()) {
+			valid = false;
+		}
+		auto &group = camera_groups[i];
+		if (group.synthetic && group.replay_path.empty() && !synthetic_source::supports_format(group.format)) {
+			std::cerr << "Synthetic frames can be either MJPEG or packed YUV 4:2:2, not " << group.format << std::endl;
+			return EXIT_FAILURE;
+		}
+		for (size_t j = 0; j < i; j++) {
+			auto &directory = camera_groups[i].record_directory;
+			if (!directory.empty() && directory == camera_groups[j].record_directory) {
+				std::cerr << "Every camera must be recorded to a directory of its own" << std::endl;
+				valid = false;
+			}
+		}
+	}
+	if (!valid) {
 		std::cerr << "Usage: " << argv[0] << " --device /dev/video0 --listen 127.0.0.1:1234 ..." << std::endl;
 		std::cerr << "\t" << "--width NNN" << std::endl;
 		std::cerr << "\t" << "--height NNN" << std::endl;
+		std::cerr << "\t" << "--format MJPEG|YUYV|YVYU|UYVY|VYUY|H264" << std::endl;
+		std::cerr << "\t" << "--capture-method read|mmap|userptr|dmabuf" << std::endl;
 		std::cerr << "\t" << "--stats" << std::endl;
 		std::cerr << "\t" << "--log-config FILE-NAME" << std::endl;
 		std::cerr << "\t" << "--trace-libjpeg" << std::endl;
-		std::cerr << "\t" << "--bitrate NNN" << std::endl;
+		std::cerr << "\t" << "--target-bitrate KBIT/S" << std::endl;
+		std::cerr << "\t" << "--reduce-chroma" << std::endl;
 		std::cerr << "\t" << "--send-buffer NNN" << std::endl;
+		std::cerr << "\t" << "--max-queued-frames NNN" << std::endl;
+		std::cerr << "\t" << "--backpressure bounded|drop-oldest|latest" << std::endl;
+		std::cerr << "\t" << "--max-reorder-delay MS" << std::endl;
+		std::cerr << "\t" << "--metrics-listen 127.0.0.1:9100" << std::endl;
+		std::cerr << "\t" << "--tier 2|4|8 127.0.0.1:1235" << std::endl;
+		std::cerr << "\t" << "--hugepages" << std::endl;
+		std::cerr << "\t" << "--workers NNN" << std::endl;
+		std::cerr << "\t" << "--synthetic" << std::endl;
+		std::cerr << "\t" << "--replay FILE-NAME" << std::endl;
+		std::cerr << "\t" << "--fps NNN" << std::endl;
+		std::cerr << "\t" << "--record DIRECTORY" << std::endl;
+		std::cerr << "\t" << "--record-segment-size MB" << std::endl;
+		std::cerr << "More cameras are served by repeating --device (or --synthetic, --replay) followed by ";
+		std::cerr << "the options of that camera" << std::endl;
 		return EXIT_SUCCESS;
 	}
 	configure_loggers(log_config_file, trace_libjpeg);
+	video_streamer::frame_pool::instance().set_hugepages(hugepages);
 	
-	video_streamer::v4l2::capture_device device(capture_device_path);
-	device.set_format(capture_frame_width, capture_frame_height, video_streamer::v4l2::format::MJPEG);
-	LOG(INFO) << "Capture size is " << device.frame_width() << "x" << device.frame_height();
-	LOG(INFO) << "Capture pixel format is " << device.pixel_format();
+	if (worker_count <= 0) {
+		worker_count = (int) std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	
+	// All servers share a single network thread
+	video_streamer::event_loop loop;
+	std::vector<std::unique_ptr<camera>> cameras;
+	for (auto &options : camera_groups) {
+		std::unique_ptr<camera> cam(new camera());
+		cam->name = std::to_string(cameras.size());
+		if (!options.replay_path.empty()) {
+			cam->source.reset(new replay_source(options.replay_path, options.fps));
+		} else if (options.synthetic) {
+			cam->source.reset(new synthetic_source(
+					options.width > 0 ? options.width : 640,
+					options.height > 0 ? options.height : 480,
+					options.format, options.fps
+			));
+			LOG(INFO) << "Camera " << cam->name << ": capturing synthetic frames at " << options.fps << " FPS";
+		} else {
+			auto capture_device = new video_streamer::v4l2::capture_device(options.device_path, options.method);
+			cam->source.reset(capture_device);
+			LOG(INFO) << "Camera " << cam->name << ": capture method of " << options.device_path << " is " <<
+					capture_device->method();
+			capture_device->set_format(options.width, options.height, options.format);
+		}
+		auto &source = *cam->source;
+		cam->format = source.pixel_format();
+		LOG(INFO) << "Camera " << cam->name << ": capture size is " << source.frame_width() << "x" <<
+				source.frame_height();
+		LOG(INFO) << "Camera " << cam->name << ": capture pixel format is " << cam->format;
+		bool h264 = cam->format == video_streamer::v4l2::format::H264;
+		if (cam->format != video_streamer::v4l2::format::MJPEG && !h264) {
+			LOG(INFO) << "Using " << video_streamer::yuv422_kernel_name() << " kernel for YUV 4:2:2 compression";
+		}
+		
+		cam->server.reset(new stream_server(
+				loop, options.listen_addresses, send_buffer_size, max_queued_frames > 0 ? max_queued_frames : 1,
+				policy
+		));
+		cam->jpeg_buffers = video_streamer::jpeg_buffer_pool::create();
+		if (h264) {
+			cam->h264.reset(new h264_packetizer());
+			cam->server->set_format(stream_format::H264);
+			// The stream isn't decoded, so there is nothing to scale, recompress or record as MJPEG
+			if (!options.tier_addresses.empty() || options.target_bitrate > 0 || !options.record_directory.empty()) {
+				LOG(WARNING) << "Camera " << cam->name << ": tiers, target bitrate and recording are " <<
+						"not supported for H.264 and ignored";
+			}
+			options.tier_addresses.clear();
+			options.target_bitrate = -1;
+			options.record_directory.clear();
+		}
+		for (auto &it : options.tier_addresses) {
+			LOG(INFO) << "Camera " << cam->name << ": streaming 1/" << it.first <<
+					" of the capture size to a separate tier";
+			cam->tiers.push_back(stream_tier {
+					it.first,
+					std::unique_ptr<stream_server>(new stream_server(
+							loop, it.second, send_buffer_size, max_queued_frames > 0 ? max_queued_frames : 1, policy
+					)),
+					video_streamer::jpeg_buffer_pool::create()
+			});
+		}
+		
+		cam->rate.reset(new video_streamer::rate_controller(
+				options.target_bitrate > 0 ? (uint64_t) options.target_bitrate * 1000 : 0
+		));
+		if (cam->rate->enabled()) {
+			LOG(INFO) << "Camera " << cam->name << ": target bitrate is " << options.target_bitrate << " kbit/s";
+		}
+		
+		if (!options.record_directory.empty()) {
+			cam->recorder.reset(new segment_recorder(
+					options.record_directory, (uint64_t) std::max(options.record_segment_size, 1) * 1024 * 1024
+			));
+		}
+		
+		// Worker threads finish frames in arbitrary order, restore the capture order before sending
+		auto &camera_ref = *cam;
+		cam->reorder.reset(new video_streamer::reorder_buffer<encoded_frame>(
+				[&camera_ref](encoded_frame &frame) {
+					stage_latency[STAGE_REORDER].record_since(frame.encoded_at);
+					camera_ref.rate->record(frame.buffer->size());
+					frame_bytes_sent.add(frame.buffer->size());
+					frames_sent.add();
+					if (camera_ref.recorder) {
+						camera_ref.recorder->record(*frame.buffer, frame.metadata);
+					}
+					camera_ref.server->send(std::move(frame.buffer), frame.metadata);
+					for (size_t i = 0; i < frame.tier_buffers.size(); i++) {
+						if (frame.tier_buffers[i]) {
+							camera_ref.tiers[i].server->send(std::move(frame.tier_buffers[i]), frame.metadata);
+						}
+					}
+				},
+				std::chrono::milliseconds(max_reorder_delay > 0 ? max_reorder_delay : 0),
+				2 * (size_t) worker_count
+		));
+		for (int i = 0; i < worker_count; i++) {
+			cam->lanes.emplace_back(new pipeline_lane());
+		}
+		cameras.emplace_back(std::move(cam));
+	}
 	
-	video_streamer::stream_server server(listen_addresses, send_buffer_size);
+	/*
+	 * Capture thread -> shared worker pool -> send thread per camera. Every camera has a pair of queues
+	 * with every worker, so that each queue has a single producer and a single consumer.
+	 */
+	std::vector<std::unique_ptr<pipeline_worker>> workers;
+	for (int i = 0; i < worker_count; i++) {
+		workers.emplace_back(new pipeline_worker());
+	}
+	LOG(INFO) << "Encoding frames of " << cameras.size() << " cameras in " << workers.size() << " worker threads";
 	
 	std::vector<std::thread> stream_threads;
-	stream_threads.reserve(std::thread::hardware_concurrency());
-	for (auto i = 0; i < std::thread::hardware_concurrency(); i++) {
-		stream_threads.emplace_back([&device, &server, &frame_processor] {
-			while (running) {
-				try {
-					auto frame = device.read_jpeg();
-					if (frame_processor) {
-						auto processed_frame = frame_processor(frame.uncompress(JCS_RGB, 3));
-						auto compressed_frame = jpeg_frame(
-								processed_frame, JCS_RGB, 3, jpeg_quality
-						);
-						server.send(compressed_frame);
-						byte_counter += (int) compressed_frame.buffer().size();
-					} else {
-						// TODO: Recompress JPEG if the frame is exceed target bitrate
-						server.send(frame);
-						byte_counter += (int) frame.buffer().size();
-					}
-					// TODO: Adjust quality if it is exceed target bitrate
-					frame_counter++;
-				} catch (const video_streamer::libjpeg_exception &e) {
-					LOG(WARNING) << "libjpeg error: " << e.what();
-				}
-			}
+	stream_threads.reserve(workers.size() + 2 * cameras.size());
+	for (auto &cam : cameras) {
+		auto &camera_ref = *cam;
+		stream_threads.emplace_back([&camera_ref, &workers] {
+			capture_frames(camera_ref, workers);
+		});
+	}
+	for (size_t i = 0; i < workers.size(); i++) {
+		auto &worker = *workers[i];
+		stream_threads.emplace_back([i, &worker, &cameras, reduce_chroma, &processors] {
+			process_frames(i, worker, cameras, reduce_chroma, processors);
+		});
+	}
+	for (auto &cam : cameras) {
+		auto &camera_ref = *cam;
+		stream_threads.emplace_back([&camera_ref] {
+			send_frames(camera_ref);
 		});
 	}
 	
+	video_streamer::metrics_registry metrics;
+	register_metrics(metrics, cameras, workers);
+	std::unique_ptr<video_streamer::metrics_server> metrics_server;
+	if (!metrics_addresses.empty()) {
+		metrics_server.reset(new video_streamer::metrics_server(metrics, metrics_addresses));
+	}
+	
 	setup_signal_handlers();
+	uint64_t last_frames_sent = 0;
+	uint64_t last_frame_bytes_sent = 0;
+	std::vector<latency_snapshot> last_stage_latency;
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		last_stage_latency.push_back(stage_latency[i].snapshot());
+	}
+	std::vector<stream_server_latency> last_server_latency;
+	for (auto &cam : cameras) {
+		last_server_latency.push_back(cam->server->latency());
+	}
 	while (running) {
 		sleep(1);
 		if (show_stats) {
-			LOG(DEBUG) << "Processed " << frame_counter.exchange(0) << " frames (" <<
-					   (8 * byte_counter.exchange(0) / (1024 * 1024)) << " MBit/s)";
+			uint64_t frames = frames_sent.value();
+			uint64_t bytes = frame_bytes_sent.value();
+			LOG(DEBUG) << "Processed " << (frames - last_frames_sent) << " frames (" <<
+					   (8 * (bytes - last_frame_bytes_sent) / (1024 * 1024)) << " MBit/s)";
+			last_frames_sent = frames;
+			last_frame_bytes_sent = bytes;
+			LOG(DEBUG) << "Pipeline: " << pipeline_frames_dropped.value() << " frames dropped by the capture thread";
+			for (int i = 0; i < STAGE_COUNT; i++) {
+				auto snapshot = stage_latency[i].snapshot();
+				if (snapshot.count != last_stage_latency[i].count) {
+					LOG(DEBUG) << "Latency of " << stage_names[i] << ": " << snapshot.since(last_stage_latency[i]);
+				}
+				last_stage_latency[i] = snapshot;
+			}
+			for (size_t c = 0; c < cameras.size(); c++) {
+				auto &cam = *cameras[c];
+				auto prefix = "Camera " + cam.name + ": ";
+				if (cam.rate->enabled()) {
+					LOG(DEBUG) << prefix << "JPEG quality " << cam.rate->quality() << ", frame budget " <<
+							cam.rate->frame_budget() << " bytes, " << frames_recompressed.value() <<
+							" frames recompressed in total";
+				}
+				for (auto &client : cam.server->client_stats()) {
+					LOG(DEBUG) << prefix << "client " << client.address << ": " << client.frames_sent <<
+							" frames sent, " << client.frames_dropped << " frames dropped, " <<
+							client.frames_queued << " frames queued";
+					LOG(DEBUG) << prefix << "client " << client.address << " queue wait since connect: " <<
+							client.queue_wait;
+					LOG(DEBUG) << prefix << "client " << client.address << " send since connect: " << client.send;
+				}
+				for (auto &tier : cam.tiers) {
+					LOG(DEBUG) << prefix << "tier 1/" << tier.scale_denom << ": " << tier.server->client_count() <<
+							" clients";
+				}
+				if (cam.recorder) {
+					auto stats = cam.recorder->stats();
+					LOG(DEBUG) << prefix << "recording: " << stats.frames_recorded << " frames recorded, " <<
+							stats.frames_dropped << " frames dropped, " << (stats.bytes_written / (1024 * 1024)) <<
+							" MB written in " << stats.segments << " segments";
+				}
+				LOG(DEBUG) << prefix << "reordering: " << cam.reorder->late_count() << " late frames, " <<
+						cam.reorder->lost_count() << " lost frames";
+				auto server_latency = cam.server->latency();
+				auto &last = last_server_latency[c];
+				LOG(DEBUG) << prefix << "latency of queue wait: " << server_latency.queue_wait.since(last.queue_wait);
+				LOG(DEBUG) << prefix << "latency of send: " << server_latency.send.since(last.send);
+				LOG(DEBUG) << prefix << "latency of capture to wire: " <<
+						server_latency.capture_to_wire.since(last.capture_to_wire);
+				last = server_latency;
+			}
 		}
 	}
 	
@@ -321,3 +1781,11 @@ int video_streamer::main(int argc, char **argv, std::function<uncompressed_frame
 	
 	return EXIT_SUCCESS;
 }
+
+int video_streamer::main(int argc, char **argv, std::function<uncompressed_frame(uncompressed_frame)> frame_processor) {
+	return run_streamer(argc, argv, frame_processors { std::move(frame_processor), {} });
+}
+
+int video_streamer::main(int argc, char **argv, std::vector<ycbcr_processor> ycbcr_processors) {
+	return run_streamer(argc, argv, frame_processors { nullptr, std::move(ycbcr_processors) });
+}
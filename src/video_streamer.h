@@ -2,10 +2,19 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <thread>
 #include <string>
 #include "unique_fd.h"
+#include "event_loop.h"
+#include "latency_histogram.h"
 
 namespace video_streamer {
 	
@@ -44,6 +53,21 @@ namespace video_streamer {
 			}
 		}
 		
+		image_buffer &operator=(image_buffer &&buffer) noexcept {
+			if (this != &buffer) {
+				if (m_releaser) {
+					m_releaser->release(*this);
+				}
+				m_data = buffer.m_data;
+				m_size = buffer.m_size;
+				m_releaser = buffer.m_releaser;
+				buffer.m_data = nullptr;
+				buffer.m_size = 0;
+				buffer.m_releaser = nullptr;
+			}
+			return *this;
+		}
+		
 		uint8_t *data() const {
 			return m_data;
 		}
@@ -52,9 +76,30 @@ namespace video_streamer {
 			return m_size;
 		}
 		
+		image_buffer_releaser *releaser() const {
+			return m_releaser;
+		}
+		
+		void truncate(size_t size) {
+			if (size < m_size) {
+				m_size = size;
+			}
+		}
+		
+	};
+	
+	struct frame_metadata {
+		// Position of the frame in capture order, assigned without gaps when the frame is dequeued
+		uint64_t index = 0;
+		// Sequence number reported by the driver (has gaps when the driver drops frames)
+		uint32_t sequence = 0;
+		// Moment the frame was captured (driver timestamp when available), epoch if unknown
+		std::chrono::steady_clock::time_point timestamp;
 	};
 	
 	class frame {
+		frame_metadata m_metadata;
+		
 	public:
 		virtual ~frame() = default;
 		virtual int width() const = 0;
@@ -62,6 +107,14 @@ namespace video_streamer {
 		virtual image_buffer& buffer() = 0;
 		virtual const image_buffer& buffer() const = 0;
 		
+		frame_metadata& metadata() {
+			return m_metadata;
+		}
+		
+		const frame_metadata& metadata() const {
+			return m_metadata;
+		}
+		
 	};
 	
 	class uncompressed_frame: public frame {
@@ -69,11 +122,19 @@ namespace video_streamer {
 		int m_width;
 		int m_height;
 		int m_bytes_per_pixel;
+		int m_stride;
 	
 	public:
 		uncompressed_frame(
 				image_buffer buffer, int width, int height, int bytes_per_pixel
-		): m_buffer(std::move(buffer)), m_width(width), m_height(height), m_bytes_per_pixel(bytes_per_pixel) {
+		): uncompressed_frame(std::move(buffer), width, height, bytes_per_pixel, width * bytes_per_pixel) {
+		}
+		
+		// Rows start every stride bytes (pooled frames pad them to a cache line)
+		uncompressed_frame(
+				image_buffer buffer, int width, int height, int bytes_per_pixel, int stride
+		): m_buffer(std::move(buffer)), m_width(width), m_height(height), m_bytes_per_pixel(bytes_per_pixel),
+			m_stride(stride) {
 		}
 		
 		uncompressed_frame(
@@ -104,8 +165,20 @@ namespace video_streamer {
 			return m_bytes_per_pixel;
 		}
 		
+		int stride() const {
+			return m_stride;
+		}
+		
+		uint8_t *row(int y) {
+			return m_buffer.data() + (size_t) y * m_stride;
+		}
+		
+		const uint8_t *row(int y) const {
+			return m_buffer.data() + (size_t) y * m_stride;
+		}
+		
 		uint32_t pixel(int x, int y) const {
-			unsigned long offset = (y * m_width + x) * m_bytes_per_pixel;
+			unsigned long offset = (unsigned long) y * m_stride + x * m_bytes_per_pixel;
 			uint32_t result = 0;
 			for (auto i = 0; i < m_bytes_per_pixel; i++) {
 				result = result | ((uint32_t) m_buffer.data()[offset + i] << (8 * i));
@@ -114,7 +187,7 @@ namespace video_streamer {
 		}
 		
 		void set_pixel(int x, int y, uint32_t color) {
-			unsigned long offset = (y * m_width + x) * m_bytes_per_pixel;
+			unsigned long offset = (unsigned long) y * m_stride + x * m_bytes_per_pixel;
 			for (auto i = 0; i < m_bytes_per_pixel; i++) {
 				m_buffer.data()[offset + i] = (color >> (i * 8)) & 0xFF;
 			}
@@ -122,6 +195,67 @@ namespace video_streamer {
 		
 	};
 	
+	// One component of a planar YCbCr frame
+	struct ycbcr_plane {
+		uint8_t *data;
+		// Samples per row and rows of the plane (i.e. of the image divided by the subsampling)
+		int width;
+		int height;
+		// Rows and columns are padded to whole MCUs, padding samples are encoded too
+		int stride;
+		// Image pixels per sample horizontally and vertically, e.g. 2 and 2 for chroma of 4:2:0
+		int h_subsampling;
+		int v_subsampling;
+		
+		uint8_t *row(int y) const {
+			return data + (size_t) y * stride;
+		}
+		
+	};
+	
+	/*
+	 * Y, Cb and Cr planes of a frame in a single buffer, laid out as libjpeg reads and writes raw data:
+	 * no color conversion and chroma at the resolution it has in the JPEG image.
+	 */
+	class ycbcr_frame: public frame {
+		image_buffer m_buffer;
+		int m_width;
+		int m_height;
+		ycbcr_plane m_planes[3];
+		
+	public:
+		ycbcr_frame(
+				image_buffer buffer, int width, int height, const ycbcr_plane &y, const ycbcr_plane &cb,
+				const ycbcr_plane &cr
+		): m_buffer(std::move(buffer)), m_width(width), m_height(height), m_planes { y, cb, cr } {
+		}
+		
+		image_buffer& buffer() override {
+			return m_buffer;
+		}
+		
+		const image_buffer& buffer() const override {
+			return m_buffer;
+		}
+		
+		int width() const override {
+			return m_width;
+		}
+		
+		int height() const override {
+			return m_height;
+		}
+		
+		// 0 is Y, 1 is Cb, 2 is Cr
+		const ycbcr_plane &plane(int index) const {
+			return m_planes[index];
+		}
+		
+	};
+	
+	// Changes a frame in place, a chain of them works on a single buffer
+	typedef std::function<void(ycbcr_frame&)> ycbcr_processor;
+	
 	class stream_server_exception: public std::exception {
 		std::string m_message;
 	
@@ -134,23 +268,135 @@ namespace video_streamer {
 		
 	};
 	
-	class stream_server: std::thread {
-		std::vector<posix::unique_fd> m_server_sockets;
-		std::mutex m_server_sockets_mutex;
-		std::vector<posix::unique_fd> m_client_sockets;
-		std::mutex m_client_sockets_mutex;
-		bool m_quit = false;
+	// Creates a non-blocking listening TCP socket for "host:port" (IPv6 hosts may be enclosed in brackets)
+	posix::unique_fd open_server_socket(const std::string &address);
+	
+	enum class backpressure_policy {
+		// Keep up to N frames and skip new frames while the queue is full
+		BOUNDED_QUEUE,
+		// Keep up to N frames and discard the oldest waiting frame to make room for a new one
+		DROP_OLDEST,
+		// Keep only the most recent frame waiting behind the one being transmitted
+		LATEST_ONLY
+	};
+	
+	// How a frame can be decoded, frames of compressed video streams depend on the preceding ones
+	enum class frame_dependency {
+		// Decodable on its own (a JPEG image)
+		INDEPENDENT,
+		// Starts a group of frames (an H.264 IDR access unit with parameter sets)
+		KEY,
+		// Needs every frame since the last key frame
+		DELTA
+	};
+	
+	enum class stream_format {
+		MJPEG,
+		H264
+	};
+	
+	struct stream_client_stats {
+		std::string address;
+		uint64_t frames_sent;
+		uint64_t frames_dropped;
+		size_t frames_queued;
+		uint64_t bytes_sent;
+		// Time from stream_server::send() to the first byte written to the socket
+		latency_snapshot queue_wait;
+		// Time from the first to the last byte of a frame written to the socket
+		latency_snapshot send;
+	};
+	
+	struct stream_server_latency {
+		latency_snapshot queue_wait;
+		latency_snapshot send;
+		// Time from the capture timestamp to the last byte written to the socket
+		latency_snapshot capture_to_wire;
+	};
+	
+	class stream_client;
+	class stream_listener;
+	class stream_detection_timer;
+	
+	class stream_server {
+		struct incoming_frame {
+			std::shared_ptr<const image_buffer> buffer;
+			frame_dependency dependency;
+			std::chrono::steady_clock::time_point captured_at;
+			std::chrono::steady_clock::time_point enqueued_at;
+		};
+		
+		std::unique_ptr<event_loop> m_own_loop;
+		event_loop *m_loop;
+		std::vector<std::unique_ptr<stream_listener>> m_listeners;
+		// Clients are served by the network thread only, other threads lock the map to look at it
+		std::unordered_map<int, std::unique_ptr<stream_client>> m_clients;
+		std::mutex m_clients_mutex;
+		// Frames passed to send(), the network thread takes them all at once and fans them out to the clients
+		std::mutex m_incoming_mutex;
+		std::vector<incoming_frame> m_incoming;
+		std::vector<incoming_frame> m_incoming_batch;
+		std::atomic<bool> m_flush_scheduled;
 		int m_send_buffer_size;
+		size_t m_max_queued_frames;
+		backpressure_policy m_backpressure_policy;
+		latency_histogram m_queue_wait_latency;
+		latency_histogram m_send_latency;
+		latency_histogram m_capture_to_wire_latency;
+		stream_format m_format;
+		// Frames a new client needs to start decoding (the most recent image or the current group of frames),
+		// it gets them as soon as its protocol is known. Owned by the network thread
+		std::vector<std::pair<std::shared_ptr<const image_buffer>, frame_dependency>> m_join_frames;
+		size_t m_join_frames_size;
+		std::unique_ptr<stream_detection_timer> m_detection_timer;
 		
-		void run();
-		void accept_client(posix::unique_fd &server_socket);
+		stream_server(
+				std::unique_ptr<event_loop> own_loop,
+				event_loop *loop,
+				std::vector<std::string> server_addresses,
+				int send_buffer_size,
+				size_t max_queued_frames,
+				backpressure_policy policy
+		);
+		void accept_clients(stream_listener &listener);
+		void flush_clients();
+		void close_client(stream_client &client, const char *reason);
+		void detect_protocols();
+		
+		friend class stream_client;
+		friend class stream_listener;
+		friend class stream_detection_timer;
 		
 	public:
-		explicit stream_server(std::vector<std::string> server_addresses, int sendBufferSize = -1);
+		explicit stream_server(
+				std::vector<std::string> server_addresses,
+				int send_buffer_size = -1,
+				size_t max_queued_frames = 4,
+				backpressure_policy policy = backpressure_policy::DROP_OLDEST
+		);
+		// Serves clients on the given loop instead of starting a thread of its own
+		stream_server(
+				event_loop &loop,
+				std::vector<std::string> server_addresses,
+				int send_buffer_size = -1,
+				size_t max_queued_frames = 4,
+				backpressure_policy policy = backpressure_policy::DROP_OLDEST
+		);
 		~stream_server();
 		void send(const void *data, size_t data_size);
 		void send(const image_buffer &buffer);
 		void send(const frame &frame);
+		void send(
+				std::shared_ptr<const image_buffer> buffer, const frame_metadata &metadata = frame_metadata(),
+				frame_dependency dependency = frame_dependency::INDEPENDENT
+		);
+		// Selects how frames are framed for HTTP clients, must be called before any client connects
+		void set_format(stream_format format) {
+			m_format = format;
+		}
+		size_t client_count();
+		std::vector<stream_client_stats> client_stats();
+		stream_server_latency latency();
 	
 	};
 	
@@ -164,4 +410,6 @@ namespace video_streamer {
 			std::function<uncompressed_frame(uncompressed_frame)> frame_processor =
 					std::function<uncompressed_frame(uncompressed_frame)>()
 	);
+	// Runs the processors in order on every frame decoded to planar YCbCr (skips RGB conversion both ways)
+	int main(int argc, char *argv[], std::vector<ycbcr_processor> ycbcr_processors);
 }
@@ -0,0 +1,483 @@
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <easylogging++.h>
+#include "video_streamer.h"
+#include "jpeg_frame.h"
+#include "pixel_ops.h"
+#include "unique_fd.h"
+
+INITIALIZE_EASYLOGGINGPP
+
+/*
+ * Micro benchmarks of the hot paths. Every result is printed to stdout as a single line JSON object
+ * (JSON Lines), so that runs can be stored and compared by scripts:
+ *
+ *     {"benchmark":"compress_rgb","width":1920,"height":1080,"quality":80,"iterations":52,"mean_ns":...}
+ */
+
+namespace {
+	
+	struct options {
+		double min_time = 0.5;
+		std::string filter;
+		int port = 19850;
+	};
+	
+	// Accumulates "key":value pairs of a single result line
+	class result {
+		std::ostringstream m_out;
+	
+	public:
+		explicit result(const std::string &benchmark) {
+			m_out << "{\"benchmark\":\"" << benchmark << "\"";
+		}
+		result &field(const char *name, const std::string &value) {
+			m_out << ",\"" << name << "\":\"" << value << "\"";
+			return *this;
+		}
+		result &field(const char *name, const char *value) {
+			return field(name, std::string(value));
+		}
+		template<typename T> result &field(const char *name, T value) {
+			m_out << ",\"" << name << "\":" << value;
+			return *this;
+		}
+		void print() {
+			m_out << "}";
+			std::cout << m_out.str() << std::endl;
+		}
+		
+	};
+	
+	struct timing {
+		uint64_t iterations;
+		double mean_ns;
+		double min_ns;
+		double p50_ns;
+		double p99_ns;
+	};
+	
+	// Runs the operation (after a warm-up call) until min_time seconds have passed, at least 3 times
+	timing measure(const options &opts, const std::function<void()> &op) {
+		op();
+		std::vector<double> samples;
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(opts.min_time);
+		while (samples.size() < 3 || std::chrono::steady_clock::now() < deadline) {
+			auto start = std::chrono::steady_clock::now();
+			op();
+			samples.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+		}
+		double sum = 0;
+		for (auto sample : samples) {
+			sum += sample;
+		}
+		std::sort(samples.begin(), samples.end());
+		return timing {
+				samples.size(),
+				sum / samples.size(),
+				samples.front(),
+				samples[samples.size() / 2],
+				samples[std::min(samples.size() - 1, samples.size() * 99 / 100)]
+		};
+	}
+	
+	result &add_timing(result &r, const timing &t) {
+		return r.field("iterations", t.iterations)
+				.field("mean_ns", (uint64_t) t.mean_ns)
+				.field("min_ns", (uint64_t) t.min_ns)
+				.field("p50_ns", (uint64_t) t.p50_ns)
+				.field("p99_ns", (uint64_t) t.p99_ns);
+	}
+	
+	bool enabled(const options &opts, const char *benchmark) {
+		return opts.filter.empty() || std::string(benchmark).find(opts.filter) != std::string::npos;
+	}
+	
+	/*
+	 * Camera-like content: smooth gradients with a bit of deterministic noise. Flat or purely random
+	 * images would make libjpeg unrealistically fast or slow.
+	 */
+	video_streamer::uncompressed_frame test_image(int width, int height) {
+		video_streamer::uncompressed_frame frame(width, height, 3);
+		uint32_t noise = 12345;
+		for (int y = 0; y < height; y++) {
+			auto row = frame.row(y);
+			for (int x = 0; x < width; x++) {
+				noise = noise * 1103515245 + 12345;
+				int n = (int) ((noise >> 16) & 15) - 8;
+				row[x * 3] = (uint8_t) std::max(0, std::min(255, x * 255 / width + n));
+				row[x * 3 + 1] = (uint8_t) std::max(0, std::min(255, y * 255 / height + n));
+				row[x * 3 + 2] = (uint8_t) std::max(0, std::min(255, ((x + y) & 255) / 2 + 64 + n));
+			}
+		}
+		return frame;
+	}
+	
+	video_streamer::image_buffer test_yuyv(video_streamer::uncompressed_frame &rgb) {
+		video_streamer::image_buffer buffer((size_t) rgb.width() * rgb.height() * 2);
+		for (int y = 0; y < rgb.height(); y++) {
+			auto src = rgb.row(y);
+			auto dst = buffer.data() + (size_t) y * rgb.width() * 2;
+			for (int x = 0; x < rgb.width(); x++) {
+				int r = src[x * 3], g = src[x * 3 + 1], b = src[x * 3 + 2];
+				dst[x * 2] = (uint8_t) ((77 * r + 150 * g + 29 * b) >> 8);
+				dst[x * 2 + 1] = (uint8_t) (x & 1 ?
+						(128 * r - 107 * g - 21 * b + 32768) >> 8 : (-43 * r - 85 * g + 128 * b + 32768) >> 8);
+			}
+		}
+		return buffer;
+	}
+	
+	const int resolutions[][2] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+	const int qualities[] = { 50, 80, 95 };
+	
+	void bench_codec(const options &opts) {
+		for (auto &resolution : resolutions) {
+			int width = resolution[0], height = resolution[1];
+			auto rgb = test_image(width, height);
+			auto yuyv = test_yuyv(rgb);
+			for (auto quality : qualities) {
+				size_t size = 0;
+				if (enabled(opts, "compress_rgb")) {
+					auto t = measure(opts, [&] {
+						video_streamer::jpeg_frame frame(rgb, JCS_RGB, 3, quality);
+						size = frame.buffer().size();
+					});
+					result r("compress_rgb");
+					r.field("width", width).field("height", height).field("quality", quality);
+					add_timing(r, t).field("bytes", size).print();
+				}
+				if (enabled(opts, "compress_yuv422")) {
+					auto t = measure(opts, [&] {
+						video_streamer::jpeg_frame frame(
+								yuyv, width, height, width * 2, video_streamer::yuv422_layout::YUYV, quality
+						);
+						size = frame.buffer().size();
+					});
+					result r("compress_yuv422");
+					r.field("width", width).field("height", height).field("quality", quality);
+					add_timing(r, t).field("bytes", size).print();
+				}
+				if (enabled(opts, "uncompress")) {
+					video_streamer::jpeg_frame encoded(rgb, JCS_RGB, 3, quality);
+					for (int scale_denom : { 1, 4 }) {
+						auto t = measure(opts, [&] {
+							auto frame = encoded.uncompress(JCS_RGB, 3, scale_denom);
+						});
+						result r("uncompress");
+						r.field("width", width).field("height", height).field("quality", quality)
+								.field("scale_denom", scale_denom);
+						add_timing(r, t).field("bytes", encoded.buffer().size()).print();
+					}
+				}
+			}
+		}
+	}
+	
+	/*
+	 * Checkouts of decompressors from the codec cache by several threads at once. "held" codecs are
+	 * checked out by every thread at the same time, holding more than the thread cache keeps
+	 * goes through the shared pool.
+	 */
+	void bench_codec_cache(const options &opts) {
+		if (!enabled(opts, "libjpeg_checkout")) return;
+		unsigned int max_threads = std::max(4u, std::thread::hardware_concurrency());
+		for (unsigned int threads = 1; threads <= max_threads; threads *= 2) {
+			for (int held : { 1, 4 }) {
+				const int rounds = 100000;
+				auto before = video_streamer::libjpeg_instance<video_streamer::jpeg_decompressor_impl>::stats();
+				auto t = measure(opts, [&] {
+					std::vector<std::thread> workers;
+					for (unsigned int i = 0; i < threads; i++) {
+						workers.emplace_back([held] {
+							for (int round = 0; round < rounds; round++) {
+								video_streamer::libjpeg_instance<video_streamer::jpeg_decompressor_impl> instances[4];
+								for (int j = 0; j < held; j++) {
+									instances[j].get();
+								}
+							}
+						});
+					}
+					for (auto &worker : workers) {
+						worker.join();
+					}
+				});
+				auto after = video_streamer::libjpeg_instance<video_streamer::jpeg_decompressor_impl>::stats();
+				result r("libjpeg_checkout");
+				r.field("threads", threads).field("held", held);
+				add_timing(r, t)
+						.field("ns_per_checkout", t.mean_ns / ((double) rounds * held))
+						.field("created", after.created - before.created)
+						.field("shared_hits", after.shared_hits - before.shared_hits)
+						.field("discarded", after.discarded - before.discarded)
+						.print();
+			}
+		}
+	}
+	
+	void bench_pixels(const options &opts) {
+		if (!enabled(opts, "pixel_access")) return;
+		for (int bytes_per_pixel : { 1, 3, 4 }) {
+			video_streamer::uncompressed_frame frame(1920, 1080, bytes_per_pixel);
+			memset(frame.buffer().data(), 0x5A, frame.buffer().size());
+			auto t = measure(opts, [&frame] {
+				for (int y = 0; y < frame.height(); y++) {
+					for (int x = 0; x < frame.width(); x++) {
+						frame.set_pixel(x, y, ~frame.pixel(x, y));
+					}
+				}
+			});
+			result r("pixel_access");
+			r.field("width", frame.width()).field("height", frame.height()).field("bytes_per_pixel", bytes_per_pixel);
+			add_timing(r, t)
+					.field("mpixels_per_second", (double) frame.width() * frame.height() * 1000.0 / t.mean_ns)
+					.print();
+		}
+		if (!enabled(opts, "pixel_ops")) return;
+		video_streamer::uncompressed_frame frame(1920, 1080, 3);
+		video_streamer::uncompressed_frame copy(1920, 1080, 3);
+		video_streamer::uncompressed_frame overlay(1920, 1080, 4);
+		memset(frame.buffer().data(), 0x5A, frame.buffer().size());
+		memset(overlay.buffer().data(), 0x80, overlay.buffer().size());
+		std::pair<const char*, std::function<void()>> operations[] = {
+				{ "fill", [&frame] { video_streamer::fill_rect(frame, 0, 0, 1920, 1080, 0x123456); } },
+				{ "blit", [&frame, &copy] { video_streamer::blit(frame, copy, 0, 0); } },
+				{ "scale_720p", [&frame] { video_streamer::scale_bilinear(frame, 1280, 720); } },
+				{ "rgb_to_ycbcr", [&frame] { video_streamer::rgb_to_ycbcr(frame); } },
+				{ "ycbcr_to_rgb", [&frame] { video_streamer::ycbcr_to_rgb(frame); } },
+				{ "overlay_rgba", [&frame, &overlay] { video_streamer::overlay_rgba(overlay, frame, 0, 0); } }
+		};
+		for (auto &operation : operations) {
+			auto t = measure(opts, operation.second);
+			result r("pixel_ops");
+			r.field("operation", operation.first).field("kernel", video_streamer::pixel_kernel_name())
+					.field("width", frame.width()).field("height", frame.height());
+			add_timing(r, t)
+					.field("mpixels_per_second", (double) frame.width() * frame.height() * 1000.0 / t.mean_ns)
+					.print();
+		}
+	}
+	
+	// Loopback clients of the fan-out benchmark. Fast clients are drained by a thread, the slow one never reads.
+	class loopback_clients {
+		std::vector<video_streamer::posix::unique_fd> m_sockets;
+		video_streamer::posix::unique_fd m_epoll;
+		std::atomic<bool> m_running;
+		std::atomic<uint64_t> m_bytes_received;
+		std::thread m_thread;
+		
+		void drain() {
+			static thread_local uint8_t buffer[256 * 1024];
+			epoll_event events[64];
+			while (m_running) {
+				int count = epoll_wait(m_epoll, events, 64, 10);
+				for (int i = 0; i < count; i++) {
+					ssize_t r;
+					while ((r = recv(events[i].data.fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+						m_bytes_received.fetch_add((uint64_t) r, std::memory_order_relaxed);
+					}
+				}
+			}
+		}
+	
+	public:
+		std::string slow_client_address;
+		
+		loopback_clients(): m_epoll(epoll_create1(EPOLL_CLOEXEC)), m_running(true), m_bytes_received(0) {
+		}
+		~loopback_clients() {
+			m_running = false;
+			if (m_thread.joinable()) {
+				m_thread.join();
+			}
+		}
+		
+		void connect(video_streamer::stream_server &server, int port, int count, bool slow) {
+			sockaddr_in addr = {};
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons((uint16_t) port);
+			addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			for (int i = 0; i < count + (slow ? 1 : 0); i++) {
+				video_streamer::posix::unique_fd fd(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+				bool is_slow = i == count;
+				if (is_slow) {
+					int size = 4096;
+					setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+				}
+				if (fd < 0 || ::connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0) {
+					throw video_streamer::stream_server_exception(std::string("connect() failed: ") + strerror(errno));
+				}
+				// Anything but an HTTP request makes the server choose the raw protocol without waiting
+				if (::send(fd, "\n", 1, MSG_NOSIGNAL) != 1) {
+					throw video_streamer::stream_server_exception(std::string("send() failed: ") + strerror(errno));
+				}
+				if (is_slow) {
+					sockaddr_in local = {};
+					socklen_t local_size = sizeof(local);
+					getsockname(fd, (sockaddr*) &local, &local_size);
+					slow_client_address = "127.0.0.1:" + std::to_string(ntohs(local.sin_port));
+				} else {
+					epoll_event event = {};
+					event.events = EPOLLIN;
+					event.data.fd = fd;
+					epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event);
+				}
+				m_sockets.emplace_back(std::move(fd));
+				// The listen backlog is short, let the server accept before it overflows
+				while (server.client_count() + 4 < m_sockets.size()) {
+					std::this_thread::yield();
+				}
+			}
+			while (server.client_count() < m_sockets.size()) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			m_thread = std::thread([this] {
+				drain();
+			});
+		}
+		
+		uint64_t bytes_received() const {
+			return m_bytes_received.load(std::memory_order_relaxed);
+		}
+		
+	};
+	
+	bool ensure_file_limit(rlim_t count) {
+		rlimit limit = {};
+		if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return false;
+		if (limit.rlim_cur >= count) return true;
+		limit.rlim_cur = std::min(count, limit.rlim_max);
+		return setrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur >= count;
+	}
+	
+	/*
+	 * Fan-out of frames from stream_server::send() to loopback clients. send_ns is the cost paid
+	 * by the producing thread, delivered_mb_per_second is what the fast clients actually received
+	 * and the frames dropped for the slow client show the backpressure at work.
+	 */
+	void bench_fan_out(const options &opts) {
+		if (!enabled(opts, "fan_out")) return;
+		const size_t frame_size = 100 * 1024;
+		const int frames = 300;
+		auto frame = std::make_shared<video_streamer::image_buffer>(frame_size);
+		memset(frame->data(), 0xA5, frame_size);
+		int port = opts.port;
+		for (int clients : { 1, 10, 100, 1000 }) {
+			result r("fan_out");
+			r.field("clients", clients).field("slow_clients", 1).field("frame_bytes", frame_size);
+			if (!ensure_file_limit((rlim_t) clients * 2 + 64)) {
+				r.field("skipped", "RLIMIT_NOFILE is too low").print();
+				continue;
+			}
+			video_streamer::stream_server server({ "127.0.0.1:" + std::to_string(port++) });
+			loopback_clients peers;
+			peers.connect(server, port - 1, clients, true);
+			// Let the raw protocol of every client be detected before measuring
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			
+			std::vector<double> send_ns;
+			send_ns.reserve(frames);
+			auto start = std::chrono::steady_clock::now();
+			auto period = std::chrono::microseconds(1000000 / 60);
+			for (int i = 0; i < frames; i++) {
+				auto send_start = std::chrono::steady_clock::now();
+				video_streamer::frame_metadata metadata;
+				metadata.index = (uint64_t) i;
+				metadata.timestamp = send_start;
+				server.send(frame, metadata);
+				send_ns.push_back(std::chrono::duration<double, std::nano>(
+						std::chrono::steady_clock::now() - send_start
+				).count());
+				// Camera-like pacing (60 FPS), so that drops mean the fan-out can't keep up
+				std::this_thread::sleep_until(start + period * (i + 1));
+			}
+			// Wait for the fast clients to receive what is still queued
+			uint64_t received = 0;
+			auto idle_since = std::chrono::steady_clock::now();
+			while (std::chrono::steady_clock::now() - idle_since < std::chrono::milliseconds(200)) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				auto now_received = peers.bytes_received();
+				if (now_received != received) {
+					received = now_received;
+					idle_since = std::chrono::steady_clock::now();
+				}
+			}
+			auto elapsed = std::chrono::duration<double>(idle_since - start).count();
+			uint64_t fast_sent = 0, fast_dropped = 0, slow_sent = 0, slow_dropped = 0;
+			for (auto &client : server.client_stats()) {
+				if (client.address == peers.slow_client_address) {
+					slow_sent += client.frames_sent;
+					slow_dropped += client.frames_dropped;
+				} else {
+					fast_sent += client.frames_sent;
+					fast_dropped += client.frames_dropped;
+				}
+			}
+			auto latency = server.latency();
+			std::sort(send_ns.begin(), send_ns.end());
+			double send_sum = 0;
+			for (auto ns : send_ns) {
+				send_sum += ns;
+			}
+			r.field("frames", frames)
+					.field("send_mean_ns", (uint64_t) (send_sum / send_ns.size()))
+					.field("send_p99_ns", (uint64_t) send_ns[send_ns.size() * 99 / 100])
+					.field("delivered_mb_per_second", (double) received / elapsed / 1e6)
+					.field("fast_frames_sent", fast_sent)
+					.field("fast_frames_dropped", fast_dropped)
+					.field("slow_frames_sent", slow_sent)
+					.field("slow_frames_dropped", slow_dropped)
+					.field("capture_to_wire_p50_us", latency.capture_to_wire.percentile(0.5))
+					.field("capture_to_wire_p99_us", latency.capture_to_wire.percentile(0.99))
+					.print();
+		}
+	}
+	
+}
+
+int main(int argc, char *argv[]) {
+	options opts;
+	for (auto i = 1; i < argc; i++) {
+		std::string arg(argv[i]);
+		if (arg == "--min-time" && i < argc - 1) {
+			opts.min_time = atof(argv[++i]);
+		} else if (arg == "--filter" && i < argc - 1) {
+			opts.filter = argv[++i];
+		} else if (arg == "--port" && i < argc - 1) {
+			opts.port = atoi(argv[++i]);
+		} else {
+			std::cerr << "Usage: " << argv[0] << " [--min-time SECONDS] [--filter NAME] [--port NNN]" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	// Keep stdout for results only
+	el::Configurations conf;
+	conf.setGlobally(el::ConfigurationType::ToStandardOutput, "false");
+	conf.setGlobally(el::ConfigurationType::ToFile, "false");
+	el::Loggers::setDefaultConfigurations(conf, true);
+	
+	try {
+		bench_codec(opts);
+		bench_codec_cache(opts);
+		bench_pixels(opts);
+		bench_fan_out(opts);
+	} catch (std::exception &e) {
+		std::cerr << "Benchmark failed: " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
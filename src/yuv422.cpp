@@ -0,0 +1,164 @@
+#include "yuv422.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VIDEO_STREAMER_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VIDEO_STREAMER_NEON 1
+#endif
+
+namespace {
+	
+	/*
+	 * The kernels split a row into luma and "first/second chroma" planes. luma_first tells
+	 * whether luma occupies even bytes (YUYV, YVYU) or odd bytes (UYVY, VYUY).
+	 * The caller swaps the chroma planes for YVYU and VYUY.
+	 */
+	typedef void (*deinterleave_kernel)(
+			const uint8_t *src, uint8_t *y, uint8_t *c0, uint8_t *c1, int pairs, bool luma_first
+	);
+	
+	void deinterleave_scalar(const uint8_t *src, uint8_t *y, uint8_t *c0, uint8_t *c1, int pairs, bool luma_first) {
+		int luma = luma_first ? 0 : 1;
+		int chroma = luma_first ? 1 : 0;
+		for (int i = 0; i < pairs; i++) {
+			y[2 * i] = src[4 * i + luma];
+			y[2 * i + 1] = src[4 * i + luma + 2];
+			c0[i] = src[4 * i + chroma];
+			c1[i] = src[4 * i + chroma + 2];
+		}
+	}
+	
+#ifdef VIDEO_STREAMER_X86
+	
+	__attribute__((target("sse2")))
+	void deinterleave_sse2(const uint8_t *src, uint8_t *y, uint8_t *c0, uint8_t *c1, int pairs, bool luma_first) {
+		const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+		int i = 0;
+		// 16 pixels (32 bytes) per iteration
+		for (; i + 8 <= pairs; i += 8) {
+			__m128i a = _mm_loadu_si128((const __m128i*) (src + 4 * i));
+			__m128i b = _mm_loadu_si128((const __m128i*) (src + 4 * i + 16));
+			__m128i luma_a, luma_b, chroma_a, chroma_b;
+			if (luma_first) {
+				luma_a = _mm_and_si128(a, low_bytes);
+				luma_b = _mm_and_si128(b, low_bytes);
+				chroma_a = _mm_srli_epi16(a, 8);
+				chroma_b = _mm_srli_epi16(b, 8);
+			} else {
+				luma_a = _mm_srli_epi16(a, 8);
+				luma_b = _mm_srli_epi16(b, 8);
+				chroma_a = _mm_and_si128(a, low_bytes);
+				chroma_b = _mm_and_si128(b, low_bytes);
+			}
+			_mm_storeu_si128((__m128i*) (y + 2 * i), _mm_packus_epi16(luma_a, luma_b));
+			__m128i chroma = _mm_packus_epi16(chroma_a, chroma_b);
+			__m128i first = _mm_and_si128(chroma, low_bytes);
+			__m128i second = _mm_srli_epi16(chroma, 8);
+			__m128i planes = _mm_packus_epi16(first, second);
+			_mm_storel_epi64((__m128i*) (c0 + i), planes);
+			_mm_storel_epi64((__m128i*) (c1 + i), _mm_srli_si128(planes, 8));
+		}
+		deinterleave_scalar(src + 4 * i, y + 2 * i, c0 + i, c1 + i, pairs - i, luma_first);
+	}
+	
+	__attribute__((target("avx2")))
+	void deinterleave_avx2(const uint8_t *src, uint8_t *y, uint8_t *c0, uint8_t *c1, int pairs, bool luma_first) {
+		const __m256i low_bytes = _mm256_set1_epi16(0x00FF);
+		int i = 0;
+		// 32 pixels (64 bytes) per iteration, packs work inside 128-bit lanes so fix the order with permutes
+		for (; i + 16 <= pairs; i += 16) {
+			__m256i a = _mm256_loadu_si256((const __m256i*) (src + 4 * i));
+			__m256i b = _mm256_loadu_si256((const __m256i*) (src + 4 * i + 32));
+			__m256i luma_a, luma_b, chroma_a, chroma_b;
+			if (luma_first) {
+				luma_a = _mm256_and_si256(a, low_bytes);
+				luma_b = _mm256_and_si256(b, low_bytes);
+				chroma_a = _mm256_srli_epi16(a, 8);
+				chroma_b = _mm256_srli_epi16(b, 8);
+			} else {
+				luma_a = _mm256_srli_epi16(a, 8);
+				luma_b = _mm256_srli_epi16(b, 8);
+				chroma_a = _mm256_and_si256(a, low_bytes);
+				chroma_b = _mm256_and_si256(b, low_bytes);
+			}
+			__m256i luma = _mm256_permute4x64_epi64(_mm256_packus_epi16(luma_a, luma_b), 0xD8);
+			_mm256_storeu_si256((__m256i*) (y + 2 * i), luma);
+			__m256i chroma = _mm256_permute4x64_epi64(_mm256_packus_epi16(chroma_a, chroma_b), 0xD8);
+			__m256i first = _mm256_and_si256(chroma, low_bytes);
+			__m256i second = _mm256_srli_epi16(chroma, 8);
+			__m256i planes = _mm256_permute4x64_epi64(_mm256_packus_epi16(first, second), 0xD8);
+			_mm_storeu_si128((__m128i*) (c0 + i), _mm256_castsi256_si128(planes));
+			_mm_storeu_si128((__m128i*) (c1 + i), _mm256_extracti128_si256(planes, 1));
+		}
+		deinterleave_sse2(src + 4 * i, y + 2 * i, c0 + i, c1 + i, pairs - i, luma_first);
+	}
+	
+#endif
+	
+#ifdef VIDEO_STREAMER_NEON
+	
+	void deinterleave_neon(const uint8_t *src, uint8_t *y, uint8_t *c0, uint8_t *c1, int pairs, bool luma_first) {
+		int i = 0;
+		// 32 pixels (64 bytes) per iteration, vld4 splits the bytes by their position in a pixel pair
+		for (; i + 16 <= pairs; i += 16) {
+			uint8x16x4_t pixels = vld4q_u8(src + 4 * i);
+			uint8x16x2_t luma;
+			if (luma_first) {
+				luma.val[0] = pixels.val[0];
+				luma.val[1] = pixels.val[2];
+				vst1q_u8(c0 + i, pixels.val[1]);
+				vst1q_u8(c1 + i, pixels.val[3]);
+			} else {
+				luma.val[0] = pixels.val[1];
+				luma.val[1] = pixels.val[3];
+				vst1q_u8(c0 + i, pixels.val[0]);
+				vst1q_u8(c1 + i, pixels.val[2]);
+			}
+			vst2q_u8(y + 2 * i, luma);
+		}
+		deinterleave_scalar(src + 4 * i, y + 2 * i, c0 + i, c1 + i, pairs - i, luma_first);
+	}
+	
+#endif
+	
+	struct kernel_info {
+		deinterleave_kernel kernel;
+		const char *name;
+	};
+	
+	kernel_info select_kernel() {
+#ifdef VIDEO_STREAMER_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			return kernel_info { deinterleave_avx2, "AVX2" };
+		}
+		if (__builtin_cpu_supports("sse2")) {
+			return kernel_info { deinterleave_sse2, "SSE2" };
+		}
+#endif
+#ifdef VIDEO_STREAMER_NEON
+		return kernel_info { deinterleave_neon, "NEON" };
+#endif
+		return kernel_info { deinterleave_scalar, "scalar" };
+	}
+	
+	const kernel_info &current_kernel() {
+		static const kernel_info kernel = select_kernel();
+		return kernel;
+	}
+	
+}
+
+void video_streamer::deinterleave_yuv422(
+		const uint8_t *src, uint8_t *y, uint8_t *cb, uint8_t *cr, int width, yuv422_layout layout
+) {
+	bool luma_first = layout == yuv422_layout::YUYV || layout == yuv422_layout::YVYU;
+	bool cb_first = layout == yuv422_layout::YUYV || layout == yuv422_layout::UYVY;
+	current_kernel().kernel(src, y, cb_first ? cb : cr, cb_first ? cr : cb, width / 2, luma_first);
+}
+
+const char *video_streamer::yuv422_kernel_name() {
+	return current_kernel().name;
+}
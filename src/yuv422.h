@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+
+namespace video_streamer {
+	
+	// Byte order of packed 4:2:2 pixel pairs
+	enum class yuv422_layout {
+		YUYV,
+		YVYU,
+		UYVY,
+		VYUY
+	};
+	
+	/*
+	 * Splits one row of packed 4:2:2 pixels into planar Y, Cb and Cr rows.
+	 * width is in pixels and must be even; Cb and Cr receive width / 2 samples.
+	 * Uses AVX2, SSE2 or NEON when available (selected at runtime).
+	 */
+	void deinterleave_yuv422(
+			const uint8_t *src, uint8_t *y, uint8_t *cb, uint8_t *cr, int width, yuv422_layout layout
+	);
+	
+	// Name of the instruction set used by deinterleave_yuv422
+	const char *yuv422_kernel_name();
+	
+}